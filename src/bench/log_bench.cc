@@ -0,0 +1,280 @@
+//* log_bench: 各种场景下 LOG() 的单次调用延迟分位数和多线程总吞吐量
+//* 结果以 JSON 输出, 便于在不同版本之间对比
+//* usage: log_bench [--threads N] [--iterations N] [--cases a,b,...]
+//*                  [--output file] [--async] [--log-dir dir]
+//* cases: disabled, stderr, fatal, file
+#include "log_what.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace what::Log;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  int threads{
+      static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))};
+  long iterations{100000};
+  std::string cases{"disabled,stderr,fatal,file"};
+  const char *output{nullptr};
+  const char *log_dir{"/tmp"};
+  bool async{false};
+};
+
+struct Result {
+  std::string name;
+  int threads;
+  long calls;
+  double seconds;
+  long p50_ns;
+  long p99_ns;
+  long p999_ns;
+  long max_ns;
+};
+
+//* 所有线程就绪后同时开始, 避免把线程创建时间算进吞吐量
+class StartGate {
+public:
+  explicit StartGate(int count) : waiting(count) {}
+
+  void Arrive_and_wait() {
+    waiting.fetch_sub(1, std::memory_order_acq_rel);
+    while (waiting.load(std::memory_order_acquire) > 0) {
+      std::this_thread::yield();
+    }
+  }
+
+private:
+  std::atomic<int> waiting;
+};
+
+auto percentile(const std::vector<long> &sorted, double p) -> long {
+  if (sorted.empty()) {
+    return 0;
+  }
+  auto index = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1));
+  return sorted[index];
+}
+
+void log_once(const std::string &name, long i) {
+  if (name == "fatal") {
+    LOG(FATAL, "bench fatal %ld", i);
+  } else if (name == "disabled") {
+    LOG(INFO, "bench disabled %ld %s", i, "payload");
+  } else {
+    LOG(INFO, "bench %s %ld %s", name.c_str(), i, "payload");
+  }
+}
+
+auto run_case(const std::string &name, int threads, long iterations)
+    -> Result {
+  std::vector<std::vector<long>> latencies(threads);
+  std::vector<Clock::time_point> begins(threads), ends(threads);
+  StartGate gate(threads);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      auto &samples = latencies[t];
+      samples.reserve(iterations);
+      gate.Arrive_and_wait();
+      begins[t] = Clock::now();
+      for (long i = 0; i < iterations; ++i) {
+        auto start = Clock::now();
+        log_once(name, i);
+        auto stop = Clock::now();
+        samples.push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+                .count());
+      }
+      ends[t] = Clock::now();
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  flush();
+
+  std::vector<long> all;
+  all.reserve(iterations * threads);
+  for (auto &samples : latencies) {
+    all.insert(all.end(), samples.begin(), samples.end());
+  }
+  std::sort(all.begin(), all.end());
+  auto begin = *std::min_element(begins.begin(), begins.end());
+  auto end = *std::max_element(ends.begin(), ends.end());
+
+  Result result;
+  result.name = name;
+  result.threads = threads;
+  result.calls = static_cast<long>(all.size());
+  result.seconds = std::chrono::duration<double>(end - begin).count();
+  result.p50_ns = percentile(all, 0.50);
+  result.p99_ns = percentile(all, 0.99);
+  result.p999_ns = percentile(all, 0.999);
+  result.max_ns = all.empty() ? 0 : all.back();
+  return result;
+}
+
+//* 每个场景需要的 sink 配置; callback 无法移除, 所以 file 必须放在最后
+auto prepare_case(const std::string &name, const Options &options) -> bool {
+  if (name == "disabled") {
+    Set_stderr_verbosity(Verbosity::VerbosityWARNING);
+  } else if (name == "stderr") {
+    Set_stderr_verbosity(Verbosity::VerbosityMESSAGE);
+  } else if (name == "fatal") {
+    Set_stderr_verbosity(Verbosity::VerbosityFATAL);
+  } else if (name == "file") {
+    //* 比 FATAL 更低的级别: stderr 不再输出任何日志
+    Set_stderr_verbosity(static_cast<Verbosity>(
+        static_cast<int>(Verbosity::VerbosityFATAL) - 1));
+    auto path = std::string(options.log_dir) + "/log_bench.log";
+    return Add_file(path.c_str(), FileMode::Truncate,
+                    Verbosity::VerbosityMESSAGE);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+auto split(const std::string &list) -> std::vector<std::string> {
+  std::vector<std::string> items;
+  size_t start = 0;
+  while (start <= list.size()) {
+    auto comma = list.find(',', start);
+    if (comma == std::string::npos) {
+      comma = list.size();
+    }
+    if (comma > start) {
+      items.emplace_back(list, start, comma - start);
+    }
+    start = comma + 1;
+  }
+  //* file 会注册 callback, 之后的场景都会受影响
+  std::stable_partition(items.begin(), items.end(),
+                        [](const std::string &item) { return item != "file"; });
+  return items;
+}
+
+auto parse_options(int argc, char *argv[], Options &options) -> bool {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--threads" && has_value) {
+      options.threads = std::max(1, atoi(argv[++i]));
+    } else if (arg == "--iterations" && has_value) {
+      options.iterations = std::max(1L, atol(argv[++i]));
+    } else if (arg == "--cases" && has_value) {
+      options.cases = argv[++i];
+    } else if (arg == "--output" && has_value) {
+      options.output = argv[++i];
+    } else if (arg == "--log-dir" && has_value) {
+      options.log_dir = argv[++i];
+    } else if (arg == "--async") {
+      options.async = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+//* 两次 Clock::now() 本身的开销, 所有延迟都包含这一部分
+auto timer_overhead() -> long {
+  std::vector<long> samples(10000);
+  for (auto &sample : samples) {
+    auto start = Clock::now();
+    auto stop = Clock::now();
+    sample =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start)
+            .count();
+  }
+  std::sort(samples.begin(), samples.end());
+  return percentile(samples, 0.50);
+}
+
+void print_json(FILE *out, const Options &options,
+                const std::vector<Result> &results) {
+  fprintf(out, "{\n  \"mode\": \"%s\",\n  \"iterations\": %ld,\n",
+          options.async ? "async" : "sync", options.iterations);
+  fprintf(out, "  \"hardware_threads\": %u,\n  \"timer_overhead_ns\": %ld,\n",
+          std::thread::hardware_concurrency(), timer_overhead());
+  fprintf(out, "  \"results\": [\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    auto &result = results[i];
+    fprintf(out,
+            "    {\"case\": \"%s\", \"threads\": %d, \"calls\": %ld, "
+            "\"seconds\": %.6f, \"calls_per_sec\": %.0f, \"p50_ns\": %ld, "
+            "\"p99_ns\": %ld, \"p999_ns\": %ld, \"max_ns\": %ld}%s\n",
+            result.name.c_str(), result.threads, result.calls, result.seconds,
+            result.seconds > 0 ? result.calls / result.seconds : 0.0,
+            result.p50_ns, result.p99_ns, result.p999_ns, result.max_ns,
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    fprintf(stderr,
+            "usage: %s [--threads N] [--iterations N] [--cases a,b,...] "
+            "[--output file] [--async] [--log-dir dir]\n",
+            argv[0]);
+    return 1;
+  }
+  FILE *out = options.output ? fopen(options.output, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "failed to open file: %s\n", options.output);
+    return 1;
+  }
+
+  //* 日志本身写到 /dev/null, 测的是库的开销而不是终端的速度
+  int saved_stderr = dup(STDERR_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDERR_FILENO);
+  close(null_fd);
+
+  Init(argc, argv);
+  if (options.async) {
+    Start_async(64 * 1024);
+  }
+
+  std::vector<Result> results;
+  for (auto &name : split(options.cases)) {
+    if (!prepare_case(name, options)) {
+      dprintf(saved_stderr, "unknown or failed case: %s\n", name.c_str());
+      return 1;
+    }
+    //* fatal 会抓取调用栈, 迭代次数减少两个数量级
+    auto iterations =
+        name == "fatal" ? std::max(10L, options.iterations / 100)
+                        : options.iterations;
+    for (int threads = 1;; threads = std::min(threads * 2, options.threads)) {
+      results.push_back(run_case(name, threads, iterations));
+      auto &result = results.back();
+      dprintf(saved_stderr, "%-9s threads=%-3d p50=%ldns p99=%ldns "
+              "p99.9=%ldns %.0f calls/s\n",
+              name.c_str(), threads, result.p50_ns, result.p99_ns,
+              result.p999_ns, result.calls / result.seconds);
+      if (threads == options.threads) {
+        break;
+      }
+    }
+  }
+
+  print_json(out, options, results);
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,165 @@
+//* format_prefix() 与旧版 snprintf 实现的对比: 逐字节校验输出并统计耗时
+//* g++ -O2 -I.. prefix_bench.cc ../log_what.cc -o prefix_bench
+#include "log_what.hpp"
+#include <chrono>
+#include <initializer_list>
+#include <string.h>
+#include <time.h>
+
+using namespace what::Log;
+
+namespace {
+
+//* 修改前的 print_prefix(), 时间和线程名由参数传入
+void legacy_format_prefix(char *prefix, size_t prefix_len, Verbosity verbosity,
+                          const char *file, unsigned int line,
+                          long ms_since_epoch, long uptime_ms,
+                          const char *thread_name) {
+  tm time_info;
+  auto sec_since_epoch = time_t(ms_since_epoch / 1000);
+  localtime_r(&sec_since_epoch, &time_info);
+
+  auto uptime_sec = static_cast<double>(uptime_ms) / 1000.0;
+
+  //*文件
+  file = filename(file);
+
+  //* verbosity name
+  char verbosity_level[6];
+  const char *verbosity_name = get_verbosity_name(verbosity);
+  if (verbosity_name) {
+    snprintf(verbosity_level, sizeof verbosity_level - 1, "%s", verbosity_name);
+  } else {
+    ASSERT(verbosity_name != nullptr, "fail to get verbosity name!");
+  }
+
+  //* print prefix
+  size_t pos = 0;
+  // print date
+  int bytes;
+  bytes =
+      snprintf(prefix, prefix_len, "%04d-%02d-%02d ", 1900 + time_info.tm_year,
+               1 + time_info.tm_mon, time_info.tm_mday);
+  if (bytes > 0)
+    pos += bytes;
+
+  if (pos < prefix_len) {
+    // print time
+    bytes = snprintf(prefix + pos, prefix_len - pos, "%02d:%02d:%02d.%03ld ",
+                     time_info.tm_hour, time_info.tm_min, time_info.tm_sec,
+                     ms_since_epoch % 1000);
+    if (bytes > 0)
+      pos += bytes;
+  }
+
+  if (pos < prefix_len) {
+    // print uptime
+    bytes = snprintf(prefix + pos, prefix_len - pos, "(%8.3fs)", uptime_sec);
+    if (bytes > 0) {
+      pos += bytes;
+    }
+  }
+
+  if (pos < prefix_len) {
+    // print thread name
+    bytes = snprintf(prefix + pos, prefix_len - pos, "[%-*s]", THREADNAME_WIDTH,
+                     thread_name);
+    if (bytes > 0)
+      pos += bytes;
+  }
+
+  if (pos < prefix_len) {
+    // print filename linenumber
+    //文件名字过长会被裁减
+    char shortened_filename[FILENAME_WIDTH + 1];
+    snprintf(shortened_filename, FILENAME_WIDTH + 1, "%s", file);
+    bytes = snprintf(prefix + pos, prefix_len - pos, "%*s:%-5u ",
+                     FILENAME_WIDTH, shortened_filename, line);
+    if (bytes > 0)
+      pos += bytes;
+  }
+
+  if (pos < prefix_len) {
+    // print verbosity
+    bytes = snprintf(prefix + pos, prefix_len - pos, "%6s| ", verbosity_level);
+    if (bytes > 0)
+      pos += bytes;
+  }
+}
+
+
+struct Case {
+  const char *file;
+  unsigned int line;
+  const char *thread_name;
+};
+
+const Case cases[] = {
+    {"/root/project/src/server/request_handler.cc", 42, "worker-1"},
+    {"main.cc", 7, "    7F5C11B8A3C0"},
+    {"a_really_long_file_name_that_gets_cut.cpp", 123456, "little test"},
+    {"relative/dir\\windows.cpp", 99999, "thread_name_max16"},
+    {"", 0, ""},
+};
+
+const Verbosity verbosities[] = {
+    Verbosity::VerbosityFATAL, Verbosity::VerbosityERROR,
+    Verbosity::VerbosityWARNING, Verbosity::VerbosityINFO,
+    Verbosity::VerbosityMESSAGE};
+
+//* 时间按 7ms 递增, 覆盖跨秒, 跨天以及很长的 uptime
+auto time_at(long i, long base, long &uptime_ms) -> long {
+  uptime_ms = i * 7 + (i % 3 == 0 ? 0 : 123456789L);
+  return base + i * 7;
+}
+
+template <typename F> auto run(const char *name, long iterations, F f) -> double {
+  char prefix[PREFIX_WIDTH];
+  auto t0 = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; ++i) {
+    auto &c = cases[i % (sizeof cases / sizeof cases[0])];
+    long uptime_ms;
+    auto ms = time_at(i, 1707538535973L, uptime_ms);
+    f(prefix, sizeof prefix, verbosities[i % 5], c.file, c.line, ms,
+      uptime_ms, c.thread_name);
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  auto ns = std::chrono::duration<double, std::nano>(t1 - t0).count() /
+            static_cast<double>(iterations);
+  printf("%-8s %8.1f ns/prefix\n", name, ns);
+  return ns;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+
+  //* 逐字节对比, 包括被截断的短缓冲区
+  long mismatches = 0;
+  for (long i = 0; i < 200000; ++i) {
+    auto &c = cases[i % (sizeof cases / sizeof cases[0])];
+    long uptime_ms;
+    auto ms = time_at(i * 131, 1707538535973L, uptime_ms);
+    for (size_t len : {size_t(PREFIX_WIDTH), size_t(40), size_t(1)}) {
+      char expected[PREFIX_WIDTH] = {0}, actual[PREFIX_WIDTH] = {0};
+      legacy_format_prefix(expected, len, verbosities[i % 5], c.file, c.line,
+                           ms, uptime_ms, c.thread_name);
+      format_prefix(actual, len, verbosities[i % 5], c.file, c.line, ms,
+                    uptime_ms, c.thread_name);
+      if (strcmp(expected, actual) != 0) {
+        if (mismatches++ < 5) {
+          printf("mismatch:\n  legacy: [%s]\n  cached: [%s]\n", expected,
+                 actual);
+        }
+      }
+    }
+  }
+  printf("byte-for-byte: %s (%ld mismatches)\n", mismatches ? "FAIL" : "OK",
+         mismatches);
+
+  auto legacy = run("legacy", iterations, legacy_format_prefix);
+  auto cached = run("cached", iterations, format_prefix);
+  printf("speedup  %8.2fx\n", legacy / cached);
+  return mismatches ? 1 : 0;
+}
@@ -1,2 +1,8 @@
-g++ -shared -g -fPIC log_what.cc -o liblog.so
+g++ -shared -g -fPIC -DLOG_WHAT_HAS_ZLIB log_what.cc -o liblog.so -lz -lrt
 mv liblog.so /lib/
+g++ -g log_what_decode.cc -o log_what_decode -llog
+mv log_what_decode /usr/local/bin/
+g++ -g log_what_collector.cc -o log_what_collector -llog
+mv log_what_collector /usr/local/bin/
+g++ -g log_what_query.cc -o log_what_query -llog
+mv log_what_query /usr/local/bin/
@@ -1,18 +1,47 @@
 #include "log_what.hpp"
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <charconv>
+#include <cmath>
 #include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <ctype.h>
 #include <cxxabi.h>
+#include <dirent.h>
 #include <dlfcn.h>
 #include <execinfo.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <functional>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <pthread.h>
-#include <regex>
 #include <signal.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <thread>
+#include <unordered_map>
+#include <unistd.h>
 #include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#ifdef LOG_WHAT_HAS_ZLIB
+#include <zlib.h>
+#endif
 
 namespace what::Log {
 
@@ -23,7 +52,7 @@ Text::Text(Text &&other) {
 }
 
 Text::~Text() {
-  if (!__str) {
+  if (__str) {
     free(__str);
     __str = nullptr;
   }
@@ -44,20 +73,109 @@ const auto start_time = std::chrono::steady_clock::now();
 
 static CallBacks callBacks{};
 
+//* 以下计数由 locker 保护
+static uint64_t message_counts[STATS_VERBOSITY_BUCKETS];
+static uint64_t stderr_bytes{0};
+static uint64_t batch_max{0};
+static std::atomic<uint64_t> queue_full_count{0};
+
 static signal_t internal_sig{};
 
-static bool need_flush{false};
+static std::atomic<bool> need_flush{false};
 static int8_t MAXVERBOSITY_TO_STDERR{
     static_cast<int8_t>(Verbosity::VerbosityINFO)};
+
+std::atomic<int> flush_interval_ms{0};
+
+std::atomic<int> sink_max_verbosity{static_cast<int>(Verbosity::VerbosityINFO)};
+std::atomic<int> effective_max_verbosity{
+    static_cast<int>(Verbosity::VerbosityINFO)};
+//* 飞行记录器关闭时比任何级别都小
+std::atomic<int> recorder_max_verbosity{INT_MIN};
+//* 没有匹配 vmodule 规则的调用点的级别: sink 与飞行记录器中最大的
+static std::atomic<int> default_site_verbosity{
+    static_cast<int>(Verbosity::VerbosityINFO)};
+//* 所有 vmodule 规则中最大的级别, 没有规则时为 INT_MIN
+static std::atomic<int> module_max_verbosity{INT_MIN};
 static std::thread *flush_thread{nullptr};
+static std::mutex flush_mutex;
+static std::condition_variable flush_cv;
+static std::atomic<bool> flush_stop{false};
 
 static std::recursive_mutex locker;
 
+static void update_effective_verbosity();
+static auto flush_immediately() -> bool;
+static void mark_need_flush(bool lazy = false);
+static void stop_flush_thread();
+static void flush_sinks();
+static void close_callBacks();
+static void prepare_path(const char *path_in, char *path);
+static void stop_compress_thread();
+static void stop_config_thread();
+static void maybe_report_stats();
+static void maybe_report_suppressed();
+static void anchor_ticks_now();
+static void invalidate_sites();
+static void parse_args(int argc, char *argv[]);
+static auto module_verbosity(const char *file) -> int;
+static void crash_drain_backend();
+static void crash_dump_flight_recorder();
+static auto render_stacktrace(void *const *frames, int num_frames, int skip)
+    -> std::string;
+
+#define MAX_STACK_FRAMES 128
+//* log_stacktrace() 抓取的第 0 帧是它自身, 渲染时跳过
+#define LOG_STACKTRACE_SKIP 1
+
+static thread_local bool is_backend_thread{false};
+static thread_local bool is_sink_worker{false};
+//* collector 转交的日志已经有前缀, 不再输出到 stderr 和共享内存
+static thread_local bool is_shm_collector{false};
+//* 当前线程正在 log_message() 中(持有 locker), 此时再打的日志必须同步输出
+static thread_local int dispatch_depth{0};
+
+//* 日志库自身的堆分配次数, 稳态下每次 LOG() 都不应该增加
+static std::atomic<unsigned long> allocations{0};
+
+//* 自身统计: 计数一直开启, 计时需要 Enable_stats(true)
+enum class StatsPoint { LockWait, Enqueue, QueueLatency, Dispatch, Flush };
+
+static std::atomic<bool> stats_enabled{false};
+static void stats_record(StatsPoint point, uint64_t ns);
+
+static auto stats_now() -> uint64_t {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
+
+//* 关闭计时时返回 0, stats_finish() 随之什么都不做
+static auto stats_start() -> uint64_t {
+  return stats_enabled.load(std::memory_order_relaxed) ? stats_now() : 0;
+}
+
+static void stats_finish(StatsPoint point, uint64_t start) {
+  if (start) {
+    auto now = stats_now();
+    stats_record(point, now > start ? now - start : 0);
+  }
+}
+
 static pthread_key_t thread_key;                       // Thread Specific Data 
 static pthread_once_t thread_once = PTHREAD_ONCE_INIT; // call only once
+//* 与线程名一起创建, 保存 LOG_SCOPE 的嵌套深度和 LOG_TIMER 的累计
+static pthread_key_t scope_key;
+static void scope_thread_exit(void *data);
+
+//* 生产者每次都要拷贝线程名, 缓存起来避免 pthread_getspecific 和 snprintf
+static thread_local char thread_name_cache[THREADNAME_WIDTH + 1];
+static thread_local bool thread_name_cached{false};
 
 void Init(int argc, char *argv[]) {
-  // TODO parse args
+  anchor_ticks_now();
+  parse_args(argc, argv);
   install_signal_handler(internal_sig);
   atexit(exit);
 }
@@ -72,487 +190,5800 @@ void write_to_stderr(const char *str, size_t len) {
 void call_default_signal_handler(
     int signal_number) { //恢复我们的处理函数后杀死进程
   struct sigaction sig_action;
+  memset(&sig_action, 0, sizeof sig_action);
   sigemptyset(&sig_action.sa_mask);
   sig_action.sa_handler = SIG_DFL;
   sigaction(signal_number, &sig_action, nullptr);
   kill(getpid(), signal_number);
 }
 
+//* 信号处理函数中只能使用预分配的内存和 write(), 不能 malloc 也不能等锁
+#define CRASH_BUFFER_SIZE 1024
+#define CRASH_MAX_FRAMES 64
+#define ALT_STACK_SIZE (64 * 1024)
+
+class CrashWriter {
+public:
+  void Append(const char *str) {
+    while (*str && len < sizeof buffer) {
+      buffer[len++] = *str++;
+    }
+  }
+
+  void Append(const char *data, size_t size) {
+    for (size_t i = 0; i < size && len < sizeof buffer; ++i) {
+      buffer[len++] = data[i];
+    }
+  }
+
+  void Append_dec(long long value) {
+    if (value < 0) {
+      Append("-");
+    }
+    Append_unsigned(value < 0 ? 0ULL - static_cast<unsigned long long>(value)
+                              : static_cast<unsigned long long>(value),
+                    10);
+  }
+
+  void Append_unsigned(unsigned long long value, unsigned base) {
+    char digits[64];
+    int count = 0;
+    do {
+      digits[count++] = "0123456789abcdef"[value % base];
+      value /= base;
+    } while (value);
+    while (count > 0 && len < sizeof buffer) {
+      buffer[len++] = digits[--count];
+    }
+  }
+
+  void Append_hex(uintptr_t value) {
+    Append("0x");
+    for (int shift = sizeof(value) * 8 - 4; shift >= 0; shift -= 4) {
+      if (len < sizeof buffer) {
+        buffer[len++] = "0123456789abcdef"[(value >> shift) & 0xF];
+      }
+    }
+  }
+
+  //* copy_fd 不为 -1 时同时写到 copy_fd
+  void Write(int fd, int copy_fd = -1) {
+    auto ignore = write(fd, buffer, len);
+    if (copy_fd != -1) {
+      ignore = write(copy_fd, buffer, len);
+    }
+    (void)ignore;
+    len = 0;
+  }
+
+private:
+  char buffer[CRASH_BUFFER_SIZE];
+  size_t len{0};
+};
+
+static CrashWriter crash_writer;
+static void *crash_frames[CRASH_MAX_FRAMES];
+//* 多个线程同时崩溃时只有第一个输出, 其余的等待进程被杀死
+static std::atomic<long> crash_thread{0};
+static std::atomic<bool> signal_handler_installed{false};
+
+//* 每个线程一个备用信号栈, 栈溢出导致的 SIGSEGV 也能执行处理函数
+class AltStack {
+public:
+  AltStack() {
+    memory = malloc(ALT_STACK_SIZE);
+    if (!memory) {
+      return;
+    }
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    stack_t stack{};
+    stack.ss_sp = memory;
+    stack.ss_size = ALT_STACK_SIZE;
+    if (sigaltstack(&stack, nullptr) == -1) {
+      free(memory);
+      memory = nullptr;
+    }
+  }
+
+  AltStack(const AltStack &) = delete;
+  auto operator=(const AltStack &) -> AltStack & = delete;
+
+  ~AltStack() {
+    if (memory) {
+      stack_t stack{};
+      stack.ss_flags = SS_DISABLE;
+      sigaltstack(&stack, nullptr);
+      free(memory);
+    }
+  }
+
+private:
+  void *memory{nullptr};
+};
+
+static void ensure_alt_stack() {
+  if (signal_handler_installed.load(std::memory_order_relaxed)) {
+    static thread_local AltStack alt_stack;
+    (void)alt_stack;
+  }
+}
+
+//* 信号处理函数中不能加锁, 也不能调用用户的 flush callback: 由这个线程执行 flush(),
+//* 处理函数只往管道写一个字节, 最多等待 CRASH_FLUSH_MS
+#define CRASH_FLUSH_MS 500
+
+static int crash_flush_pipe[2]{-1, -1};
+static std::atomic<bool> crash_flushed{false};
+
+static void crash_flush_loop() {
+  char byte;
+  while (true) {
+    auto bytes = read(crash_flush_pipe[0], &byte, 1);
+    if (bytes == 1) {
+      flush();
+      crash_flushed.store(true, std::memory_order_release);
+    } else if (bytes == -1 && errno == EINTR) {
+      continue;
+    } else {
+      break;
+    }
+  }
+}
+
+static void start_crash_flush_thread() {
+  static std::once_flag once;
+  std::call_once(once, [] {
+    if (pipe2(crash_flush_pipe, O_CLOEXEC) == -1) {
+      crash_flush_pipe[1] = -1;
+      return;
+    }
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    std::thread(crash_flush_loop).detach();
+  });
+}
+
+//* 只使用 write() 和 nanosleep(); 持有 locker 的线程卡住时超时返回
+static void crash_flush() {
+  if (crash_flush_pipe[1] == -1) {
+    return;
+  }
+  crash_flushed.store(false, std::memory_order_relaxed);
+  char byte = 0;
+  if (write(crash_flush_pipe[1], &byte, 1) != 1) {
+    return;
+  }
+  timespec interval{0, 1000000};
+  for (int i = 0;
+       i < CRASH_FLUSH_MS && !crash_flushed.load(std::memory_order_acquire);
+       ++i) {
+    nanosleep(&interval, nullptr);
+  }
+}
+
+static auto signal_name(int signum) -> const char * {
+  switch (signum) {
+  case SIGABRT:
+    return "SIGABRT";
+  case SIGSEGV:
+    return "SIGSEGV";
+  case SIGBUS:
+    return "SIGBUS";
+  case SIGFPE:
+    return "SIGFPE";
+  case SIGILL:
+    return "SIGILL";
+  default:
+    return "UNKNOWN SIGNAL";
+  }
+}
+
 void signal_handler(int signum, siginfo_t *siginfo, void *ptr) {
-  char *signame = "UNKNOW SIG";
-  if (signum == SIGABRT)
-    signame = "SIGABRT";
-//! unsafe code may cause dead lock
-#ifdef UNSAFE
-  write_to_stderr(TERMINAL_RESET);
-  write_to_stderr(TERMINAL_BOLD);
-  write_to_stderr(TERMINAL_LIGHT_RED);
-  write_to_stderr("\n");
-  write_to_stderr("log_what capture a sig:");
-  write_to_stderr(signame);
-  write_to_stderr("\n");
-  write_to_stderr(TERMINAL_RESET);
-  flush();
+  long tid = static_cast<long>(syscall(SYS_gettid));
+  long expected = 0;
+  if (!crash_thread.compare_exchange_strong(expected, tid)) {
+    if (expected == tid) { //* 处理函数自身崩溃
+      call_default_signal_handler(signum);
+      return;
+    }
+    while (true) {
+      pause();
+    }
+  }
 
-  char prefix[PREFIX_WIDTH];
-  print_prefix(prefix, PREFIX_WIDTH, Verbosity::VerbosityFATAL, "", 0);
-  auto message = Message{
-      .verbosity = Verbosity::VerbosityFATAL,
-      .file = nullptr,
-      .line = 0,
-      .prefix = prefix,
-      .raw_message = signame,
-  };
-  log_message(Verbosity::VerbosityFATAL, message);
-  flush();
+  //* 先把缓冲中的日志写出去; 当前线程持有 locker 时 sink 的状态不可信, 跳过
+  if (dispatch_depth == 0) {
+    crash_drain_backend();
+    crash_flush();
+  }
 
-#endif
+  crash_writer.Append(TERMINAL_RESET);
+  crash_writer.Append(TERMINAL_BOLD);
+  crash_writer.Append(TERMINAL_LIGHT_RED);
+  crash_writer.Append("\nlog_what caught signal ");
+  crash_writer.Append(signal_name(signum));
+  if (siginfo && siginfo->si_code > 0) { //* 由内核产生, 而不是 kill()/raise()
+    crash_writer.Append(" at address ");
+    crash_writer.Append_hex(reinterpret_cast<uintptr_t>(siginfo->si_addr));
+  }
+  crash_writer.Append(" in thread ");
+  crash_writer.Append(thread_name_cached ? thread_name_cache : "?");
+  crash_writer.Append(" (");
+  crash_writer.Append_dec(tid);
+  crash_writer.Append(")\n");
+  crash_writer.Append(TERMINAL_RESET);
+  crash_writer.Append("Stack Trace:\n");
+  crash_writer.Write(STDERR_FILENO);
+
+  //* backtrace() 已在安装处理函数时预热, 这里不会再加载 libgcc
+  auto frames = backtrace(crash_frames, CRASH_MAX_FRAMES);
+  backtrace_symbols_fd(crash_frames, frames, STDERR_FILENO);
+
+  crash_dump_flight_recorder();
+  (void)ptr;
 
   call_default_signal_handler(signum);
 }
 
 void install_signal_handler(const signal_t &sig) {
+  //* 第一次调用 backtrace() 会加载 libgcc_s 并分配内存, 不能放在信号处理函数里
+  backtrace(crash_frames, 1);
+  signal_handler_installed.store(true, std::memory_order_relaxed);
+  ensure_alt_stack();
+  start_crash_flush_thread();
+
   struct sigaction sig_action;
+  memset(&sig_action, 0, sizeof sig_action);
   sigemptyset(&sig_action.sa_mask);
-  sig_action.sa_flags |= SA_SIGINFO;
+  sig_action.sa_flags = SA_SIGINFO | SA_ONSTACK;
   sig_action.sa_sigaction = signal_handler;
-  if (sig.sigabrt) {
-    ASSERT(sigaction(SIGABRT, &sig_action, NULL) != -1,
-           "failed to install sigabrt");
+  const std::pair<bool, int> signals[] = {
+      {sig.sigabrt, SIGABRT}, {sig.sigsegv, SIGSEGV}, {sig.sigbus, SIGBUS},
+      {sig.sigfpe, SIGFPE},   {sig.sigill, SIGILL},
+  };
+  for (auto &[enabled, signum] : signals) {
+    if (enabled) {
+      ASSERT(sigaction(signum, &sig_action, NULL) != -1,
+             "failed to install signal handler");
+    }
   }
-  // TODO wait for more signal
 }
 
 void exit() {
+  Report_suppressed();
+  Report_scopes();
   LOG(INFO, "on exit");
+  stop_config_thread();
+  Stop_shm_collector();
+  Stop_async();
+  stop_flush_thread();
   flush();
-  if (!flush_thread)
-    delete flush_thread;
+  close_callBacks();
+  stop_compress_thread();
 }
 
-void init_thread_key() { pthread_key_create(&thread_key, free); }
+void init_thread_key() {
+  pthread_key_create(&thread_key, free);
+  pthread_key_create(&scope_key, scope_thread_exit);
+}
 
 void Set_thread_name(const char *str) {
   ASSERT(str != nullptr, "str should not be null !");
   pthread_once(&thread_once, init_thread_key);
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  free(pthread_getspecific(thread_key));
   pthread_setspecific(thread_key, strdup(str)); // strdup->malloc->free
+  thread_name_cached = false;
 }
 
-void log(Verbosity verbosity, const char *file, unsigned int line,
-         const char *format, ...) {
-  va_list list;
-  va_start(list, format);
-  auto buffer = vastextprint(format, list);
-  log_to_everywhere(verbosity, file, line, buffer.C_str());
-  va_end(list);
-}
+/*********************************allocation*********************************/
+auto allocation_count() -> unsigned long { return allocations.load(); }
 
-void raw_log(Verbosity verbosity, const char *file, unsigned int line,
-             const char *format, ...) {
-  va_list list;
-  va_start(list, format);
-  auto buffer = vastextprint(format, list);
-  auto message = Message{
-      .verbosity = verbosity,
-      .file = file,
-      .line = line,
-      .prefix = nullptr,
-      .raw_message = buffer.C_str(),
-  };
-  log_message(verbosity, message);
-  va_end(list);
+static auto counted_malloc(size_t size) -> void * {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return malloc(size);
 }
 
-void log_to_everywhere(Verbosity verbosity, const char *file, unsigned line,
-                       const char *message) {
-  char prefix[PREFIX_WIDTH];
-  print_prefix(prefix, sizeof prefix, verbosity, file, line);
-  Message real_message = Message{verbosity, file, line, prefix, message};
-  log_message(verbosity, real_message);
-}
+#define SPILL_BLOCK_SIZE (16 * 1024)
+#define SPILL_POOL_BLOCKS 64
+#define SPILL_UNPOOLED UINT32_MAX
 
-void do_replacements(
-    const std::vector<std::pair<std::string, std::string>> &replacements,
-    std::string &str) {
-  for (auto &&p : replacements) {
-    if (p.first.size() <= p.second.size()) {
-      // On gcc, "type_name<std::string>()" is "std::string"
-      continue;
+//* 超长消息使用的内存块, data 之前保存所属的池下标
+struct SpillHeader {
+  uint32_t index;
+  uint32_t next;
+  alignas(16) char data[];
+};
+
+//* 固定容量的无锁空闲链表, head 的高32位是防止 ABA 的版本号
+class SpillPool {
+public:
+  auto Get(size_t size) -> char * {
+    if (size > SPILL_BLOCK_SIZE) {
+      return make_block(size, SPILL_UNPOOLED);
+    }
+    auto head = free_head.load(std::memory_order_acquire);
+    while (static_cast<uint32_t>(head) != 0) {
+      auto index = static_cast<uint32_t>(head) - 1;
+      auto next = (head & 0xFFFFFFFF00000000ULL) + (1ULL << 32) +
+                  blocks[index]->next;
+      if (free_head.compare_exchange_weak(head, next,
+                                          std::memory_order_acq_rel)) {
+        return blocks[index]->data;
+      }
+    }
+    auto index = created.fetch_add(1, std::memory_order_relaxed);
+    if (index >= SPILL_POOL_BLOCKS) {
+      return make_block(size, SPILL_UNPOOLED);
     }
+    auto data = make_block(SPILL_BLOCK_SIZE, index);
+    blocks[index] = header_of(data);
+    return data;
+  }
 
-    size_t it;
-    while ((it = str.find(p.first)) != std::string::npos) {
-      str.replace(it, p.first.size(), p.second);
+  void Put(char *data) {
+    auto header = header_of(data);
+    if (header->index == SPILL_UNPOOLED) {
+      free(header);
+      return;
     }
+    auto head = free_head.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+      header->next = static_cast<uint32_t>(head);
+      next = (head & 0xFFFFFFFF00000000ULL) + (1ULL << 32) + header->index + 1;
+    } while (!free_head.compare_exchange_weak(head, next,
+                                              std::memory_order_acq_rel));
   }
-}
 
-static const std::vector<std::pair<std::string, std::string>> REPLACE_LIST = {
+private:
+  static auto header_of(char *data) -> SpillHeader * {
+    return reinterpret_cast<SpillHeader *>(data - offsetof(SpillHeader, data));
+  }
 
-    {"std::__1::", "std::"},
-    {"__thiscall ", ""},
-    {"__cdecl ", ""},
+  static auto make_block(size_t size, uint32_t index) -> char * {
+    auto header = reinterpret_cast<SpillHeader *>(
+        counted_malloc(sizeof(SpillHeader) + size));
+    header->index = index;
+    return header->data;
+  }
+
+  SpillHeader *blocks[SPILL_POOL_BLOCKS]{};
+  std::atomic<uint64_t> free_head{0}; //* 低32位为 下标+1, 0 表示空
+  std::atomic<uint32_t> created{0};
 };
 
-std::string prettify_stacktrace(const std::string &input) {
-  std::string output = input;
+static SpillPool spill_pool;
 
-  do_replacements(s_user_stack_cleanups, output);
-  do_replacements(REPLACE_LIST, output);
+static auto alloc_spill(size_t size) -> char * { return spill_pool.Get(size); }
 
-  try {
-    std::regex std_allocator_re(R"(,\s*std::allocator<[^<>]+>)");
-    output = std::regex_replace(output, std_allocator_re, std::string(""));
+static void release_spill(char *data) { spill_pool.Put(data); }
 
-    std::regex template_spaces_re(R"(<\s*([^<> ]+)\s*>)");
-    output =
-        std::regex_replace(output, template_spaces_re, std::string("<$1>"));
-  } catch (std::regex_error &) {
-    // Probably old GCC.
-  }
+#define ARENA_SIZE (8 * 1024)
 
-  return output;
-}
+//* 线程私有的格式化区域, 按栈的方式分配, 回调里再次打日志也不会覆盖外层消息
+struct ThreadArena {
+  char data[ARENA_SIZE];
+  size_t used{0};
+};
 
-std::string stacktrace_as_stdstring(int skip) {
-  // From https://gist.github.com/fmela/591333
-  void *callstack[128];
-  const auto max_frames = sizeof(callstack) / sizeof(callstack[0]);
-  int num_frames = backtrace(callstack, max_frames);
-  char **symbols = backtrace_symbols(callstack, num_frames);
+static thread_local ThreadArena *arena{nullptr};
 
-  std::string result;
-  // Print stack traces so the most relevant ones are written last
-  // Rationale:
-  // http://yellerapp.com/posts/2015-01-22-upside-down-stacktraces.html
-  for (int i = num_frames - 1; i >= skip; --i) {
-    char buf[1024];
-    Dl_info info;
-    if (dladdr(callstack[i], &info) && info.dli_sname) {
-      char *demangled = NULL;
-      int status = -1;
-      if (info.dli_sname[0] == '_') {
-        demangled = abi::__cxa_demangle(info.dli_sname, 0, 0, &status);
-      }
-      snprintf(buf, sizeof(buf), "%-3d %*p %s + %zd\n", i - skip,
-               int(2 + sizeof(void *) * 2), callstack[i],
-               status == 0           ? demangled
-               : info.dli_sname == 0 ? symbols[i]
-                                     : info.dli_sname,
-               static_cast<char *>(callstack[i]) -
-                   static_cast<char *>(info.dli_saddr));
-      free(demangled);
+//* 格式化结果, 析构时归还 arena 或内存池
+class Formatted {
+public:
+  Formatted(const char *format, va_list list) {
+    if (!arena) { //* 每个线程只分配一次
+      arena = new (counted_malloc(sizeof(ThreadArena))) ThreadArena;
+    }
+    mark = arena->used;
+    auto room = ARENA_SIZE - mark;
+    va_list copy;
+    va_copy(copy, list);
+    int bytes = vsnprintf(arena->data + mark, room, format, copy);
+    va_end(copy);
+    ASSERT(bytes >= 0, "bad format fatal");
+    if (static_cast<size_t>(bytes) < room) {
+      __str = arena->data + mark;
+      arena->used += bytes + 1;
     } else {
-      snprintf(buf, sizeof(buf), "%-3d %*p %s\n", i - skip,
-               int(2 + sizeof(void *) * 2), callstack[i], symbols[i]);
+      __str = alloc_spill(bytes + 1);
+      spilled = true;
+      vsnprintf(__str, bytes + 1, format, list);
     }
-    result += buf;
   }
-  free(symbols);
 
-  if (num_frames == max_frames) {
-    result = "[truncated]\n" + result;
-  }
+  Formatted(const Formatted &) = delete;
+  auto operator=(const Formatted &) -> Formatted & = delete;
 
-  if (!result.empty() && result[result.size() - 1] == '\n') {
-    result.resize(result.size() - 1);
+  ~Formatted() {
+    if (spilled) {
+      release_spill(__str);
+    } else {
+      arena->used = mark;
+    }
   }
 
-  return prettify_stacktrace(result);
-}
+  auto C_str() const -> const char * { return __str; }
 
-auto get_stack() -> Text {
-  auto str = stacktrace_as_stdstring(4);
-  return Text(strdup(str.c_str()));
-}
+private:
+  char *__str;
+  size_t mark;
+  bool spilled{false};
+};
 
-void handle_fatal_message() {
-  auto text = get_stack();
-  if (!text.Is_empty())
-    RAW_LOG(ERROR, "Stack Trace:\n %s", text.C_str());
-  return;
+/*********************************batch writer*********************************/
+//* 单个 sink 的写缓冲, 攒够 write_batch_bytes 或 flush 时才交给内核
+static std::atomic<size_t> write_batch_bytes{64 * 1024};
+
+void Set_write_batch(size_t batch_bytes) {
+  write_batch_bytes.store(std::max(batch_bytes, static_cast<size_t>(512)));
 }
 
-void log_message(Verbosity verbosity, Message &message) {
-  std::unique_lock<std::recursive_mutex> lock(locker);
-  if (verbosity == Verbosity::VerbosityFATAL) {
-    handle_fatal_message();
-  }
-  if (static_cast<int8_t>(verbosity) <=
-      MAXVERBOSITY_TO_STDERR) { //* log to stderr
-    if (verbosity > Verbosity::VerbosityWARNING) {
-      fprintf(stderr, "%s%s%s%s%s\n", TERMINAL_RESET, TERMINAL_DIM,
-              message.prefix, message.raw_message, TERMINAL_RESET);
-    } else {
-      fprintf(stderr, "%s%s%s%s%s%s\n", TERMINAL_RESET, TERMINAL_DIM,
-              verbosity < Verbosity::VerbosityWARNING ? TERMINAL_RED
-                                                      : TERMINAL_YELLOW,
-              message.prefix, message.raw_message, TERMINAL_RESET);
+//* 把 iov 全部写出, 处理 EINTR 和部分写
+static auto write_all(int fd, iovec *iov, int count) -> bool {
+  while (count > 0) {
+    auto bytes = writev(fd, iov, std::min(count, IOV_MAX));
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
     }
-    if (flush_interval_ms == 0) {
-      fflush(stderr);
-    } else {
-      need_flush = true;
+    while (count > 0 && static_cast<size_t>(bytes) >= iov->iov_len) {
+      bytes -= iov->iov_len;
+      ++iov;
+      --count;
     }
-  }
-  for (auto &callBack : callBacks) { //* log to registered callback
-    if (verbosity <= callBack.max_verbosit) {
-      callBack.call_back(callBack.user_data, message);
-      if (flush_interval_ms == 0) {
-        if (callBack.flush) {
-          callBack.flush(callBack.user_data);
-        }
-      } else {
-        need_flush = true;
-      }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + bytes;
+      iov->iov_len -= bytes;
     }
   }
+  return true;
+}
 
-  if (flush_interval_ms != 0 && flush_thread == nullptr) {
-    flush_thread = new std::thread([] { // TODO require delete()
-      while (true) {
-        if (need_flush) {
-          flush();
-        } else {
-          std::this_thread::sleep_for(
-              std::chrono::milliseconds(flush_interval_ms));
-        }
-      }
-    });
-  }
+class BatchWriter {
+public:
+  explicit BatchWriter(int fd) : fd(fd) {}
 
-  if (message.verbosity == Verbosity::VerbosityFATAL) {
-    flush();
-    signal(SIGABRT, SIG_DFL);
+  BatchWriter(const BatchWriter &) = delete;
+  auto operator=(const BatchWriter &) -> BatchWriter & = delete;
+
+  ~BatchWriter() { free(buffer); }
+
+  //* 写入一条记录的若干片段; immediately 时连同缓冲区一起用一次 writev 写出
+  void Write(const iovec *pieces, int count, bool immediately) {
+    size_t total = 0;
+    for (int i = 0; i < count; ++i) {
+      total += pieces[i].iov_len;
+    }
+    if (!buffer) {
+      capacity = write_batch_bytes.load();
+      buffer = static_cast<char *>(counted_malloc(capacity));
+    }
+    if (!immediately && used + total <= capacity) {
+      for (int i = 0; i < count; ++i) {
+        memcpy(buffer + used, pieces[i].iov_base, pieces[i].iov_len);
+        used += pieces[i].iov_len;
+      }
+      return;
+    }
+    iovec iov[8];
+    int n = 0;
+    if (used) {
+      iov[n++] = iovec{buffer, used};
+    }
+    for (int i = 0; i < count && n < 8; ++i) {
+      iov[n++] = pieces[i];
+    }
+    write_all(fd, iov, n);
+    used = 0;
   }
-}
 
-// TODO
-auto get_verbosity_name(Verbosity verbosity) -> const char * {
-  switch (verbosity) {
-  case Verbosity::VerbosityERROR:
-    return "ERR";
-  case Verbosity::VerbosityINFO:
-    return "INFO";
-  case Verbosity::VerbosityFATAL:
-    return "FATL";
-  case Verbosity::VerbosityMESSAGE:
-    return "MES";
-  case Verbosity::VerbosityWARNING:
-    return "WARN";
-  default:
-    return nullptr;
+  void Flush() {
+    if (used) {
+      iovec iov{buffer, used};
+      write_all(fd, &iov, 1);
+      used = 0;
+    }
   }
-}
 
-void print_prefix(char *prefix, size_t prefix_len, Verbosity verbosity,
-                  const char *file, unsigned int line) {
-  //*线程
-  char thread_name[THREADNAME_WIDTH + 1] = {0};
-  get_thread_name(thread_name, sizeof thread_name);
+  auto Fd() const -> int { return fd; }
 
-  //*时间
-  tm time_info;
-  auto ms_since_epoch = std::chrono::duration_cast<std::chrono::milliseconds>(
-                            std::chrono::system_clock::now().time_since_epoch())
-                            .count();
-  auto sec_since_epoch = time_t(ms_since_epoch / 1000);
-  localtime_r(&sec_since_epoch, &time_info);
-
-  auto uptime_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                       std::chrono::steady_clock::now() - start_time)
-                       .count();
-  auto uptime_sec = static_cast<double>(uptime_ms) / 1000.0;
+  //* 写出缓冲区后切换到新的文件, 返回旧的 fd
+  auto Reset(int new_fd) -> int {
+    Flush();
+    auto old_fd = fd;
+    fd = new_fd;
+    return old_fd;
+  }
 
-  //*文件
-  file = filename(file);
+private:
+  int fd;
+  char *buffer{nullptr};
+  size_t capacity{0};
+  size_t used{0};
+};
 
-  //* verbosity name
-  char verbosity_level[6];
-  const char *verbosity_name = get_verbosity_name(verbosity);
-  if (verbosity_name) {
-    snprintf(verbosity_level, sizeof verbosity_level - 1, "%s", verbosity_name);
-  } else {
-    ASSERT(verbosity_name != nullptr, "fail to get verbosity name!");
-  }
+static BatchWriter stderr_writer(STDERR_FILENO);
 
-  //* print prefix
-  size_t pos = 0;
-  // print date
-  int bytes;
-  bytes =
-      snprintf(prefix, prefix_len, "%04d-%02d-%02d ", 1900 + time_info.tm_year,
-               1 + time_info.tm_mon, time_info.tm_mday);
-  if (bytes > 0)
-    pos += bytes;
-
-  if (pos < prefix_len) {
-    // print time
-    bytes = snprintf(prefix + pos, prefix_len - pos, "%02d:%02d:%02d.%03ld ",
-                     time_info.tm_hour, time_info.tm_min, time_info.tm_sec,
-                     ms_since_epoch % 1000);
-    if (bytes > 0)
-      pos += bytes;
+//* 每个 verbosity 在 stderr 上的颜色前缀, 只拼接一次
+struct StderrColors {
+  StderrColors() {
+    snprintf(error, sizeof error, "%s%s%s", TERMINAL_RESET, TERMINAL_DIM,
+             TERMINAL_RED);
+    snprintf(warning, sizeof warning, "%s%s%s", TERMINAL_RESET, TERMINAL_DIM,
+             TERMINAL_YELLOW);
+    snprintf(normal, sizeof normal, "%s%s", TERMINAL_RESET, TERMINAL_DIM);
+    snprintf(suffix, sizeof suffix, "%s\n", TERMINAL_RESET);
   }
 
-  if (pos < prefix_len) {
-    // print uptime
-    bytes = snprintf(prefix + pos, prefix_len - pos, "(%8.3fs)", uptime_sec);
-    if (bytes > 0) {
-      pos += bytes;
+  auto Prefix(Verbosity verbosity) const -> const char * {
+    if (verbosity < Verbosity::VerbosityWARNING) {
+      return error;
     }
+    return verbosity == Verbosity::VerbosityWARNING ? warning : normal;
   }
 
-  if (pos < prefix_len) {
-    // print thread name
-    bytes = snprintf(prefix + pos, prefix_len - pos, "[%-*s]", THREADNAME_WIDTH,
-                     thread_name);
-    if (bytes > 0)
-      pos += bytes;
-  }
+  char error[16];
+  char warning[16];
+  char normal[16];
+  char suffix[8];
+};
 
-  if (pos < prefix_len) {
-    // print filename linenumber
-    //文件名字过长会被裁减
-    char shortened_filename[FILENAME_WIDTH + 1];
-    snprintf(shortened_filename, FILENAME_WIDTH + 1, "%s", file);
-    bytes = snprintf(prefix + pos, prefix_len - pos, "%*s:%-5u ",
-                     FILENAME_WIDTH, shortened_filename, line);
-    if (bytes > 0)
-      pos += bytes;
-  }
+static const StderrColors stderr_colors;
 
-  if (pos < prefix_len) {
-    // print verbosity
-    bytes = snprintf(prefix + pos, prefix_len - pos, "%6s| ", verbosity_level);
-    if (bytes > 0)
-      pos += bytes;
-  }
+/*********************************timestamp*********************************/
+#define CALIBRATION_INTERVAL_MS 1000
+//* 第一次校准时基准至少要这么长, 否则比例误差太大
+#define CALIBRATION_MIN_MS 10
+
+//* 换算参数, 由 calibration_mutex 保护写入, 读取使用 seqlock
+struct TickCalibration {
+  uint64_t base_ticks;
+  int64_t base_mono_ns;
+  int64_t base_wall_ns;
+  double ns_per_tick;
+  uint64_t next_ticks; //* 超过它时需要重新校准
+};
+
+//* tsc_available 在 use_ticks 以 release 发布之前写入, 读 use_ticks 使用 acquire
+static std::atomic<bool> use_ticks{false};
+static std::atomic<bool> tsc_available{false};
+static std::atomic<uint32_t> calibration_seq{0};
+static TickCalibration calibration;
+static std::mutex calibration_mutex;
+//* Init() 时的基准, 比例总是从它算起, 基准越长越准确
+static uint64_t anchor_ticks;
+static int64_t anchor_mono_ns;
+static bool anchored{false};
+static std::atomic<uint64_t> calibration_count{0};
+static std::atomic<int64_t> last_drift_ns{0};
+static std::atomic<int64_t> max_drift_ns{0};
+
+static auto clock_ns(clockid_t clock) -> int64_t {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
 }
 
-void get_thread_name(char *thread_name, size_t thread_name_len) {
-  thread_name[thread_name_len - 1] = '\0';
+static auto detect_tsc() -> bool {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  //* CPUID 0x80000007 EDX bit 8: invariant TSC, 频率不随睿频和休眠变化
+  return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1u << 8));
+#else
+  return false;
+#endif
+}
+
+static auto read_ticks() -> uint64_t {
+#if defined(__x86_64__) || defined(__i386__)
+  if (tsc_available.load(std::memory_order_relaxed)) {
+    return __rdtsc();
+  }
+#endif
+  return static_cast<uint64_t>(clock_ns(CLOCK_MONOTONIC_COARSE));
+}
+
+static auto load_calibration() -> TickCalibration {
+  TickCalibration copy;
+  uint32_t before, after;
+  do {
+    before = calibration_seq.load(std::memory_order_acquire);
+    memcpy(&copy, &calibration, sizeof copy);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = calibration_seq.load(std::memory_order_relaxed);
+  } while ((before & 1) || before != after);
+  return copy;
+}
+
+static auto ticks_to_mono_ns(const TickCalibration &c, uint64_t ticks)
+    -> int64_t {
+  auto delta = static_cast<int64_t>(ticks - c.base_ticks);
+  return c.base_mono_ns + static_cast<int64_t>(delta * c.ns_per_tick);
+}
+
+//* 在 Init() 中调用, 只记录基准, 不等待
+static void anchor_ticks_now() {
+  std::unique_lock<std::mutex> lock(calibration_mutex);
+  if (anchored) {
+    return;
+  }
+  tsc_available.store(detect_tsc(), std::memory_order_relaxed);
+  anchor_ticks = read_ticks();
+  anchor_mono_ns = clock_ns(CLOCK_MONOTONIC);
+  anchored = true;
+}
+
+//* 需要持有 calibration_mutex; 重新对齐到当前的时钟, 比例从 Init() 的基准算起
+static void recalibrate_locked() {
+  auto ticks = read_ticks();
+  auto mono = clock_ns(CLOCK_MONOTONIC);
+  auto wall = clock_ns(CLOCK_REALTIME);
+  double ns_per_tick = 1.0;
+  if (tsc_available.load(std::memory_order_relaxed) && ticks > anchor_ticks) {
+    ns_per_tick = static_cast<double>(mono - anchor_mono_ns) /
+                  static_cast<double>(ticks - anchor_ticks);
+  }
+  if (calibration_count.load(std::memory_order_relaxed) > 0) {
+    auto drift = ticks_to_mono_ns(calibration, ticks) - mono;
+    last_drift_ns.store(drift, std::memory_order_relaxed);
+    if (std::llabs(drift) > std::llabs(max_drift_ns.load())) {
+      max_drift_ns.store(drift, std::memory_order_relaxed);
+    }
+  }
+  auto interval_ticks = static_cast<uint64_t>(
+      CALIBRATION_INTERVAL_MS * 1000000.0 / ns_per_tick);
+  calibration_seq.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  calibration = TickCalibration{ticks, mono, wall, ns_per_tick,
+                                ticks + interval_ticks};
+  calibration_seq.fetch_add(1, std::memory_order_release);
+  calibration_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+//* 换算一个在调用点读取的 tick; 到期时顺便重新校准(拿不到锁就下次再说)
+static void ticks_to_time(uint64_t ticks, long &ms_since_epoch,
+                          long &uptime_ms) {
+  auto c = load_calibration();
+  if (static_cast<int64_t>(ticks - c.next_ticks) > 0) {
+    std::unique_lock<std::mutex> lock(calibration_mutex, std::try_to_lock);
+    if (lock.owns_lock()) {
+      recalibrate_locked();
+      c = calibration;
+    }
+  }
+  auto mono = ticks_to_mono_ns(c, ticks);
+  auto start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      start_time.time_since_epoch())
+                      .count();
+  ms_since_epoch =
+      static_cast<long>((c.base_wall_ns + (mono - c.base_mono_ns)) / 1000000);
+  uptime_ms = static_cast<long>((mono - start_ns) / 1000000);
+}
+
+void Set_timestamp_source(TimestampSource source) {
+  if (source == TimestampSource::Clock) {
+    use_ticks.store(false, std::memory_order_relaxed);
+    return;
+  }
+  anchor_ticks_now();
+  double ns_per_tick;
+  {
+    std::unique_lock<std::mutex> lock(calibration_mutex);
+    //* Init() 之后立即调用时需要等基准足够长
+    if (tsc_available.load(std::memory_order_relaxed)) {
+      auto elapsed = clock_ns(CLOCK_MONOTONIC) - anchor_mono_ns;
+      if (elapsed < CALIBRATION_MIN_MS * 1000000LL) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(
+            CALIBRATION_MIN_MS * 1000000LL - elapsed));
+      }
+    }
+    recalibrate_locked();
+    ns_per_tick = calibration.ns_per_tick;
+  }
+  use_ticks.store(true, std::memory_order_release);
+  LOG(MESSAGE, "TIMESTAMP:%-*s ns/tick:%.6f", FILENAME_WIDTH,
+      tsc_available.load(std::memory_order_relaxed) ? "rdtsc"
+                                                     : "CLOCK_MONOTONIC_COARSE",
+      ns_per_tick);
+}
+
+auto Get_timestamp_calibration() -> TimestampCalibration {
+  auto c = load_calibration();
+  return TimestampCalibration{
+      .tsc = tsc_available.load(std::memory_order_relaxed),
+      .ns_per_tick = c.ns_per_tick,
+      .calibrations = calibration_count.load(std::memory_order_relaxed),
+      .last_drift_ns = last_drift_ns.load(std::memory_order_relaxed),
+      .max_drift_ns = max_drift_ns.load(std::memory_order_relaxed),
+  };
+}
+
+/*********************************async backend*********************************/
+//* 每条记录固定大小, 生产者直接在槽位内格式化, 超长的消息才会溢出到堆上
+#define RECORD_SIZE 512
+
+struct RecordHeader {
+  Verbosity verbosity;
+  unsigned int line;
+  const char *file;
+  bool with_prefix;
+  long ms_since_epoch;
+  long uptime_ms;
+  char thread_name[THREADNAME_WIDTH + 1];
+  const CallSite *site; //* 非空时 text 中保存的是编码后的参数
+  uint32_t args_size;
+  char *spill; //* inline 区域放不下时来自 alloc_spill(), 由后台线程归还
+  void **frames; //* log_stacktrace() 抓取的返回地址, 同样来自 alloc_spill()
+  int frame_count;
+  bool kv; //* LOG_KV 的记录: site->format 是消息, text 中是编码后的字段
+  uint64_t enqueue_ns; //* 开启计时时为开始写入队列的时间, 否则为 0
+  uint64_t ticks; //* 非 0 时时间戳尚未换算, 由后台线程填入上面两个时间
+};
+
+struct Record : RecordHeader {
+  char text[RECORD_SIZE - sizeof(RecordHeader)];
+
+  auto C_str() const -> const char * { return spill ? spill : text; }
+
+  auto Data() -> char * { return spill ? spill : text; }
+};
+
+struct alignas(64) Slot {
+  std::atomic<size_t> sequence;
+  Record record;
+};
+
+//* Dmitry Vyukov 的有界队列: 多个生产者用 CAS 抢占位置, 唯一的后台线程消费
+class RecordQueue {
+public:
+  explicit RecordQueue(size_t capacity)
+      : slots(new Slot[capacity]), mask(capacity - 1) {
+    for (size_t i = 0; i < capacity; ++i) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  RecordQueue(const RecordQueue &) = delete;
+  auto operator=(const RecordQueue &) -> RecordQueue & = delete;
+
+  ~RecordQueue() { delete[] slots; }
+
+  //* 抢占一个空槽位, 返回其位置; 队列满时返回 false
+  auto Try_acquire(size_t &pos) -> bool {
+    pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      auto &slot = slots[pos & mask];
+      auto seq = slot.sequence.load(std::memory_order_acquire);
+      auto dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (dif == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          return true;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  auto At(size_t pos) -> Record & { return slots[pos & mask].record; }
+
+  void Publish(size_t pos) {
+    slots[pos & mask].sequence.store(pos + 1, std::memory_order_release);
+  }
+
+  //* 以下只允许后台线程调用
+  auto Front() -> Record * {
+    auto &slot = slots[dequeue_pos & mask];
+    if (slot.sequence.load(std::memory_order_acquire) != dequeue_pos + 1) {
+      return nullptr;
+    }
+    return &slot.record;
+  }
+
+  void Pop() {
+    slots[dequeue_pos & mask].sequence.store(dequeue_pos + mask + 1,
+                                             std::memory_order_release);
+    ++dequeue_pos;
+    consumed.store(dequeue_pos, std::memory_order_release);
+  }
+
+  auto Tail() const -> size_t {
+    return enqueue_pos.load(std::memory_order_acquire);
+  }
+
+  auto Consumed() const -> size_t {
+    return consumed.load(std::memory_order_acquire);
+  }
+
+  auto Capacity() const -> size_t { return mask + 1; }
+
+private:
+  Slot *slots;
+  const size_t mask;
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) size_t dequeue_pos{0};
+  std::atomic<size_t> consumed{0};
+};
+
+//* Stop_async() 之后保留, 下一次 Start_async() 容量相同时复用, 否则释放
+static RecordQueue *record_queue{nullptr};
+static std::atomic<bool> async_running{false};
+//* 已经看到 async_running 并且还没有 publish 的生产者, Stop_async() 等它归零后才最后排空
+static std::atomic<int> async_producers{0};
+static std::atomic<bool> backend_stop{false};
+static std::atomic<bool> backend_sleeping{false};
+static std::thread *backend_thread{nullptr};
+//* 串行化 Start_async() 和 Stop_async(); 不能用 locker, 后台线程输出时需要它
+static std::mutex async_control_mutex;
+static std::mutex backend_mutex;
+static std::condition_variable backend_cv;
+static std::condition_variable drained_cv;
+
+//* 返回 true 时调用者可以使用 record_queue, 用完后调用 leave_async();
+//* 先登记再检查 async_running, 与 Stop_async() 的先清除再检查配对(都是 seq_cst)
+static auto enter_async() -> bool {
+  async_producers.fetch_add(1);
+  if (async_running.load()) {
+    return true;
+  }
+  async_producers.fetch_sub(1, std::memory_order_release);
+  return false;
+}
+
+static void leave_async() {
+  async_producers.fetch_sub(1, std::memory_order_release);
+}
+
+//* 同步模式下前缀马上要输出, TSC 的换算只能在调用线程完成
+static void current_time(long &ms_since_epoch, long &uptime_ms) {
+  if (use_ticks.load(std::memory_order_acquire)) {
+    ticks_to_time(read_ticks(), ms_since_epoch, uptime_ms);
+    return;
+  }
+  ms_since_epoch = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+  uptime_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::steady_clock::now() - start_time)
+                  .count();
+}
+
+//* 异步记录的时间戳: TSC 模式下只读一次 tick
+static void stamp_record(RecordHeader &record) {
+  if (use_ticks.load(std::memory_order_acquire)) {
+    record.ticks = read_ticks();
+  } else {
+    record.ticks = 0;
+    current_time(record.ms_since_epoch, record.uptime_ms);
+  }
+}
+
+static void cached_thread_name(char *thread_name) {
+  if (!thread_name_cached) {
+    get_thread_name(thread_name_cache, sizeof thread_name_cache);
+    thread_name_cached = true;
+    ensure_alt_stack();
+  }
+  memcpy(thread_name, thread_name_cache, sizeof thread_name_cache);
+}
+
+//* force 用于队列已满的情况, 否则只有后台线程深度睡眠时才需要唤醒
+static void wake_backend(bool force = false) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (force || backend_sleeping.load(std::memory_order_relaxed)) {
+    std::unique_lock<std::mutex> lock(backend_mutex);
+    backend_cv.notify_one();
+  }
+}
+
+static bool deferred_mode{false};
+
+void Set_deferred(bool enable) { deferred_mode = enable; }
+
+#define RENDER_SIZE (16 * 1024)
+
+//* 在后台线程上把延迟记录渲染成文本, 超长时借用内存池
+static auto render_record(Record &record, char *&spill) -> const char * {
+  static thread_local char rendered[RENDER_SIZE];
+  auto render = record.kv ? format_kv : format_deferred;
+  if (auto site_render = record.site->render.load(std::memory_order_relaxed);
+      site_render && !record.kv) {
+    render = site_render;
+  }
+  auto bytes = render(record.site->format, record.Data(), record.args_size,
+                      rendered, sizeof rendered);
+  if (bytes < sizeof rendered) {
+    return rendered;
+  }
+  spill = alloc_spill(bytes + 1);
+  render(record.site->format, record.Data(), record.args_size, spill,
+         bytes + 1);
+  return spill;
+}
+
+static void dispatch_record(Record &record) {
+  stats_finish(StatsPoint::QueueLatency, record.enqueue_ns);
+  if (record.ticks) {
+    ticks_to_time(record.ticks, record.ms_since_epoch, record.uptime_ms);
+  }
+  char *rendered_spill = nullptr;
+  auto text =
+      record.site ? render_record(record, rendered_spill) : record.C_str();
+  //* 符号解析放在后台线程上做
+  std::string with_stack;
+  if (record.frames) {
+    with_stack = text;
+    with_stack += "\nStack Trace:\n";
+    with_stack += render_stacktrace(record.frames, record.frame_count,
+                                   LOG_STACKTRACE_SKIP);
+    text = with_stack.c_str();
+  }
+  char prefix[PREFIX_WIDTH];
+  if (record.with_prefix) {
+    format_prefix(prefix, sizeof prefix, record.verbosity, record.file,
+                  record.line, record.ms_since_epoch, record.uptime_ms,
+                  record.thread_name);
+  }
+  auto message = Message{
+      .verbosity = record.verbosity,
+      .file = record.file,
+      .line = record.line,
+      .prefix = record.with_prefix ? prefix : nullptr,
+      .raw_message = text,
+      .ms_since_epoch = record.ms_since_epoch,
+      .uptime_ms = record.uptime_ms,
+      .thread_name = record.thread_name,
+      .site = record.kv ? nullptr : record.site,
+      .args = record.site && !record.kv ? record.Data() : nullptr,
+      .args_size = record.site && !record.kv ? record.args_size : 0,
+      .kv_message = record.kv ? record.site->format : nullptr,
+      .fields = record.kv ? record.Data() : nullptr,
+      .fields_size = record.kv ? record.args_size : 0,
+  };
+  log_message(record.verbosity, message);
+  if (rendered_spill) {
+    release_spill(rendered_spill);
+  }
+  if (record.spill) {
+    release_spill(record.spill);
+    record.spill = nullptr;
+  }
+  if (record.frames) {
+    release_spill(reinterpret_cast<char *>(record.frames));
+    record.frames = nullptr;
+  }
+}
+
+//* 返回本次处理的记录条数
+static auto drain_queue() -> size_t {
+  size_t count = 0;
+  std::unique_lock<std::recursive_mutex> lock(locker);
+  while (auto record = record_queue->Front()) {
+    dispatch_record(*record);
+    record_queue->Pop();
+    ++count;
+  }
+  batch_max = std::max<uint64_t>(batch_max, count);
+  if (need_flush.load() && (flush_interval_ms == 0 || flush_stop.load())) {
+    flush_sinks();
+  }
+  if (count) {
+    std::unique_lock<std::mutex> guard(backend_mutex);
+    drained_cv.notify_all();
+  }
+  return count;
+}
+
+#define BACKEND_IDLE_ROUNDS 50
+
+static void backend_loop() {
+  is_backend_thread = true;
   pthread_once(&thread_once, init_thread_key);
-  if (char *name = reinterpret_cast<char *>(pthread_getspecific(thread_key))) {
-    snprintf(thread_name, thread_name_len, "%s", name);
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  pthread_setspecific(thread_key, strdup("log_what"));
+  int idle_rounds = 0;
+  while (true) {
+    if (drain_queue()) {
+      idle_rounds = 0;
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(backend_mutex);
+    if (backend_stop.load()) {
+      break;
+    }
+    //* 有负载时按 1ms 轮询, 生产者不需要任何系统调用;
+    //* 空闲一段时间后才进入深度睡眠, 由下一条日志唤醒
+    if (idle_rounds < BACKEND_IDLE_ROUNDS) {
+      ++idle_rounds;
+      backend_cv.wait_for(lock, std::chrono::milliseconds(1));
+      continue;
+    }
+    backend_sleeping.store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (record_queue->Front() == nullptr) {
+      //* 超时只是兜底, 正常情况下由生产者唤醒
+      backend_cv.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    backend_sleeping.store(false);
+  }
+  drain_queue();
+}
+
+//* 等待后台线程处理完调用时刻之前入队的所有记录
+static void wait_backend_drained() {
+  if (is_backend_thread || dispatch_depth > 0 || !enter_async()) {
+    return;
+  }
+  auto target = record_queue->Tail();
+  {
+    std::unique_lock<std::mutex> lock(backend_mutex);
+    while (async_running.load() && record_queue->Consumed() < target) {
+      backend_cv.notify_one();
+      drained_cv.wait_for(lock, std::chrono::milliseconds(10));
+    }
+  }
+  leave_async();
+}
+
+//* 信号处理函数中使用: 不加锁也不唤醒, 给后台线程最多 CRASH_DRAIN_MS 处理完已提交的记录
+#define CRASH_DRAIN_MS 200
+
+static void crash_drain_backend() {
+  if (!async_running.load() || is_backend_thread) {
+    return;
+  }
+  auto target = record_queue->Tail();
+  timespec interval{0, 1000000};
+  for (int i = 0; i < CRASH_DRAIN_MS && record_queue->Consumed() < target;
+       ++i) {
+    nanosleep(&interval, nullptr);
+  }
+}
+
+auto Start_async(size_t queue_size) -> bool {
+  if (is_backend_thread) { //* Stop_async() 可能正持有锁等待后台线程退出
+    return false;
+  }
+  std::unique_lock<std::mutex> control(async_control_mutex);
+  if (async_running.load()) {
+    return true;
+  }
+  size_t capacity = 2;
+  while (capacity < queue_size) {
+    capacity <<= 1;
+  }
+  if (record_queue && record_queue->Capacity() != capacity) {
+    delete record_queue; //* 上一次 Stop_async() 已经排空, 也没有生产者还在使用
+    record_queue = nullptr;
+  }
+  if (!record_queue) {
+    record_queue = new RecordQueue(capacity);
+  }
+  backend_stop.store(false);
+  backend_thread = new std::thread(backend_loop);
+  async_running.store(true);
+  return true;
+}
+
+void Stop_async() {
+  if (is_backend_thread) {
+    return;
+  }
+  //* exit() 和用户线程可能同时调用, 只有清除标志的一方负责停止
+  std::unique_lock<std::mutex> control(async_control_mutex);
+  if (!async_running.exchange(false)) {
+    return;
+  }
+  //* 清除标志之前进入的生产者可能还没有抢到槽位, 后台线程仍在运行, 队列满时也能前进
+  while (async_producers.load(std::memory_order_acquire) > 0) {
+    wake_backend(true);
+    std::this_thread::yield();
+  }
+  {
+    std::unique_lock<std::mutex> lock(backend_mutex);
+    backend_stop.store(true);
+    backend_cv.notify_one();
+  }
+  backend_thread->join();
+  delete backend_thread;
+  backend_thread = nullptr;
+  drain_queue();
+}
+
+//* 同步模式下直接输出, 异步模式下只做一次格式化和若干原子操作
+//* frames 非空时在消息后附上调用栈
+//* fatal 需要在当前线程上打印调用栈, 先排空队列保证顺序
+//* 返回 false 时已经 enter_async(), 由 publish_text() 离开
+static auto submit_inline(Verbosity verbosity) -> bool {
+  return is_backend_thread || dispatch_depth > 0 ||
+         verbosity == Verbosity::VerbosityFATAL || !enter_async();
+}
+
+//* 在队列中预留一条文本记录, 填好时间和线程名, 由调用者写入文本后 publish_text()
+static auto acquire_text(Verbosity verbosity, const char *file,
+                         unsigned int line, bool with_prefix, uint64_t start,
+                         size_t &pos) -> Record & {
+  if (!record_queue->Try_acquire(pos)) {
+    queue_full_count.fetch_add(1, std::memory_order_relaxed);
+    while (!record_queue->Try_acquire(pos)) { //* 队列已满, 等待后台线程
+      wake_backend(true);
+      std::this_thread::yield();
+    }
+  }
+  auto &record = record_queue->At(pos);
+  record.enqueue_ns = start;
+  record.verbosity = verbosity;
+  record.file = file;
+  record.line = line;
+  record.with_prefix = with_prefix;
+  record.site = nullptr;
+  record.spill = nullptr;
+  record.frames = nullptr;
+  record.kv = false;
+  record.ticks = 0;
+  if (with_prefix) {
+    stamp_record(record);
+    cached_thread_name(record.thread_name);
+  }
+  return record;
+}
+
+static void publish_text(size_t pos, uint64_t start) {
+  record_queue->Publish(pos);
+  leave_async();
+  stats_finish(StatsPoint::Enqueue, start);
+  wake_backend();
+}
+
+static void submit(Verbosity verbosity, const char *file, unsigned int line,
+                   bool with_prefix, const char *format, va_list list,
+                   void *const *frames = nullptr, int frame_count = 0) {
+  if (submit_inline(verbosity)) {
+    wait_backend_drained();
+    Formatted buffer(format, list);
+    if (frames) {
+      std::string text = buffer.C_str();
+      text += "\nStack Trace:\n";
+      text += render_stacktrace(frames, frame_count, LOG_STACKTRACE_SKIP);
+      log_to_everywhere(verbosity, file, line, text.c_str());
+    } else if (with_prefix) {
+      log_to_everywhere(verbosity, file, line, buffer.C_str());
+    } else {
+      auto message = Message{
+          .verbosity = verbosity,
+          .file = file,
+          .line = line,
+          .prefix = nullptr,
+          .raw_message = buffer.C_str(),
+      };
+      log_message(verbosity, message);
+    }
+    return;
+  }
+
+  auto start = stats_start();
+  size_t pos;
+  auto &record = acquire_text(verbosity, file, line, with_prefix, start, pos);
+  va_list copy;
+  va_copy(copy, list);
+  int bytes = vsnprintf(record.text, sizeof record.text, format, copy);
+  va_end(copy);
+  if (bytes >= static_cast<int>(sizeof record.text)) {
+    record.spill = alloc_spill(bytes + 1);
+    vsnprintf(record.spill, bytes + 1, format, list);
+  }
+  if (frames) {
+    record.frames = reinterpret_cast<void **>(
+        alloc_spill(sizeof(void *) * static_cast<size_t>(frame_count)));
+    memcpy(record.frames, frames, sizeof(void *) * frame_count);
+    record.frame_count = frame_count;
+  }
+  publish_text(pos, start);
+}
+
+void log_formatted(Verbosity verbosity, const char *file, unsigned int line,
+                   const char *text, size_t len) {
+  if (submit_inline(verbosity)) {
+    wait_backend_drained();
+    log_to_everywhere(verbosity, file, line, text);
+    return;
+  }
+  auto start = stats_start();
+  size_t pos;
+  auto &record = acquire_text(verbosity, file, line, true, start, pos);
+  if (len < sizeof record.text) {
+    memcpy(record.text, text, len + 1);
   } else {
-    thread_name[0] = '\0';
+    record.spill = alloc_spill(len + 1);
+    memcpy(record.spill, text, len + 1);
+  }
+  publish_text(pos, start);
+}
+
+auto begin_deferred(const CallSite &site, Verbosity verbosity,
+                    size_t args_size, size_t &token) -> char * {
+  if (!deferred_mode || is_backend_thread || dispatch_depth > 0 ||
+      verbosity == Verbosity::VerbosityFATAL || !enter_async()) {
+    return nullptr;
+  }
+  auto start = stats_start();
+  if (!record_queue->Try_acquire(token)) {
+    queue_full_count.fetch_add(1, std::memory_order_relaxed);
+    while (!record_queue->Try_acquire(token)) {
+      wake_backend(true);
+      std::this_thread::yield();
+    }
+  }
+  auto &record = record_queue->At(token);
+  record.enqueue_ns = start;
+  record.verbosity = verbosity;
+  record.file = site.file;
+  record.line = site.line;
+  record.with_prefix = true;
+  record.site = &site;
+  record.frames = nullptr;
+  record.kv = false;
+  record.args_size = static_cast<uint32_t>(args_size);
+  record.spill = args_size > sizeof record.text ? alloc_spill(args_size)
+                                                : nullptr;
+  stamp_record(record);
+  cached_thread_name(record.thread_name);
+  return record.Data();
+}
+
+void commit_deferred(size_t token) {
+  auto start = record_queue->At(token).enqueue_ns;
+  record_queue->Publish(token);
+  leave_async();
+  stats_finish(StatsPoint::Enqueue, start);
+  wake_backend();
+}
+
+//* 与 begin_deferred 相同, 但不需要开启 Set_deferred(): 字段本来就是编码好的
+auto begin_kv(const CallSite &site, Verbosity verbosity, size_t fields_size,
+              size_t &token) -> char * {
+  if (is_backend_thread || dispatch_depth > 0 ||
+      verbosity == Verbosity::VerbosityFATAL || !enter_async()) {
+    return nullptr;
+  }
+  auto start = stats_start();
+  if (!record_queue->Try_acquire(token)) {
+    queue_full_count.fetch_add(1, std::memory_order_relaxed);
+    while (!record_queue->Try_acquire(token)) {
+      wake_backend(true);
+      std::this_thread::yield();
+    }
+  }
+  auto &record = record_queue->At(token);
+  record.enqueue_ns = start;
+  record.verbosity = verbosity;
+  record.file = site.file;
+  record.line = site.line;
+  record.with_prefix = true;
+  record.site = &site;
+  record.frames = nullptr;
+  record.kv = true;
+  record.args_size = static_cast<uint32_t>(fields_size);
+  record.spill = fields_size > sizeof record.text ? alloc_spill(fields_size)
+                                                  : nullptr;
+  stamp_record(record);
+  cached_thread_name(record.thread_name);
+  return record.Data();
+}
+
+//* 读取下一个参数, 类型不符或参数不足时返回 false
+template <typename V>
+static auto take_arg(const char *&args, const char *end, ArgType type, V &v)
+    -> bool {
+  if (args + 1 + sizeof v > end || static_cast<ArgType>(*args) != type) {
+    return false;
+  }
+  memcpy(&v, args + 1, sizeof v);
+  args += 1 + sizeof v;
+  return true;
+}
+
+//* 跳过一个参数(用于类型不符的情况)
+static void skip_arg(const char *&args, const char *end) {
+  if (args >= end) {
+    return;
+  }
+  size_t size = 0;
+  switch (static_cast<ArgType>(*args)) {
+  case ArgType::Int:
+    size = sizeof(int);
+    break;
+  case ArgType::Long:
+    size = sizeof(long);
+    break;
+  case ArgType::LongLong:
+    size = sizeof(long long);
+    break;
+  case ArgType::Double:
+    size = sizeof(double);
+    break;
+  case ArgType::LongDouble:
+    size = sizeof(long double);
+    break;
+  case ArgType::String: {
+    uint32_t len = 0;
+    memcpy(&len, args + 1, sizeof len);
+    size = sizeof len + len;
+    break;
+  }
+  case ArgType::Bool:
+    size = sizeof(bool);
+    break;
+  case ArgType::Unsigned:
+    size = sizeof(uint64_t);
+    break;
+  default:
+    size = sizeof(const void *);
+    break;
+  }
+  args += 1 + size;
+}
+
+//* 把 spec 中的长度修饰符替换成与实际参数类型一致的版本, 避免 printf 读错类型;
+//* int 参数保留 h/hh, 由 printf 截断为 short/char
+static void fix_length_modifier(char *spec, size_t &len, ArgType type) {
+  char conversion = spec[len - 1];
+  size_t h_count = 0;
+  while (len > 1 && strchr("hlLqjzt", spec[len - 2])) {
+    h_count += spec[len - 2] == 'h';
+    --len;
+  }
+  const char *modifier = "";
+  if (type == ArgType::Int && conversion != 'c') {
+    modifier = h_count >= 2 ? "hh" : h_count == 1 ? "h" : "";
+  } else if (type == ArgType::Long) {
+    modifier = "l";
+  } else if (type == ArgType::LongLong) {
+    modifier = "ll";
+  } else if (type == ArgType::LongDouble) {
+    modifier = "L";
+  }
+  len -= 1;
+  for (auto p = modifier; *p; ++p) {
+    spec[len++] = *p;
+  }
+  spec[len++] = conversion;
+  spec[len] = '\0';
+}
+
+auto format_deferred(const char *format, const char *args, size_t args_size,
+                     char *out, size_t out_len) -> size_t {
+  const char *end = args + args_size;
+  size_t pos = 0;
+  auto put = [&](const char *str, size_t len) {
+    if (pos < out_len) {
+      memcpy(out + pos, str, std::min(len, out_len - pos));
+    }
+    pos += len;
+  };
+  //* 只格式化单个转换说明, 结果直接写到 out 的剩余空间
+  auto put_spec = [&](const char *spec, auto... values) {
+    auto room = pos < out_len ? out_len - pos : 0;
+    int bytes = snprintf(room ? out + pos : nullptr, room, spec, values...);
+    if (bytes > 0) {
+      pos += bytes;
+    }
+  };
+
+  for (auto p = format; *p;) {
+    if (*p != '%') {
+      auto next = strchr(p, '%');
+      auto len = next ? static_cast<size_t>(next - p) : strlen(p);
+      put(p, len);
+      p += len;
+      continue;
+    }
+    if (p[1] == '%') {
+      put("%", 1);
+      p += 2;
+      continue;
+    }
+    //* %[flags][width][.precision][length]conversion
+    char spec[32];
+    size_t len = 0;
+    int stars[2];
+    int star_count = 0;
+    bool bad = false;
+    spec[len++] = *p++;
+    while (*p && !strchr("diouxXeEfFgGaAcspn", *p)) {
+      if (*p == '*') {
+        if (star_count < 2 && take_arg(args, end, ArgType::Int,
+                                       stars[star_count])) {
+          ++star_count;
+        } else {
+          bad = true;
+        }
+      }
+      if (len < sizeof spec - 4) {
+        spec[len++] = *p;
+      }
+      ++p;
+    }
+    if (!*p) {
+      break;
+    }
+    auto conversion = *p++;
+    spec[len++] = conversion;
+    spec[len] = '\0';
+    if (bad || args >= end || conversion == 'n') {
+      put("(bad arg)", sizeof("(bad arg)") - 1);
+      skip_arg(args, end);
+      continue;
+    }
+
+    auto type = static_cast<ArgType>(*args);
+    bool is_integer = type == ArgType::Int || type == ArgType::Long ||
+                      type == ArgType::LongLong;
+    bool is_float = type == ArgType::Double || type == ArgType::LongDouble;
+    bool ok = strchr("diouxXc", conversion) ? is_integer
+              : strchr("eEfFgGaA", conversion) ? is_float
+              : conversion == 'p'               ? type == ArgType::Pointer
+                                                : type == ArgType::String;
+    if (!ok) {
+      put("(bad arg)", sizeof("(bad arg)") - 1);
+      skip_arg(args, end);
+      continue;
+    }
+    fix_length_modifier(spec, len, type);
+    auto put_value = [&](auto value) {
+      if (star_count == 0) {
+        put_spec(spec, value);
+      } else if (star_count == 1) {
+        put_spec(spec, stars[0], value);
+      } else {
+        put_spec(spec, stars[0], stars[1], value);
+      }
+    };
+    if (conversion == 's') {
+      uint32_t str_len = 0;
+      if (take_arg(args, end, type, str_len) &&
+          args + str_len <= end) {
+        //* 参数中的字符串没有结尾的'\0', 用 precision 限制长度
+        char str_spec[40];
+        size_t str_pos = 0;
+        for (size_t i = 0; i + 1 < len && spec[i] != '.'; ++i) {
+          str_spec[str_pos++] = spec[i];
+        }
+        int precision = static_cast<int>(str_len);
+        if (auto dot = strchr(spec, '.')) {
+          precision = dot[1] == '*' ? stars[star_count - 1] : atoi(dot + 1);
+          if (dot[1] == '*') {
+            --star_count;
+          }
+          precision = std::min(precision, static_cast<int>(str_len));
+          if (precision < 0) {
+            precision = static_cast<int>(str_len);
+          }
+        }
+        memcpy(str_spec + str_pos, ".*s", 4);
+        if (star_count == 1) {
+          put_spec(str_spec, stars[0], precision, args);
+        } else {
+          put_spec(str_spec, precision, args);
+        }
+        args += str_len;
+      } else {
+        ok = false;
+      }
+    } else if (type == ArgType::Int) {
+      int value;
+      ok = take_arg(args, end, type, value);
+      if (ok) {
+        put_value(value);
+      }
+    } else if (type == ArgType::Long) {
+      long value;
+      ok = take_arg(args, end, type, value);
+      if (ok) {
+        put_value(value);
+      }
+    } else if (type == ArgType::LongLong) {
+      long long value;
+      ok = take_arg(args, end, type, value);
+      if (ok) {
+        put_value(value);
+      }
+    } else if (type == ArgType::Double) {
+      double value;
+      ok = take_arg(args, end, type, value);
+      if (ok) {
+        put_value(value);
+      }
+    } else if (type == ArgType::LongDouble) {
+      long double value;
+      ok = take_arg(args, end, type, value);
+      if (ok) {
+        put_value(value);
+      }
+    } else {
+      const void *value;
+      ok = take_arg(args, end, type, value);
+      if (ok) {
+        put_value(value);
+      }
+    }
+    if (!ok) {
+      put("(bad arg)", sizeof("(bad arg)") - 1);
+      skip_arg(args, end);
+    }
+  }
+  if (out_len) {
+    out[std::min(pos, out_len - 1)] = '\0';
+  }
+  return pos;
+}
+
+/*********************************structured log*********************************/
+//* 解码后的一个 key 或 value
+struct KvValue {
+  ArgType type;
+  long long integer;
+  uint64_t unsigned_integer;
+  bool boolean;
+  double real;
+  const char *str;
+  size_t len;
+  const void *pointer;
+};
+
+static auto next_kv(const char *&args, const char *end, KvValue &value)
+    -> bool {
+  if (args >= end) {
+    return false;
+  }
+  value.type = static_cast<ArgType>(*args);
+  switch (value.type) {
+  case ArgType::Int: {
+    int v = 0;
+    take_arg(args, end, value.type, v);
+    value.integer = v;
+    break;
+  }
+  case ArgType::Long: {
+    long v = 0;
+    take_arg(args, end, value.type, v);
+    value.integer = v;
+    break;
+  }
+  case ArgType::LongLong: {
+    long long v = 0;
+    take_arg(args, end, value.type, v);
+    value.integer = v;
+    break;
+  }
+  case ArgType::Unsigned:
+    take_arg(args, end, value.type, value.unsigned_integer);
+    break;
+  case ArgType::Bool:
+    take_arg(args, end, value.type, value.boolean);
+    break;
+  case ArgType::Double:
+    take_arg(args, end, value.type, value.real);
+    break;
+  case ArgType::LongDouble: {
+    long double v = 0;
+    take_arg(args, end, value.type, v);
+    value.real = static_cast<double>(v);
+    value.type = ArgType::Double;
+    break;
+  }
+  case ArgType::String: {
+    uint32_t len;
+    if (!take_arg(args, end, value.type, len) ||
+        args + len > end) {
+      return false;
+    }
+    value.str = args;
+    value.len = len;
+    args += len;
+    break;
+  }
+  default:
+    if (!take_arg(args, end, ArgType::Pointer, value.pointer)) {
+      return false;
+    }
+    break;
+  }
+  return true;
+}
+
+//* 整数和浮点数都用 to_chars: 不查 locale, 浮点数输出最短的可还原表示;
+//* bool 输出 true/false
+static auto number_chars(const KvValue &value, char *buffer, size_t size)
+    -> size_t {
+  std::to_chars_result result;
+  if (value.type == ArgType::Bool) {
+    auto text = value.boolean ? "true" : "false";
+    auto len = strlen(text);
+    memcpy(buffer, text, len);
+    return len;
+  } else if (value.type == ArgType::Unsigned) {
+    result = std::to_chars(buffer, buffer + size, value.unsigned_integer);
+  } else if (value.type == ArgType::Double) {
+    result = std::to_chars(buffer, buffer + size, value.real);
+  } else if (value.type == ArgType::Pointer) {
+    buffer[0] = '0';
+    buffer[1] = 'x';
+    result = std::to_chars(buffer + 2, buffer + size,
+                           reinterpret_cast<uintptr_t>(value.pointer), 16);
+  } else {
+    result = std::to_chars(buffer, buffer + size, value.integer);
+  }
+  return result.ec == std::errc() ? result.ptr - buffer : 0;
+}
+
+auto format_kv(const char *message, const char *fields, size_t fields_size,
+               char *out, size_t out_len) -> size_t {
+  const char *end = fields + fields_size;
+  size_t pos = 0;
+  auto put = [&](const char *str, size_t len) {
+    if (pos < out_len) {
+      memcpy(out + pos, str, std::min(len, out_len - pos));
+    }
+    pos += len;
+  };
+  put(message, strlen(message));
+  KvValue key, value;
+  while (next_kv(fields, end, key) && next_kv(fields, end, value)) {
+    put(" ", 1);
+    if (key.type == ArgType::String) {
+      put(key.str, key.len);
+    }
+    put("=", 1);
+    if (value.type == ArgType::String) {
+      //* 含空格, 引号或 '=' 的字符串加引号
+      bool quote = value.len == 0;
+      for (size_t i = 0; i < value.len && !quote; ++i) {
+        quote = value.str[i] == ' ' || value.str[i] == '"' ||
+                value.str[i] == '=';
+      }
+      if (quote) {
+        put("\"", 1);
+        for (size_t i = 0; i < value.len; ++i) {
+          if (value.str[i] == '"' || value.str[i] == '\\') {
+            put("\\", 1);
+          }
+          put(value.str + i, 1);
+        }
+        put("\"", 1);
+      } else {
+        put(value.str, value.len);
+      }
+    } else {
+      char number[32];
+      put(number, number_chars(value, number, sizeof number));
+    }
+  }
+  if (out_len > 0) {
+    out[std::min(pos, out_len - 1)] = '\0';
+  }
+  return pos;
+}
+
+void log_kv_fields(const CallSite &site, Verbosity verbosity,
+                   const char *fields, size_t fields_size) {
+  wait_backend_drained();
+  char rendered[RENDER_SIZE];
+  char *spill = nullptr;
+  const char *text = rendered;
+  auto bytes =
+      format_kv(site.format, fields, fields_size, rendered, sizeof rendered);
+  if (bytes >= sizeof rendered) {
+    spill = alloc_spill(bytes + 1);
+    format_kv(site.format, fields, fields_size, spill, bytes + 1);
+    text = spill;
+  }
+
+  char thread_name[THREADNAME_WIDTH + 1];
+  cached_thread_name(thread_name);
+  long ms_since_epoch, uptime_ms;
+  current_time(ms_since_epoch, uptime_ms);
+  char prefix[PREFIX_WIDTH];
+  format_prefix(prefix, sizeof prefix, verbosity, site.file, site.line,
+                ms_since_epoch, uptime_ms, thread_name);
+  auto message = Message{
+      .verbosity = verbosity,
+      .file = site.file,
+      .line = site.line,
+      .prefix = prefix,
+      .raw_message = text,
+      .ms_since_epoch = ms_since_epoch,
+      .uptime_ms = uptime_ms,
+      .thread_name = thread_name,
+      .kv_message = site.format,
+      .fields = fields,
+      .fields_size = static_cast<unsigned int>(fields_size),
+  };
+  log_message(verbosity, message);
+  if (spill) {
+    release_spill(spill);
+  }
+}
+
+void log(Verbosity verbosity, const char *file, unsigned int line,
+         const char *format, ...) {
+  va_list list;
+  va_start(list, format);
+  submit(verbosity, file, line, true, format, list);
+  va_end(list);
+}
+
+void raw_log(Verbosity verbosity, const char *file, unsigned int line,
+             const char *format, ...) {
+  va_list list;
+  va_start(list, format);
+  submit(verbosity, file, line, false, format, list);
+  va_end(list);
+}
+
+/*********************************rate limit*********************************/
+#define SUPPRESSED_REPORT_MS 5000
+
+//* 执行过至少一次的限流调用点, 只增不删(调用点都是静态变量)
+static std::atomic<RateLimit *> rate_limits{nullptr};
+static std::atomic<long> next_suppressed_report_ms{0};
+static std::mutex report_locker;
+//* 汇报本身也会经过 log_message(), 不再从那里重入
+static thread_local bool reporting_suppressed{false};
+
+void rate_limit_pass(RateLimit &limit) {
+  limit.emitted.fetch_add(1, std::memory_order_relaxed);
+}
+
+void rate_limit_check(RateLimit &limit) {
+  if (!limit.registered.load(std::memory_order_relaxed) &&
+      !limit.registered.exchange(true, std::memory_order_acq_rel)) {
+    auto head = rate_limits.load(std::memory_order_relaxed);
+    do {
+      limit.next = head;
+    } while (!rate_limits.compare_exchange_weak(head, &limit,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed));
+  }
+  maybe_report_suppressed();
+}
+
+//* 与 maybe_report_stats() 一样在 log_message() 末尾检查, 另外由 rate_limit_check() 检查,
+//* 由恰好到期的线程输出
+static void maybe_report_suppressed() {
+  if (reporting_suppressed || !rate_limits.load(std::memory_order_relaxed)) {
+    return;
+  }
+  auto now = coarse_ms();
+  auto next = next_suppressed_report_ms.load(std::memory_order_relaxed);
+  if (now >= next && next_suppressed_report_ms.compare_exchange_strong(
+                         next, now + SUPPRESSED_REPORT_MS,
+                         std::memory_order_relaxed)) {
+    if (next != 0) { //* 第一次只设置时间
+      Report_suppressed();
+    }
+  }
+}
+
+#define SUPPRESSED_REPORT_BATCH 32
+
+//* report_locker 只保护 reported 的更新; log() 在锁外调用, 每次最多取出一批
+void Report_suppressed() {
+  struct Pending {
+    RateLimit *limit;
+    uint64_t count;
+    uint64_t total;
+  };
+  Pending pending[SUPPRESSED_REPORT_BATCH];
+  auto reentered = reporting_suppressed;
+  reporting_suppressed = true;
+  size_t size;
+  do {
+    size = 0;
+    {
+      std::unique_lock<std::mutex> lock(report_locker);
+      for (auto limit = rate_limits.load(std::memory_order_acquire);
+           limit && size < SUPPRESSED_REPORT_BATCH; limit = limit->next) {
+        //* 先读 count: 并发放行时宁可少报, 下次汇报会补上
+        auto count = limit->count.load(std::memory_order_relaxed);
+        auto emitted = limit->emitted.load(std::memory_order_relaxed);
+        auto suppressed = count > emitted ? count - emitted : 0;
+        if (suppressed > limit->reported) {
+          pending[size++] =
+              Pending{limit, suppressed - limit->reported, suppressed};
+          limit->reported = suppressed;
+        }
+      }
+    }
+    for (size_t i = 0; i < size; ++i) {
+      auto limit = pending[i].limit;
+      log(limit->verbosity, limit->file, limit->line,
+          "suppressed %llu messages (%llu in total)",
+          static_cast<unsigned long long>(pending[i].count),
+          static_cast<unsigned long long>(pending[i].total));
+    }
+  } while (size == SUPPRESSED_REPORT_BATCH);
+  reporting_suppressed = reentered;
+}
+
+void log_stacktrace(Verbosity verbosity, const char *file, unsigned int line,
+                    const char *format, ...) {
+  if (static_cast<int>(verbosity) >
+      sink_max_verbosity.load(std::memory_order_relaxed)) {
+    return;
+  }
+  //* 调用线程只抓取返回地址; 原样保留全部帧, 这样 render_stacktrace()
+  //* 才能判断是否截断, 自身那一帧在渲染时跳过
+  void *frames[MAX_STACK_FRAMES];
+  int num_frames = backtrace(frames, MAX_STACK_FRAMES);
+  va_list list;
+  va_start(list, format);
+  submit(verbosity, file, line, true, format, list, frames, num_frames);
+  va_end(list);
+}
+
+void log_to_everywhere(Verbosity verbosity, const char *file, unsigned line,
+                       const char *message) {
+  char thread_name[THREADNAME_WIDTH + 1];
+  cached_thread_name(thread_name);
+  long ms_since_epoch, uptime_ms;
+  current_time(ms_since_epoch, uptime_ms);
+
+  char prefix[PREFIX_WIDTH];
+  format_prefix(prefix, sizeof prefix, verbosity, file, line, ms_since_epoch,
+                uptime_ms, thread_name);
+  Message real_message = Message{
+      .verbosity = verbosity,
+      .file = file,
+      .line = line,
+      .prefix = prefix,
+      .raw_message = message,
+      .ms_since_epoch = ms_since_epoch,
+      .uptime_ms = uptime_ms,
+      .thread_name = thread_name,
+  };
+  log_message(verbosity, real_message);
+}
+
+void do_replacements(
+    const std::vector<std::pair<std::string, std::string>> &replacements,
+    std::string &str) {
+  for (auto &&p : replacements) {
+    if (p.first.size() <= p.second.size()) {
+      // On gcc, "type_name<std::string>()" is "std::string"
+      continue;
+    }
+
+    size_t it;
+    while ((it = str.find(p.first)) != std::string::npos) {
+      str.replace(it, p.first.size(), p.second);
+    }
+  }
+}
+
+static const std::vector<std::pair<std::string, std::string>> REPLACE_LIST = {
+
+    {"std::__1::", "std::"},
+    {"__thiscall ", ""},
+    {"__cdecl ", ""},
+};
+
+//* 去掉 ", std::allocator<...>" (内部不再有尖括号)
+static void remove_std_allocator(std::string &str) {
+  static const char needle[] = "std::allocator<";
+  std::string output;
+  output.reserve(str.size());
+  size_t i = 0;
+  while (i < str.size()) {
+    if (str[i] == ',') {
+      auto j = i + 1;
+      while (j < str.size() && isspace(static_cast<unsigned char>(str[j]))) {
+        ++j;
+      }
+      if (str.compare(j, sizeof needle - 1, needle) == 0) {
+        auto k = j + sizeof needle - 1;
+        auto start = k;
+        while (k < str.size() && str[k] != '<' && str[k] != '>') {
+          ++k;
+        }
+        if (k < str.size() && str[k] == '>' && k > start) {
+          i = k + 1;
+          continue;
+        }
+      }
+    }
+    output += str[i++];
+  }
+  str.swap(output);
+}
+
+//* "< T >" -> "<T>", T 中没有空格和尖括号
+static void tighten_template_spaces(std::string &str) {
+  std::string output;
+  output.reserve(str.size());
+  size_t i = 0;
+  while (i < str.size()) {
+    if (str[i] == '<') {
+      auto j = i + 1;
+      while (j < str.size() && isspace(static_cast<unsigned char>(str[j]))) {
+        ++j;
+      }
+      auto start = j;
+      while (j < str.size() && str[j] != '<' && str[j] != '>' &&
+             !isspace(static_cast<unsigned char>(str[j]))) {
+        ++j;
+      }
+      auto end = j;
+      while (j < str.size() && isspace(static_cast<unsigned char>(str[j]))) {
+        ++j;
+      }
+      if (end > start && j < str.size() && str[j] == '>') {
+        output += '<';
+        output.append(str, start, end - start);
+        output += '>';
+        i = j + 1;
+        continue;
+      }
+    }
+    output += str[i++];
+  }
+  str.swap(output);
+}
+
+std::string prettify_stacktrace(const std::string &input) {
+  std::string output = input;
+
+  do_replacements(s_user_stack_cleanups, output);
+  do_replacements(REPLACE_LIST, output);
+  remove_std_allocator(output);
+  tighten_template_spaces(output);
+
+  return output;
+}
+
+#define SYMBOL_CACHE_LIMIT 4096
+
+static std::atomic<StacktraceMode> stacktrace_mode{StacktraceMode::Symbolized};
+
+void Set_stacktrace_mode(StacktraceMode mode) { stacktrace_mode = mode; }
+
+//* 地址到符号的缓存: dladdr, __cxa_demangle 和 prettify 每个地址只做一次
+static std::mutex symbol_locker;
+static std::unordered_map<void *, std::string> symbol_cache;
+
+static auto describe_frame(void *address, StacktraceMode mode)
+    -> std::string {
+  Dl_info info;
+  if (!dladdr(address, &info)) {
+    return "??";
+  }
+  char buf[1024];
+  if (mode == StacktraceMode::Symbolized && info.dli_sname) {
+    char *demangled = NULL;
+    int status = -1;
+    if (info.dli_sname[0] == '_') {
+      demangled = abi::__cxa_demangle(info.dli_sname, 0, 0, &status);
+    }
+    snprintf(buf, sizeof(buf), "%s + %zd",
+             status == 0 ? demangled : info.dli_sname,
+             static_cast<char *>(address) -
+                 static_cast<char *>(info.dli_saddr));
+    free(demangled);
+    return prettify_stacktrace(buf);
+  }
+  //* 模块内偏移, 可以直接交给 addr2line -e <模块>
+  snprintf(buf, sizeof(buf), "%s(+%#tx)",
+           info.dli_fname ? info.dli_fname : "??",
+           static_cast<char *>(address) - static_cast<char *>(info.dli_fbase));
+  return buf;
+}
+
+static auto symbolize(void *address, StacktraceMode mode) -> std::string {
+  std::unique_lock<std::mutex> lock(symbol_locker);
+  //* 两种模式共用一个缓存, 最低位区分模式
+  auto key = reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(address) * 2 +
+                                      (mode == StacktraceMode::Raw));
+  auto found = symbol_cache.find(key);
+  if (found != symbol_cache.end()) {
+    return found->second;
+  }
+  lock.unlock();
+  auto symbol = describe_frame(address, mode);
+  lock.lock();
+  if (symbol_cache.size() >= SYMBOL_CACHE_LIMIT) {
+    symbol_cache.clear();
+  }
+  symbol_cache.emplace(key, symbol);
+  return symbol;
+}
+
+//* frames 由 backtrace() 抓取, 最相关的一帧放在最后
+static auto render_stacktrace(void *const *frames, int num_frames, int skip)
+    -> std::string {
+  // Print stack traces so the most relevant ones are written last
+  // Rationale:
+  // http://yellerapp.com/posts/2015-01-22-upside-down-stacktraces.html
+  auto mode = stacktrace_mode.load();
+  std::string result;
+  for (int i = num_frames - 1; i >= skip; --i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%-3d %*p ", i - skip,
+             int(2 + sizeof(void *) * 2), frames[i]);
+    result += buf;
+    result += symbolize(frames[i], mode);
+    result += '\n';
+  }
+
+  if (num_frames == MAX_STACK_FRAMES) {
+    result = "[truncated]\n" + result;
+  }
+
+  if (!result.empty() && result[result.size() - 1] == '\n') {
+    result.resize(result.size() - 1);
+  }
+  return result;
+}
+
+std::string stacktrace_as_stdstring(int skip) {
+  void *callstack[MAX_STACK_FRAMES];
+  int num_frames = backtrace(callstack, MAX_STACK_FRAMES);
+  return render_stacktrace(callstack, num_frames, skip);
+}
+
+auto get_stack() -> Text {
+  auto str = stacktrace_as_stdstring(4);
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return Text(strdup(str.c_str()));
+}
+
+void handle_fatal_message() {
+  //* 先把之前缓冲的 stderr 输出, 保证记录器的内容排在它们之后
+  stderr_writer.Flush();
+  Dump_flight_recorder();
+  auto text = get_stack();
+  if (!text.Is_empty())
+    RAW_LOG(ERROR, "Stack Trace:\n %s", text.C_str());
+  return;
+}
+
+/*********************************sink worker*********************************/
+#define SINK_FLUSH_TIMEOUT_MS 1000
+#define SINK_IDLE_WAIT_MS 100
+
+//* 交给有独立队列的 sink 的日志: 只读, 最后一个使用者释放
+struct SharedRecord {
+  std::atomic<int> refs;
+  Message message;
+};
+
+static auto copy_into(char *&cursor, const char *data, size_t len)
+    -> const char * {
+  if (!data) {
+    return nullptr;
+  }
+  auto copy = cursor;
+  memcpy(cursor, data, len);
+  cursor += len;
+  return copy;
+}
+
+//* Message 中的字符串和参数都拷贝到一块内存里, 来自 alloc_spill()
+static auto make_shared_record(const Message &message) -> SharedRecord * {
+  auto prefix_len = strlen(message.prefix) + 1;
+  auto text_len = strlen(message.raw_message) + 1;
+  auto thread_len = message.thread_name ? strlen(message.thread_name) + 1 : 0;
+  auto args_len = message.args ? message.args_size : 0;
+  auto fields_len = message.fields ? message.fields_size : 0;
+  auto size = sizeof(SharedRecord) + prefix_len + text_len + thread_len +
+              args_len + fields_len;
+  auto memory = alloc_spill(size);
+  auto shared = new (memory) SharedRecord{{1}, message};
+  auto cursor = memory + sizeof(SharedRecord);
+  auto &copy = shared->message;
+  copy.prefix = copy_into(cursor, message.prefix, prefix_len);
+  copy.raw_message = copy_into(cursor, message.raw_message, text_len);
+  copy.thread_name = copy_into(cursor, message.thread_name, thread_len);
+  copy.args = copy_into(cursor, message.args, args_len);
+  copy.fields = copy_into(cursor, message.fields, fields_len);
+  return shared;
+}
+
+static void acquire_shared_record(SharedRecord *shared) {
+  shared->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void release_shared_record(SharedRecord *shared) {
+  if (shared->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    shared->~SharedRecord();
+    release_spill(reinterpret_cast<char *>(shared));
+  }
+}
+
+//* 生产者是 log_message()(持有 locker), 消费者是自己的工作线程
+class SinkWorker {
+public:
+  SinkWorker(const CallBack &callback, size_t queue_size)
+      : callback(callback) {
+    size_t capacity = 2;
+    while (capacity < queue_size) {
+      capacity <<= 1;
+    }
+    ring.resize(capacity);
+    mask = capacity - 1;
+    thread = std::thread([this] { Run(); });
+  }
+
+  SinkWorker(const SinkWorker &) = delete;
+  auto operator=(const SinkWorker &) -> SinkWorker & = delete;
+
+  ~SinkWorker() { Stop(); }
+
+  //* 队列满时丢弃, 由工作线程在之后汇报
+  void Push(SharedRecord *shared) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (stopping || tail - head > mask) {
+      ++dropped;
+      ++dropped_total;
+      return;
+    }
+    acquire_shared_record(shared);
+    ring[tail++ & mask] = shared;
+    if (waiting) {
+      cv.notify_one();
+    }
+  }
+
+  //* 不加锁, 可以在 flush 线程和信号处理函数中调用; 最晚 SINK_IDLE_WAIT_MS 后生效
+  void Request_flush() {
+    flush_requested.store(true, std::memory_order_release);
+    cv.notify_one();
+  }
+
+  //* 等待已经排队的日志写出并 flush
+  void Wait_flushed(std::chrono::milliseconds timeout) {
+    if (std::this_thread::get_id() == thread.get_id()) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    auto target = tail;
+    flush_requested.store(true, std::memory_order_release);
+    cv.notify_one();
+    done_cv.wait_for(lock, timeout,
+                     [&] { return flushed >= target || stopped; });
+  }
+
+  auto Dropped() -> uint64_t {
+    std::unique_lock<std::mutex> lock(mutex);
+    return dropped_total;
+  }
+
+  //* 处理完剩余的日志后 flush, close, 然后结束工作线程
+  void Stop() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (stopping) {
+        lock.unlock();
+        if (thread.joinable() && thread.get_id() != std::this_thread::get_id()) {
+          thread.join();
+        }
+        return;
+      }
+      stopping = true;
+      cv.notify_one();
+    }
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+private:
+  void Run() {
+    is_sink_worker = true;
+    Set_thread_name("log_what_sink");
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      waiting = true;
+      cv.wait_for(lock, std::chrono::milliseconds(SINK_IDLE_WAIT_MS), [&] {
+        return stopping || head != tail ||
+               flush_requested.load(std::memory_order_acquire);
+      });
+      waiting = false;
+      //* 一次取走当前所有的日志, 处理时不持有锁
+      while (head != tail) {
+        auto end = tail;
+        auto lost = dropped;
+        dropped = 0;
+        lock.unlock();
+        for (auto pos = head; pos != end; ++pos) {
+          auto shared = ring[pos & mask];
+          auto message = shared->message;
+          callback.call_back(callback.user_data, message);
+          release_shared_record(shared);
+        }
+        if (lost) {
+          Report_dropped(lost);
+        }
+        lock.lock();
+        head = end;
+      }
+      bool flush = flush_requested.exchange(false) || stopping ||
+                   flush_interval_ms.load() == 0;
+      auto target = tail;
+      if (flush && callback.flush) {
+        lock.unlock();
+        callback.flush(callback.user_data);
+        lock.lock();
+      }
+      if (flush) {
+        flushed = std::max(flushed, std::min(target, head));
+        done_cv.notify_all();
+      }
+      if (stopping && head == tail) {
+        break;
+      }
+    }
+    if (dropped) {
+      auto lost = dropped;
+      dropped = 0;
+      lock.unlock();
+      Report_dropped(lost);
+      lock.lock();
+    }
+    lock.unlock();
+    if (callback.flush) {
+      callback.flush(callback.user_data);
+    }
+    if (callback.close) {
+      callback.close(callback.user_data);
+    }
+    lock.lock();
+    stopped = true;
+    done_cv.notify_all();
+  }
+
+  void Report_dropped(size_t lost) {
+    char text[96];
+    snprintf(text, sizeof text,
+             "log_what: dropped %zu messages, sink queue is full", lost);
+    auto message = Message{
+        .verbosity = Verbosity::VerbosityWARNING,
+        .file = __FILE__,
+        .line = __LINE__,
+        .prefix = "",
+        .raw_message = text,
+    };
+    callback.call_back(callback.user_data, message);
+  }
+
+  CallBack callback;
+  std::vector<SharedRecord *> ring;
+  size_t mask{0};
+  size_t head{0};
+  size_t tail{0};
+  size_t flushed{0};
+  size_t dropped{0};
+  uint64_t dropped_total{0};
+  bool waiting{false};
+  bool stopping{false};
+  bool stopped{false};
+  std::atomic<bool> flush_requested{false};
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::condition_variable done_cv;
+  std::thread thread;
+};
+
+//* 关闭所有 callback, 之后的日志只会输出到 stderr
+static void close_callBacks() {
+  CallBacks closing;
+  {
+    std::unique_lock<std::recursive_mutex> lock(locker);
+    closing.swap(callBacks);
+    update_effective_verbosity();
+    for (auto &callBack : closing) {
+      if (!callBack.worker && callBack.close) {
+        callBack.close(callBack.user_data);
+      }
+    }
+  }
+  for (auto &callBack : closing) {
+    if (callBack.worker) {
+      callBack.worker->Stop();
+    }
+  }
+}
+
+void log_message(Verbosity verbosity, Message &message) {
+  std::unique_lock<std::recursive_mutex> lock(locker, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    auto wait = stats_start();
+    lock.lock();
+    stats_finish(StatsPoint::LockWait, wait);
+  } else if (stats_enabled.load(std::memory_order_relaxed)) {
+    stats_record(StatsPoint::LockWait, 0);
+  }
+  auto start = stats_start();
+  ++dispatch_depth;
+  if (verbosity == Verbosity::VerbosityFATAL) {
+    handle_fatal_message();
+  }
+  if (!message.prefix) { // raw log
+    message.prefix = "";
+  }
+  auto prefix_len = strlen(message.prefix);
+  auto text_len = strlen(message.raw_message);
+  auto index = static_cast<int>(verbosity) -
+               static_cast<int>(Verbosity::VerbosityFATAL);
+  if (index >= 0) {
+    ++message_counts[std::min(index, STATS_VERBOSITY_BUCKETS - 1)];
+  }
+  //* vmodule 提高了这个文件的级别时, 所有 sink 都接收这些日志
+  auto level = static_cast<int>(verbosity);
+  if (level <= module_max_verbosity.load(std::memory_order_relaxed) &&
+      level <= module_verbosity(message.file)) {
+    level = static_cast<int>(Verbosity::VerbosityFATAL);
+  }
+  if (level <= MAXVERBOSITY_TO_STDERR && !is_shm_collector) { //* log to stderr
+    auto color = stderr_colors.Prefix(verbosity);
+    iovec pieces[] = {
+        {const_cast<char *>(color), strlen(color)},
+        {const_cast<char *>(message.prefix), prefix_len},
+        {const_cast<char *>(message.raw_message), text_len},
+        {const_cast<char *>(stderr_colors.suffix),
+         strlen(stderr_colors.suffix)},
+    };
+    stderr_writer.Write(pieces, 4, flush_immediately());
+    stderr_bytes += prefix_len + text_len + 1;
+    if (!flush_immediately()) {
+      mark_need_flush();
+    }
+  }
+  SharedRecord *shared = nullptr;
+  for (auto &callBack : callBacks) { //* log to registered callback
+    if (level <= static_cast<int>(callBack.max_verbosit)) {
+      ++callBack.messages;
+      callBack.bytes += prefix_len + text_len + 1;
+    }
+    if (level <= static_cast<int>(callBack.max_verbosit) && callBack.worker) {
+      //* 所有有独立队列的 sink 共享同一份拷贝
+      if (!shared) {
+        shared = make_shared_record(message);
+      }
+      callBack.worker->Push(shared);
+    } else if (level <= static_cast<int>(callBack.max_verbosit)) {
+      callBack.call_back(callBack.user_data, message);
+      if (flush_immediately() &&
+          (!callBack.lazy_flush || flush_stop.load(std::memory_order_relaxed))) {
+        if (callBack.flush) {
+          callBack.flush(callBack.user_data);
+        }
+      } else {
+        mark_need_flush(callBack.lazy_flush);
+      }
+    }
+  }
+
+  if (shared) {
+    release_shared_record(shared);
+  }
+
+  if (message.verbosity == Verbosity::VerbosityFATAL) {
+    flush();
+    signal(SIGABRT, SIG_DFL);
+  }
+  --dispatch_depth;
+  stats_finish(StatsPoint::Dispatch, start);
+  if (dispatch_depth == 0) {
+    lock.unlock();
+    maybe_report_stats();
+    maybe_report_suppressed();
+  }
+}
+
+// TODO
+auto get_verbosity_name(Verbosity verbosity) -> const char * {
+  switch (verbosity) {
+  case Verbosity::VerbosityERROR:
+    return "ERR";
+  case Verbosity::VerbosityINFO:
+    return "INFO";
+  case Verbosity::VerbosityFATAL:
+    return "FATL";
+  case Verbosity::VerbosityMESSAGE:
+    return "MES";
+  case Verbosity::VerbosityWARNING:
+    return "WARN";
+  default:
+    return nullptr;
+  }
+}
+
+void print_prefix(char *prefix, size_t prefix_len, Verbosity verbosity,
+                  const char *file, unsigned int line) {
+  //*线程
+  char thread_name[THREADNAME_WIDTH + 1] = {0};
+  get_thread_name(thread_name, sizeof thread_name);
+
+  //*时间
+  long ms_since_epoch, uptime_ms;
+  current_time(ms_since_epoch, uptime_ms);
+
+  format_prefix(prefix, prefix_len, verbosity, file, line, ms_since_epoch,
+                uptime_ms, thread_name);
+}
+
+//* 前缀各段的缓存, 每个线程一份(异步模式下只有后台线程在用)
+#define FILE_SEGMENT_CACHE 256
+
+struct FileSegment {
+  const char *file;
+  unsigned int line;
+  uint8_t len;
+  char text[FILENAME_WIDTH + 16];
+};
+
+struct PrefixCache {
+  long second{-1};
+  char date_time[20]; //* "YYYY-MM-DD HH:MM:SS"
+  FileSegment files[FILE_SEGMENT_CACHE]{};
+};
+
+//* 约 15KB, 第一次使用时分配, 线程退出时释放
+static thread_local std::unique_ptr<PrefixCache> prefix_cache;
+
+//* 把 value 以 width 位(不足补0)写到 out, 返回写入的字节数
+static inline auto put_digits(char *out, unsigned long value, int width)
+    -> int {
+  char digits[24];
+  int len = 0;
+  do {
+    digits[len++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value);
+  while (len < width) {
+    digits[len++] = '0';
+  }
+  for (int i = 0; i < len; ++i) {
+    out[i] = digits[len - 1 - i];
+  }
+  return len;
+}
+
+//* 与 "%*s:%-5u " 等价, 文件名超过 FILENAME_WIDTH 时截断
+static auto render_file_segment(char *out, const char *file, unsigned int line)
+    -> int {
+  auto name = filename(file);
+  auto name_len = std::min(strlen(name), static_cast<size_t>(FILENAME_WIDTH));
+  int pos = 0;
+  for (size_t i = name_len; i < FILENAME_WIDTH; ++i) {
+    out[pos++] = ' ';
+  }
+  memcpy(out + pos, name, name_len);
+  pos += name_len;
+  out[pos++] = ':';
+  int digits = put_digits(out + pos, line, 1);
+  pos += digits;
+  for (; digits < 5; ++digits) {
+    out[pos++] = ' ';
+  }
+  out[pos++] = ' ';
+  return pos;
+}
+
+void format_prefix(char *prefix, size_t prefix_len, Verbosity verbosity,
+                   const char *file, unsigned int line, long ms_since_epoch,
+                   long uptime_ms, const char *thread_name) {
+  if (!prefix_cache) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    prefix_cache = std::make_unique<PrefixCache>();
+  }
+  auto &cache = *prefix_cache;
+  char buffer[PREFIX_WIDTH + 128];
+  int pos = 0;
+
+  //* 日期和时间只在秒数变化时调用 localtime_r
+  auto sec_since_epoch = ms_since_epoch / 1000;
+  if (sec_since_epoch != cache.second) {
+    tm time_info;
+    auto sec = time_t(sec_since_epoch);
+    localtime_r(&sec, &time_info);
+    char *out = cache.date_time;
+    out += put_digits(out, 1900 + time_info.tm_year, 4);
+    *out++ = '-';
+    out += put_digits(out, 1 + time_info.tm_mon, 2);
+    *out++ = '-';
+    out += put_digits(out, time_info.tm_mday, 2);
+    *out++ = ' ';
+    out += put_digits(out, time_info.tm_hour, 2);
+    *out++ = ':';
+    out += put_digits(out, time_info.tm_min, 2);
+    *out++ = ':';
+    out += put_digits(out, time_info.tm_sec, 2);
+    *out = '\0';
+    cache.second = sec_since_epoch;
+  }
+  auto date_len = strlen(cache.date_time);
+  memcpy(buffer, cache.date_time, date_len);
+  pos += date_len;
+  buffer[pos++] = '.';
+  pos += put_digits(buffer + pos, ms_since_epoch % 1000, 3);
+  buffer[pos++] = ' ';
+
+  //* uptime: 与 "(%8.3fs)" 等价
+  if (uptime_ms >= 0) {
+    char digits[32];
+    int len = put_digits(digits, uptime_ms / 1000, 1);
+    digits[len++] = '.';
+    len += put_digits(digits + len, uptime_ms % 1000, 3);
+    buffer[pos++] = '(';
+    for (int i = len; i < 8; ++i) {
+      buffer[pos++] = ' ';
+    }
+    memcpy(buffer + pos, digits, len);
+    pos += len;
+    buffer[pos++] = 's';
+    buffer[pos++] = ')';
+  } else {
+    pos += snprintf(buffer + pos, sizeof buffer - pos, "(%8.3fs)",
+                    static_cast<double>(uptime_ms) / 1000.0);
+  }
+
+  //* thread name: 与 "[%-*s]" 等价
+  buffer[pos++] = '[';
+  auto name_len = strnlen(thread_name, 64);
+  memcpy(buffer + pos, thread_name, name_len);
+  pos += name_len;
+  for (auto i = name_len; i < THREADNAME_WIDTH; ++i) {
+    buffer[pos++] = ' ';
+  }
+  buffer[pos++] = ']';
+
+  //* 文件名和行号按调用点缓存
+  auto hash = (reinterpret_cast<uintptr_t>(file) >> 3) ^ (line * 2654435761u);
+  auto &segment = cache.files[hash % FILE_SEGMENT_CACHE];
+  if (segment.file != file || segment.line != line) {
+    segment.len = render_file_segment(segment.text, file, line);
+    segment.file = file;
+    segment.line = line;
+  }
+  memcpy(buffer + pos, segment.text, segment.len);
+  pos += segment.len;
+
+  //* verbosity: 与 "%6s| " 等价
+  const char *verbosity_name = get_verbosity_name(verbosity);
+  if (!verbosity_name) {
+    ASSERT(verbosity_name != nullptr, "fail to get verbosity name!");
+    verbosity_name = "";
+  }
+  auto verbosity_len = strlen(verbosity_name);
+  for (auto i = verbosity_len; i < 6; ++i) {
+    buffer[pos++] = ' ';
+  }
+  memcpy(buffer + pos, verbosity_name, verbosity_len);
+  pos += verbosity_len;
+  buffer[pos++] = '|';
+  buffer[pos++] = ' ';
+
+  if (prefix_len) {
+    auto len = std::min(static_cast<size_t>(pos), prefix_len - 1);
+    memcpy(prefix, buffer, len);
+    prefix[len] = '\0';
+  }
+}
+
+void get_thread_name(char *thread_name, size_t thread_name_len) {
+  thread_name[thread_name_len - 1] = '\0';
+  pthread_once(&thread_once, init_thread_key);
+  if (char *name = reinterpret_cast<char *>(pthread_getspecific(thread_key))) {
+    snprintf(thread_name, thread_name_len, "%s", name);
+  } else {
+    thread_name[0] = '\0';
+  }
+
+  if (thread_name[0] ==
+      '\0') { // fail to get a specific thread name give it a hex number
+    auto id = pthread_self();
+    snprintf(thread_name, thread_name_len, "%*lX",
+             static_cast<int>(thread_name_len) - 1, id);
+  }
+}
+
+auto vastextprint(const char *format, va_list list) -> Text {
+  char *buffer;
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  int bytes = vasprintf(&buffer, format, list);
+  ASSERT(bytes >= 0,
+         "bad format fatal"); // TODO 应该使用自己的fatal log方式进行处理
+  return Text(buffer);
+}
+
+auto filename(const char *file) -> const char * {
+  for (auto ptr = file; *ptr; ++ptr) {
+    if (*ptr == '/' || *ptr == '\\') { //消除掉文件名的前缀
+      file = ptr + 1;
+    }
+  }
+  return file;
+}
+
+//* 只 flush 已经写出的数据, 不等待异步队列
+static void flush_sinks() {
+  std::unique_lock<std::recursive_mutex> lock(locker);
+  //* 先清除标志, flush 期间新写入的数据会再次唤醒 flush 线程
+  need_flush.store(false);
+  auto start = stats_start();
+  stderr_writer.Flush();
+  fflush(stderr);
+  for (auto &callback : callBacks) {
+    if (callback.worker) {
+      callback.worker->Request_flush();
+    } else if (callback.flush) {
+      callback.flush(callback.user_data);
+    }
+  }
+  stats_finish(StatsPoint::Flush, start);
+}
+
+void flush() {
+  wait_backend_drained();
+  flush_sinks();
+  //* 在锁外等待工作线程; 可能在 log_message() 中(FATAL)被调用, 所以有超时
+  std::vector<std::shared_ptr<SinkWorker>> workers;
+  {
+    std::unique_lock<std::recursive_mutex> lock(locker);
+    for (auto &callback : callBacks) {
+      if (callback.worker) {
+        workers.push_back(callback.worker);
+      }
+    }
+  }
+  for (auto &worker : workers) {
+    worker->Wait_flushed(std::chrono::milliseconds(SINK_FLUSH_TIMEOUT_MS));
+  }
+}
+
+//* flush 线程只在有数据需要 flush 时被唤醒, 并把一个周期内的写入合并为一次
+static void flush_loop() {
+  std::unique_lock<std::mutex> lock(flush_mutex);
+  while (true) {
+    flush_cv.wait(lock, [] { return flush_stop.load() || need_flush.load(); });
+    if (flush_stop.load()) {
+      break;
+    }
+    flush_cv.wait_for(lock, std::chrono::milliseconds(flush_interval_ms.load()),
+                      [] { return flush_stop.load(); });
+    lock.unlock();
+    flush_sinks();
+    lock.lock();
+  }
+}
+
+//* 后台线程在处理完一批记录后统一 flush, 这样每批只有一次系统调用
+static auto flush_immediately() -> bool {
+  return !is_backend_thread && !is_sink_worker &&
+         (flush_interval_ms == 0 || flush_stop.load(std::memory_order_relaxed));
+}
+
+//* 需要持有 locker; lazy 的 sink 在 flush_interval_ms 为 0 时也交给 flush 线程,
+//* 后台线程在每批日志之后自己 flush
+static void mark_need_flush(bool lazy) {
+  bool wake = flush_interval_ms != 0 || (lazy && !is_backend_thread);
+  if (need_flush.exchange(true) || !wake || flush_stop.load()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(flush_mutex);
+  if (!flush_thread) {
+    flush_thread = new std::thread(flush_loop);
+  }
+  flush_cv.notify_one();
+}
+
+static void stop_flush_thread() {
+  {
+    std::unique_lock<std::mutex> lock(flush_mutex);
+    flush_stop.store(true);
+    flush_cv.notify_one();
+  }
+  if (flush_thread) {
+    flush_thread->join();
+    delete flush_thread;
+    flush_thread = nullptr;
+  }
+}
+
+auto Add_file(const char *path_in, FileMode filemode, Verbosity verbosity)
+    -> bool {
+  char path[FILENAME_MAX];
+  prepare_path(path_in, path);
+  const char *mode = filemode == FileMode::Truncate ? "w" : "a";
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+              (filemode == FileMode::Truncate ? O_TRUNC : O_APPEND);
+  int fd = open(path, flags, 0644);
+  if (fd == -1) {
+    LOG(ERROR, "failed to open file: %s", path);
+    return false;
+  }
+
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  add_callBack(new BatchWriter(fd), batch_file_log, batch_file_flush,
+               batch_file_close, verbosity);
+
+  LOG(MESSAGE, "FILE:%-*s FileMode:%-*s Verbosity:%-*s", FILENAME_WIDTH,
+      path_in, 5, mode, 6, get_verbosity_name(verbosity));
+  return true;
+}
+
+//* 展开 '~' 并创建上级目录, path 的长度为 FILENAME_MAX
+static void prepare_path(const char *path_in, char *path) {
+  if (path_in[0] == '~') {
+    snprintf(path, FILENAME_MAX, "%s%s", home_dir(), path_in + 1);
+  } else {
+    snprintf(path, FILENAME_MAX, "%s", path_in);
+  }
+  if (!create_dir(path)) {
+    LOG(ERROR, "failed to create dir:%s", path);
+  }
+}
+
+auto create_dir(const char *filepath) -> bool {
+  char *file = strdup(filepath);
+  for (char *p = strchr(file + 1, '/'); p; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    if (mkdir(file, 0755) == -1 && errno != EEXIST) {
+      LOG(ERROR, "failed to create dir: %s", file);
+      free(file);
+      return false;
+    }
+    *p = '/';
+  }
+  free(file);
+  return true;
+}
+
+auto home_dir() -> const char * {
+  auto home = getenv("HOME");
+  ASSERT(home != nullptr, "failed to get your home directory");
+  return home;
+}
+
+void add_callBack(void *user_data, call_back_handler_t call,
+                  flush_handler_t flush, close_handler_t close,
+                  Verbosity max_verbosity, size_t queue_size) {
+  std::unique_lock<std::recursive_mutex> lock(locker);
+  auto tmp = CallBack{.user_data = user_data,
+                      .call_back = call,
+                      .flush = flush,
+                      .close = close,
+                      .max_verbosit = max_verbosity,
+                      .worker = nullptr};
+  if (queue_size > 0) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    tmp.worker = std::make_shared<SinkWorker>(tmp, queue_size);
+  }
+  callBacks.push_back(std::move(tmp));
+  update_effective_verbosity();
+}
+
+//* 这个 sink 只由 flush()、flush 线程和后台线程的每批日志之后 flush
+static void set_lazy_flush(void *user_data) {
+  std::unique_lock<std::recursive_mutex> lock(locker);
+  for (auto &callBack : callBacks) {
+    if (callBack.user_data == user_data) {
+      callBack.lazy_flush = true;
+    }
+  }
+}
+
+//* 从列表中摘下后, 新的日志不会再交给它; 工作线程的收尾在锁外进行,
+//* 因为 callback 自己也可能写日志
+auto remove_callBack(void *user_data) -> bool {
+  ASSERT(dispatch_depth == 0, "remove_callBack() called inside a callback");
+  CallBack removed;
+  {
+    std::unique_lock<std::recursive_mutex> lock(locker);
+    auto it = std::find_if(
+        callBacks.begin(), callBacks.end(),
+        [&](const CallBack &callBack) { return callBack.user_data == user_data; });
+    if (it == callBacks.end()) {
+      return false;
+    }
+    removed = std::move(*it);
+    callBacks.erase(it);
+    update_effective_verbosity();
+    if (!removed.worker) {
+      if (removed.flush) {
+        removed.flush(removed.user_data);
+      }
+      if (removed.close) {
+        removed.close(removed.user_data);
+      }
+      return true;
+    }
+  }
+  removed.worker->Stop();
+  return true;
+}
+
+//* 需要持有 locker
+static void update_effective_verbosity() {
+  int max_verbosity = MAXVERBOSITY_TO_STDERR;
+  for (auto &callBack : callBacks) {
+    max_verbosity =
+        std::max(max_verbosity, static_cast<int>(callBack.max_verbosit));
+  }
+  //* fatal 永远不能被过滤
+  max_verbosity =
+      std::max(max_verbosity, static_cast<int>(Verbosity::VerbosityFATAL));
+  auto recorder = recorder_max_verbosity.load(std::memory_order_relaxed);
+  default_site_verbosity.store(std::max(max_verbosity, recorder),
+                               std::memory_order_relaxed);
+  max_verbosity = std::max(
+      max_verbosity, module_max_verbosity.load(std::memory_order_relaxed));
+  sink_max_verbosity.store(max_verbosity, std::memory_order_relaxed);
+  max_verbosity = std::max(max_verbosity, recorder);
+  effective_max_verbosity.store(max_verbosity, std::memory_order_relaxed);
+  invalidate_sites();
+}
+
+void Set_stderr_verbosity(Verbosity verbosity) {
+  std::unique_lock<std::recursive_mutex> lock(locker);
+  MAXVERBOSITY_TO_STDERR = static_cast<int8_t>(verbosity);
+  update_effective_verbosity();
+}
+
+void file_log(void *user_data, Message &message) {
+  auto file = reinterpret_cast<FILE *>(user_data);
+  fprintf(file, "%s%s\n", message.prefix, message.raw_message);
+  if (flush_immediately()) {
+    fflush(file);
+  }
+}
+
+void batch_file_log(void *user_data, Message &message) {
+  auto writer = reinterpret_cast<BatchWriter *>(user_data);
+  iovec pieces[] = {
+      {const_cast<char *>(message.prefix), strlen(message.prefix)},
+      {const_cast<char *>(message.raw_message), strlen(message.raw_message)},
+      {const_cast<char *>("\n"), 1},
+  };
+  writer->Write(pieces, 3, flush_immediately());
+}
+
+void batch_file_flush(void *user_data) {
+  reinterpret_cast<BatchWriter *>(user_data)->Flush();
+}
+
+void batch_file_close(void *user_data) {
+  auto writer = reinterpret_cast<BatchWriter *>(user_data);
+  writer->Flush();
+  close(writer->Fd());
+  delete writer;
+}
+
+void file_flush(void *user_data) {
+  auto file = reinterpret_cast<FILE *>(user_data);
+  fflush(file);
+}
+
+void file_close(void *user_data) {
+  auto file = reinterpret_cast<FILE *>(user_data);
+  if (file) {
+    fclose(file);
+  }
+}
+
+/*********************************binary file*********************************/
+struct BinaryFile {
+  FILE *file;
+  //* 调用点字典: 延迟记录以 CallSite 地址为键, 文本记录以 (file, line) 为键
+  std::map<std::pair<const void *, unsigned int>, uint64_t> sites;
+  std::map<std::array<char, THREADNAME_WIDTH + 1>, uint64_t> threads;
+  long last_ms{0};
+  long last_uptime_ms{0};
+};
+
+static void put_varint(FILE *file, uint64_t value) {
+  uint8_t buffer[10];
+  size_t len = 0;
+  do {
+    buffer[len] = value & 0x7F;
+    value >>= 7;
+    if (value) {
+      buffer[len] |= 0x80;
+    }
+    ++len;
+  } while (value);
+  fwrite(buffer, 1, len, file);
+}
+
+static void put_signed_varint(FILE *file, int64_t value) {
+  put_varint(file, (static_cast<uint64_t>(value) << 1) ^
+                       static_cast<uint64_t>(value >> 63));
+}
+
+static void put_string(FILE *file, const char *str) {
+  auto len = strlen(str);
+  put_varint(file, len);
+  fwrite(str, 1, len, file);
+}
+
+void binary_file_log(void *user_data, Message &message) {
+  auto binary = reinterpret_cast<BinaryFile *>(user_data);
+  auto file = binary->file;
+
+  //* 文本记录当作格式串为 "%s" 的调用点
+  auto key = message.site ? std::make_pair<const void *, unsigned int>(
+                                message.site, 0)
+                          : std::make_pair<const void *, unsigned int>(
+                                message.file, message.line + 1);
+  auto site = binary->sites.find(key);
+  if (site == binary->sites.end()) {
+    site = binary->sites.emplace(key, binary->sites.size()).first;
+    fputc('S', file);
+    put_varint(file, site->second);
+    put_varint(file, message.line);
+    put_string(file, message.file ? message.file : "");
+    put_string(file, message.site ? message.site->format : "%s");
+  }
+
+  std::array<char, THREADNAME_WIDTH + 1> name{};
+  if (message.thread_name) {
+    strncpy(name.data(), message.thread_name, THREADNAME_WIDTH);
+  }
+  auto thread = binary->threads.find(name);
+  if (thread == binary->threads.end()) {
+    thread = binary->threads.emplace(name, binary->threads.size()).first;
+    fputc('T', file);
+    put_varint(file, thread->second);
+    put_string(file, name.data());
+  }
+
+  bool with_prefix = message.prefix && message.prefix[0];
+  fputc('R', file);
+  put_varint(file, site->second);
+  put_signed_varint(file, static_cast<int>(message.verbosity));
+  fputc(with_prefix ? 1 : 0, file);
+  if (with_prefix) {
+    put_signed_varint(file, message.ms_since_epoch - binary->last_ms);
+    put_signed_varint(file, message.uptime_ms - binary->last_uptime_ms);
+    binary->last_ms = message.ms_since_epoch;
+    binary->last_uptime_ms = message.uptime_ms;
+  } else {
+    put_signed_varint(file, 0);
+    put_signed_varint(file, 0);
+  }
+  put_varint(file, thread->second);
+  if (message.site) {
+    put_varint(file, message.args_size);
+    fwrite(message.args, 1, message.args_size, file);
+  } else {
+    //* 与 encode_arg 对 const char * 的编码一致
+    char header[1 + sizeof(uint32_t)];
+    auto len = static_cast<uint32_t>(strlen(message.raw_message));
+    header[0] = static_cast<char>(ArgType::String);
+    memcpy(header + 1, &len, sizeof len);
+    put_varint(file, sizeof header + len);
+    fwrite(header, 1, sizeof header, file);
+    fwrite(message.raw_message, 1, len, file);
+  }
+  if (flush_immediately()) {
+    fflush(file);
+  }
+}
+
+void binary_file_flush(void *user_data) {
+  auto binary = reinterpret_cast<BinaryFile *>(user_data);
+  fflush(binary->file);
+}
+
+void binary_file_close(void *user_data) {
+  auto binary = reinterpret_cast<BinaryFile *>(user_data);
+  if (binary->file) {
+    fclose(binary->file);
+  }
+  delete binary;
+}
+
+auto Add_binary_file(const char *path_in, FileMode filemode,
+                     Verbosity verbosity) -> bool {
+  char path[FILENAME_MAX];
+  prepare_path(path_in, path);
+  const char *mode = filemode == FileMode::Truncate ? "wb" : "ab";
+  FILE *file = fopen(path, mode);
+  if (!file) {
+    LOG(ERROR, "failed to open file: %s", path);
+    return false;
+  }
+  //* 追加模式下重新写一个文件头, 解码器据此重置字典
+  fwrite(BINARY_LOG_MAGIC, 1, sizeof(BINARY_LOG_MAGIC) - 1, file);
+
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  auto binary = new BinaryFile{.file = file};
+  add_callBack(binary, binary_file_log, binary_file_flush, binary_file_close,
+               verbosity);
+
+  LOG(MESSAGE, "BINARY FILE:%-*s FileMode:%-*s Verbosity:%-*s",
+      FILENAME_WIDTH, path_in, 5, mode, 6, get_verbosity_name(verbosity));
+  return true;
+}
+
+/*********************************mmap file*********************************/
+//* 文件按 MMAP_CHUNK_SIZE 预分配, 记录直接拷贝到映射窗口中
+#define MMAP_CHUNK_SIZE (16 * 1024 * 1024)
+
+class MmapFile {
+public:
+  MmapFile(int fd, size_t size) : fd(fd), size(size) {}
+
+  MmapFile(const MmapFile &) = delete;
+  auto operator=(const MmapFile &) -> MmapFile & = delete;
+
+  void Write(const char *data, size_t len) {
+    while (len > 0) {
+      if (!window || size >= window_offset + MMAP_CHUNK_SIZE) {
+        if (!Remap()) {
+          return;
+        }
+      }
+      auto room = window_offset + MMAP_CHUNK_SIZE - size;
+      auto bytes = std::min(room, len);
+      memcpy(window + (size - window_offset), data, bytes);
+      size += bytes;
+      data += bytes;
+      len -= bytes;
+    }
+  }
+
+  //* 把上次 flush 之后写入的页交给内核回写
+  void Flush() {
+    if (!window || synced >= size) {
+      return;
+    }
+    auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto begin = std::max(synced, window_offset) & ~(page - 1);
+    msync(window + (begin - window_offset), size - begin, MS_ASYNC);
+    synced = size;
+  }
+
+  //* 去掉预分配但没有用到的部分
+  void Close() {
+    Flush();
+    if (window) {
+      munmap(window, MMAP_CHUNK_SIZE);
+      window = nullptr;
+    }
+    if (ftruncate(fd, size) == -1) {
+      write_to_stderr("log_what: failed to truncate mmap file\n");
+    }
+    close(fd);
+  }
+
+private:
+  //* 窗口移动到 size 所在的块, 并预分配对应的磁盘空间
+  auto Remap() -> bool {
+    if (window) {
+      Flush();
+      munmap(window, MMAP_CHUNK_SIZE);
+      window = nullptr;
+    }
+    window_offset = size / MMAP_CHUNK_SIZE * MMAP_CHUNK_SIZE;
+    auto end = window_offset + MMAP_CHUNK_SIZE;
+    if (fallocate(fd, 0, window_offset, MMAP_CHUNK_SIZE) == -1 &&
+        ftruncate(fd, end) == -1) {
+      write_to_stderr("log_what: failed to allocate mmap file\n");
+      return false;
+    }
+    auto addr = mmap(nullptr, MMAP_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, window_offset);
+    if (addr == MAP_FAILED) {
+      write_to_stderr("log_what: failed to mmap file\n");
+      return false;
+    }
+    madvise(addr, MMAP_CHUNK_SIZE, MADV_SEQUENTIAL);
+    window = static_cast<char *>(addr);
+    return true;
+  }
+
+  int fd;
+  size_t size;            //* 已写入的逻辑长度
+  size_t synced{0};       //* 已经 msync 过的长度
+  size_t window_offset{0};
+  char *window{nullptr};
+};
+
+//* 进程崩溃时文件末尾会残留预分配的 '\0', 追加时从最后一个非 '\0' 字节之后开始
+static auto mmap_file_end(int fd) -> size_t {
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    return 0;
+  }
+  auto end = static_cast<size_t>(st.st_size);
+  char buffer[4096];
+  while (end > 0) {
+    auto len = std::min(end, sizeof buffer);
+    if (pread(fd, buffer, len, end - len) != static_cast<ssize_t>(len)) {
+      break;
+    }
+    size_t i = len;
+    while (i > 0 && buffer[i - 1] == '\0') {
+      --i;
+    }
+    if (i > 0) {
+      return end - len + i;
+    }
+    end -= len;
+  }
+  return end;
+}
+
+void mmap_file_log(void *user_data, Message &message) {
+  auto file = reinterpret_cast<MmapFile *>(user_data);
+  file->Write(message.prefix, strlen(message.prefix));
+  file->Write(message.raw_message, strlen(message.raw_message));
+  file->Write("\n", 1);
+}
+
+void mmap_file_flush(void *user_data) {
+  reinterpret_cast<MmapFile *>(user_data)->Flush();
+}
+
+void mmap_file_close(void *user_data) {
+  auto file = reinterpret_cast<MmapFile *>(user_data);
+  file->Close();
+  delete file;
+}
+
+auto Add_mmap_file(const char *path_in, FileMode filemode, Verbosity verbosity)
+    -> bool {
+  char path[FILENAME_MAX];
+  prepare_path(path_in, path);
+  const char *mode = filemode == FileMode::Truncate ? "w" : "a";
+  int flags = O_RDWR | O_CREAT | O_CLOEXEC |
+              (filemode == FileMode::Truncate ? O_TRUNC : 0);
+  int fd = open(path, flags, 0644);
+  if (fd == -1) {
+    LOG(ERROR, "failed to open file: %s", path);
+    return false;
+  }
+
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  auto file = new MmapFile(fd, mmap_file_end(fd));
+  add_callBack(file, mmap_file_log, mmap_file_flush, mmap_file_close,
+               verbosity);
+
+  LOG(MESSAGE, "MMAP FILE:%-*s FileMode:%-*s Verbosity:%-*s", FILENAME_WIDTH,
+      path_in, 5, mode, 6, get_verbosity_name(verbosity));
+  return true;
+}
+
+/*********************************rotating file*********************************/
+//* 轮转时写日志的线程只把 fd 切换到提前创建好的备用文件 <path>.next;
+//* rename 和创建下一个备用文件在 rotate 线程完成, 压缩和清理在 SCHED_IDLE 的压缩线程完成
+#define ROTATE_SPARE_SUFFIX ".next"
+//* 备用文件创建失败后重试的间隔
+#define ROTATE_RETRY_MS 1000
+
+//* 按顺序执行提交的任务的后台线程, 第一次提交时创建
+class JobThread {
+public:
+  explicit JobThread(bool idle) : idle(idle) {}
+
+  void Submit(std::function<void()> job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!thread) {
+      stop = false;
+      thread = new std::thread([this] { Loop(); });
+    }
+    jobs.push_back(std::move(job));
+    cv.notify_one();
+  }
+
+  //* 处理完剩余的任务后退出
+  void Stop() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      stop = true;
+      cv.notify_one();
+    }
+    if (thread) {
+      thread->join();
+      delete thread;
+      thread = nullptr;
+    }
+  }
+
+private:
+  void Loop() {
+    if (idle) { //* SCHED_IDLE: 只在 CPU 空闲时运行, 不和业务线程抢时间
+      sched_param param{};
+      pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [this] { return stop || !jobs.empty(); });
+      if (jobs.empty()) {
+        break;
+      }
+      auto job = std::move(jobs.front());
+      jobs.erase(jobs.begin());
+      lock.unlock();
+      job();
+      lock.lock();
+    }
+  }
+
+  const bool idle;
+  std::thread *thread{nullptr};
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::function<void()>> jobs;
+  bool stop{false};
+};
+
+static JobThread rotate_thread{false};
+static JobThread compress_thread{true};
+
+#ifdef LOG_WHAT_HAS_ZLIB
+static auto gzip_file(const std::string &path) -> bool {
+  auto gz_path = path + ".gz";
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  auto gz = gzopen(gz_path.c_str(), "wb6");
+  if (!gz) {
+    close(fd);
+    return false;
+  }
+  char buffer[64 * 1024];
+  ssize_t bytes;
+  bool ok = true;
+  while ((bytes = read(fd, buffer, sizeof buffer)) > 0) {
+    if (gzwrite(gz, buffer, static_cast<unsigned>(bytes)) != bytes) {
+      ok = false;
+      break;
+    }
+  }
+  close(fd);
+  if (gzclose(gz) != Z_OK || bytes < 0 || !ok) {
+    unlink(gz_path.c_str());
+    return false;
+  }
+  unlink(path.c_str());
+  return true;
+}
+#endif
+
+//* 只匹配轮转出来的文件名 <name>.YYYYmmdd-HHMMSS.NNN, 可以带 .gz
+static auto is_rotated_name(const char *name, const std::string &prefix)
+    -> bool {
+  if (strncmp(name, prefix.c_str(), prefix.size()) != 0) {
+    return false;
+  }
+  auto p = name + prefix.size();
+  auto digits = [&p](int count) {
+    for (int i = 0; i < count; ++i, ++p) {
+      if (!isdigit(static_cast<unsigned char>(*p))) {
+        return false;
+      }
+    }
+    return true;
+  };
+  if (!digits(8) || *p++ != '-' || !digits(6) || *p++ != '.' || !digits(3)) {
+    return false;
+  }
+  while (isdigit(static_cast<unsigned char>(*p))) {
+    ++p;
+  }
+  return *p == '\0' || strcmp(p, ".gz") == 0;
+}
+
+//* 只保留最新的 max_files 个历史文件
+static void remove_old_files(const std::string &base, int max_files) {
+  if (max_files <= 0) {
+    return;
+  }
+  auto slash = base.rfind('/');
+  auto dir = slash == std::string::npos ? std::string(".")
+                                        : base.substr(0, slash + 1);
+  auto prefix =
+      (slash == std::string::npos ? base : base.substr(slash + 1)) + ".";
+  auto dp = opendir(dir.c_str());
+  if (!dp) {
+    return;
+  }
+  std::vector<std::string> rotated;
+  while (auto entry = readdir(dp)) {
+    if (is_rotated_name(entry->d_name, prefix)) {
+      rotated.emplace_back(entry->d_name);
+    }
+  }
+  closedir(dp);
+  if (rotated.size() <= static_cast<size_t>(max_files)) {
+    return;
+  }
+  std::sort(rotated.begin(), rotated.end());
+  for (size_t i = 0; i + max_files < rotated.size(); ++i) {
+    auto path =
+        slash == std::string::npos ? rotated[i] : dir + rotated[i];
+    unlink(path.c_str());
+  }
+}
+
+//* 处理完剩余的任务后退出: 先完成 rename, 再完成它们提交的压缩
+static void stop_compress_thread() {
+  rotate_thread.Stop();
+  compress_thread.Stop();
+}
+
+//* 写日志的线程和 rotate 线程共享, 文件关闭后 rotate 线程还可能持有
+struct RotateSpare {
+  std::mutex mutex;
+  int fd{-1};             //* 已经创建好的备用文件
+  bool preparing{false};  //* rotate 线程正在 rename 或创建备用文件
+  bool closed{false};
+  long retry_ms{0};       //* 创建失败后下一次重试的时间
+};
+
+struct RotatingFile {
+  std::string path;
+  RotateOptions options;
+  BatchWriter writer;
+  size_t size;
+  long opened_ms;
+  std::shared_ptr<RotateSpare> spare;
+};
+
+static auto open_log_file(const char *path, bool truncate) -> int {
+  return open(path,
+              O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : O_APPEND),
+              0644);
+}
+
+//* log.txt -> log.txt.20240210-121535.000, 序号区分同一秒内的多次轮转,
+//* 这样按文件名排序就是按时间排序
+static auto rotated_name(const std::string &path, long now_ms) -> std::string {
+  char rotated[FILENAME_MAX];
+  tm time_info;
+  auto sec = time_t(now_ms / 1000);
+  localtime_r(&sec, &time_info);
+  int len = snprintf(rotated, sizeof rotated, "%s.", path.c_str());
+  strftime(rotated + len, sizeof rotated - len, "%Y%m%d-%H%M%S", &time_info);
+  len = strlen(rotated);
+  struct stat st;
+  for (int n = 0;; ++n) {
+    snprintf(rotated + len, sizeof rotated - len, ".%03d", n);
+    if (stat(rotated, &st) != 0 &&
+        stat((std::string(rotated) + ".gz").c_str(), &st) != 0) {
+      break;
+    }
+  }
+  return rotated;
+}
+
+//* 在 rotate 线程上创建下一个备用文件; O_EXCL 保证不会截断正在写的文件
+static void prepare_spare(const std::string &path,
+                          const std::shared_ptr<RotateSpare> &spare,
+                          long now_ms) {
+  auto spare_path = path + ROTATE_SPARE_SUFFIX;
+  int fd = open(spare_path.c_str(),
+                O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+  std::unique_lock<std::mutex> lock(spare->mutex);
+  spare->preparing = false;
+  if (fd == -1) {
+    spare->retry_ms = now_ms + ROTATE_RETRY_MS;
+    write_to_stderr("log_what: failed to create spare log file\n");
+  } else if (spare->closed) {
+    close(fd);
+    unlink(spare_path.c_str());
+  } else {
+    spare->fd = fd;
+  }
+}
+
+//* 在 rotate 线程上完成轮转: 旧文件改为历史文件名, 备用文件(已经在写)改为 path
+static void finish_rotation(const std::string &path, int old_fd,
+                            const RotateOptions &options,
+                            const std::shared_ptr<RotateSpare> &spare,
+                            long now_ms) {
+  close(old_fd);
+  auto rotated = rotated_name(path, now_ms);
+  if (rename(path.c_str(), rotated.c_str()) == -1) {
+    write_to_stderr("log_what: failed to rotate log file\n");
+  }
+  if (rename((path + ROTATE_SPARE_SUFFIX).c_str(), path.c_str()) == -1) {
+    write_to_stderr("log_what: failed to rename spare log file\n");
+  }
+  prepare_spare(path, spare, now_ms);
+  compress_thread.Submit([rotated, path, options] {
+#ifdef LOG_WHAT_HAS_ZLIB
+    if (options.compress && !gzip_file(rotated)) {
+      write_to_stderr("log_what: failed to compress rotated file\n");
+    }
+#endif
+    remove_old_files(path, options.max_files);
+  });
+}
+
+//* 写日志的线程上只切换 fd; 备用文件还没有准备好时继续写当前文件,
+//* 需要时(失败后按 ROTATE_RETRY_MS 间隔)让 rotate 线程重新创建
+static void rotate_file(RotatingFile &file, long now_ms) {
+  auto spare = file.spare;
+  std::unique_lock<std::mutex> lock(spare->mutex);
+  if (spare->fd == -1) {
+    if (!spare->preparing && now_ms >= spare->retry_ms) {
+      spare->preparing = true;
+      lock.unlock();
+      rotate_thread.Submit([path = file.path, spare, now_ms] {
+        prepare_spare(path, spare, now_ms);
+      });
+    }
+    return;
+  }
+  int fd = spare->fd;
+  spare->fd = -1;
+  spare->preparing = true;
+  lock.unlock();
+
+  auto old_fd = file.writer.Reset(fd);
+  file.size = 0;
+  file.opened_ms = now_ms;
+  rotate_thread.Submit(
+      [path = file.path, old_fd, options = file.options, spare, now_ms] {
+        finish_rotation(path, old_fd, options, spare, now_ms);
+      });
+}
+
+void rotating_file_log(void *user_data, Message &message) {
+  auto file = reinterpret_cast<RotatingFile *>(user_data);
+  auto prefix_len = strlen(message.prefix);
+  auto message_len = strlen(message.raw_message);
+  auto len = prefix_len + message_len + 1;
+
+  auto now_ms = message.ms_since_epoch;
+  if (!now_ms) { //* 同步的 raw log 没有时间戳
+    now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                 std::chrono::system_clock::now().time_since_epoch())
+                 .count();
+  }
+  auto &options = file->options;
+  if (file->size > 0 &&
+      ((options.max_bytes && file->size + len > options.max_bytes) ||
+       (options.max_age_sec &&
+        now_ms - file->opened_ms >= options.max_age_sec * 1000))) {
+    rotate_file(*file, now_ms);
+  }
+
+  iovec pieces[] = {
+      {const_cast<char *>(message.prefix), prefix_len},
+      {const_cast<char *>(message.raw_message), message_len},
+      {const_cast<char *>("\n"), 1},
+  };
+  file->writer.Write(pieces, 3, flush_immediately());
+  file->size += len;
+}
+
+void rotating_file_flush(void *user_data) {
+  reinterpret_cast<RotatingFile *>(user_data)->writer.Flush();
+}
+
+//* 没有用上的备用文件在这里删除, 正在创建的由 prepare_spare() 删除
+void rotating_file_close(void *user_data) {
+  auto file = reinterpret_cast<RotatingFile *>(user_data);
+  close(file->writer.Reset(-1));
+  {
+    std::unique_lock<std::mutex> lock(file->spare->mutex);
+    file->spare->closed = true;
+    if (file->spare->fd != -1) {
+      close(file->spare->fd);
+      file->spare->fd = -1;
+      unlink((file->path + ROTATE_SPARE_SUFFIX).c_str());
+    }
+  }
+  delete file;
+}
+
+auto Add_rotating_file(const char *path_in, FileMode filemode,
+                       Verbosity verbosity, const RotateOptions &options)
+    -> bool {
+  char path[FILENAME_MAX];
+  prepare_path(path_in, path);
+  const char *mode = filemode == FileMode::Truncate ? "w" : "a";
+  int fd = open_log_file(path, filemode == FileMode::Truncate);
+  if (fd == -1) {
+    LOG(ERROR, "failed to open file: %s", path);
+    return false;
+  }
+  struct stat st;
+  size_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+  long now_ms, uptime_ms;
+  current_time(now_ms, uptime_ms);
+
+  //* 上次运行在切换 fd 之后、rename 之前退出时, 备用文件中还有日志, 先作为历史文件保留
+  auto spare_path = std::string(path) + ROTATE_SPARE_SUFFIX;
+  if (stat(spare_path.c_str(), &st) == 0 && st.st_size > 0) {
+    rename(spare_path.c_str(), rotated_name(path, now_ms).c_str());
+  }
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  auto spare = std::make_shared<RotateSpare>();
+  spare->fd = open_log_file(spare_path.c_str(), true);
+  if (spare->fd == -1) {
+    spare->retry_ms = now_ms + ROTATE_RETRY_MS;
+  }
+
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  auto file = new RotatingFile{.path = path,
+                               .options = options,
+                               .writer = BatchWriter(fd),
+                               .size = size,
+                               .opened_ms = now_ms,
+                               .spare = std::move(spare)};
+  add_callBack(file, rotating_file_log, rotating_file_flush,
+               rotating_file_close, verbosity);
+
+  LOG(MESSAGE,
+      "ROTATING FILE:%-*s FileMode:%-*s Verbosity:%-*s max_bytes:%zu "
+      "max_age:%lds max_files:%d",
+      FILENAME_WIDTH, path_in, 5, mode, 6, get_verbosity_name(verbosity),
+      options.max_bytes, options.max_age_sec, options.max_files);
+  return true;
+}
+
+/*********************************indexed file*********************************/
+struct IndexedFile {
+  BatchWriter writer;
+  BatchWriter index;
+  IndexOptions options;
+  uint64_t offset; //* 日志文件的当前长度
+  IndexBlock block;
+};
+
+static auto verbosity_bit(Verbosity verbosity) -> uint32_t {
+  auto bit = static_cast<int>(verbosity) -
+             static_cast<int>(Verbosity::VerbosityFATAL);
+  return bit >= 0 && bit < 32 ? 1u << bit : 0;
+}
+
+//* 写出当前块并开始下一个块, 下一个块的 max_ms 从这个块继承
+static void finish_index_block(IndexedFile &file, bool immediately) {
+  if (file.block.records) {
+    iovec piece{&file.block, sizeof file.block};
+    file.index.Write(&piece, 1, immediately);
+  }
+  file.block = IndexBlock{.offset = file.offset,
+                          .length = 0,
+                          .min_ms = INT64_MAX,
+                          .max_ms = file.block.max_ms,
+                          .records = 0,
+                          .levels = 0};
+}
+
+//* 返回已有索引的最后一个块的 max_ms; 没有可用的索引时重写文件头, 返回 -1
+//* 索引超出日志文件的长度时(日志文件被截断或者替换过)整个丢弃
+static auto open_index(int fd, bool truncate, uint64_t log_size) -> int64_t {
+  struct stat st;
+  char magic[sizeof(LOG_INDEX_MAGIC) - 1];
+  if (!truncate && fstat(fd, &st) == 0 &&
+      static_cast<size_t>(st.st_size) >= sizeof magic &&
+      pread(fd, magic, sizeof magic, 0) == sizeof magic &&
+      memcmp(magic, LOG_INDEX_MAGIC, sizeof magic) == 0) {
+    auto blocks = (st.st_size - sizeof magic) / sizeof(IndexBlock);
+    IndexBlock last;
+    //* 丢弃不完整的块(进程在写索引时崩溃)
+    if (blocks > 0 &&
+        ftruncate(fd, sizeof magic + blocks * sizeof(IndexBlock)) == 0 &&
+        pread(fd, &last, sizeof last,
+              sizeof magic + (blocks - 1) * sizeof last) == sizeof last &&
+        last.offset + last.length <= log_size) {
+      return last.max_ms;
+    }
+  }
+  if (ftruncate(fd, 0) == 0) {
+    write(fd, LOG_INDEX_MAGIC, sizeof magic);
+  }
+  return -1;
+}
+
+auto Add_indexed_file(const char *path_in, FileMode filemode,
+                      Verbosity verbosity, const IndexOptions &options)
+    -> bool {
+  char path[FILENAME_MAX];
+  prepare_path(path_in, path);
+  const char *mode = filemode == FileMode::Truncate ? "w" : "a";
+  bool truncate = filemode == FileMode::Truncate;
+  int fd = open_log_file(path, truncate);
+  if (fd == -1) {
+    LOG(ERROR, "failed to open file: %s", path);
+    return false;
+  }
+  std::string index_path = std::string(path) + ".idx";
+  int index_fd = open(index_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (index_fd == -1) {
+    LOG(ERROR, "failed to open file: %s", index_path.c_str());
+    close(fd);
+    return false;
+  }
+  struct stat st;
+  uint64_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+  auto max_ms = open_index(index_fd, truncate, size);
+  lseek(index_fd, 0, SEEK_END);
+  long now_ms, uptime_ms;
+  current_time(now_ms, uptime_ms);
+
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  auto file = new IndexedFile{.writer = BatchWriter(fd),
+                              .index = BatchWriter(index_fd),
+                              .options = options,
+                              .offset = size,
+                              .block = IndexBlock{}};
+  if (max_ms == -1 && size > 0) {
+    //* 没有索引的已有内容作为一个块: 时间只知道不晚于现在
+    file->block = IndexBlock{.offset = 0,
+                             .length = size,
+                             .min_ms = 0,
+                             .max_ms = now_ms,
+                             .records = 1,
+                             .levels = UINT32_MAX};
+  } else {
+    file->block.max_ms = std::max<int64_t>(max_ms, 0);
+  }
+  finish_index_block(*file, true);
+  add_callBack(file, indexed_file_log, indexed_file_flush, indexed_file_close,
+               verbosity);
+
+  LOG(MESSAGE,
+      "INDEXED FILE:%-*s FileMode:%-*s Verbosity:%-*s every_records:%zu "
+      "every_bytes:%zu",
+      FILENAME_WIDTH, path_in, 5, mode, 6, get_verbosity_name(verbosity),
+      options.every_records, options.every_bytes);
+  return true;
+}
+
+void indexed_file_log(void *user_data, Message &message) {
+  auto &file = *reinterpret_cast<IndexedFile *>(user_data);
+  iovec pieces[] = {
+      {const_cast<char *>(message.prefix), strlen(message.prefix)},
+      {const_cast<char *>(message.raw_message), strlen(message.raw_message)},
+      {const_cast<char *>("\n"), 1},
+  };
+  auto bytes = pieces[0].iov_len + pieces[1].iov_len + 1;
+  auto immediately = flush_immediately();
+  file.writer.Write(pieces, 3, immediately);
+  file.offset += bytes;
+
+  auto &block = file.block;
+  block.length += bytes;
+  ++block.records;
+  block.levels |= verbosity_bit(message.verbosity);
+  if (message.prefix[0]) { //* raw_log 没有时间戳
+    block.min_ms = std::min<int64_t>(block.min_ms, message.ms_since_epoch);
+    block.max_ms = std::max<int64_t>(block.max_ms, message.ms_since_epoch);
+  }
+  if ((file.options.every_records &&
+       block.records >= file.options.every_records) ||
+      (file.options.every_bytes && block.length >= file.options.every_bytes)) {
+    finish_index_block(file, immediately);
+  }
+}
+
+//* 块要写满才进入索引, 末尾未完成的块由 log_what_query 直接扫描
+void indexed_file_flush(void *user_data) {
+  auto &file = *reinterpret_cast<IndexedFile *>(user_data);
+  file.writer.Flush();
+  file.index.Flush();
+}
+
+void indexed_file_close(void *user_data) {
+  auto file = reinterpret_cast<IndexedFile *>(user_data);
+  finish_index_block(*file, false);
+  file->writer.Flush();
+  file->index.Flush();
+  close(file->writer.Fd());
+  close(file->index.Fd());
+  delete file;
+}
+
+/*********************************io_uring file*********************************/
+//* 直接使用 io_uring 的系统调用, 不依赖 liburing
+class Uring {
+public:
+  Uring(const Uring &) = delete;
+  auto operator=(const Uring &) -> Uring & = delete;
+
+  Uring() = default;
+
+  ~Uring() {
+    if (sq_ring != MAP_FAILED) {
+      munmap(sq_ring, sq_ring_size);
+    }
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, sqes_size);
+    }
+    if (ring_fd != -1) {
+      close(ring_fd);
+    }
+  }
+
+  //* 内核不支持(或被 seccomp 禁止)时返回 false
+  auto Init(unsigned entries) -> bool {
+    io_uring_params params{};
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd == -1) {
+      return false;
+    }
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+      return false;
+    }
+    cq_ring = single_mmap ? sq_ring
+                          : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ring_fd,
+                                 IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      return false;
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+    auto sq = static_cast<char *>(sq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    auto cq = static_cast<char *>(cq_ring);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  //* 提交一个写请求, 调用者保证在途的请求数不超过 entries;
+  //* 返回 false 时请求没有进入内核, SQE 已经收回, 不会再有它的完成事件
+  auto Write(int fd, const char *data, unsigned len, uint64_t offset,
+             uint64_t user_data) -> bool {
+    auto tail = *sq_tail;
+    auto index = tail & sq_mask;
+    auto &sqe = static_cast<io_uring_sqe *>(sqes)[index];
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_WRITE;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(data);
+    sqe.len = len;
+    sqe.off = offset;
+    sqe.user_data = user_data;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (Enter(1, 0) == 1) {
+      return true;
+    }
+    //* 没有 SQPOLL 时内核只在 io_uring_enter 中读取 SQ; head 没有前进说明没有取走,
+    //* 收回 tail, 否则之后的 io_uring_enter 会用已经复用的缓冲区提交它
+    if (__atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == tail) {
+      __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+      return false;
+    }
+    return true;
+  }
+
+  //* 取出一个完成事件, wait 为 true 时阻塞等待
+  auto Complete(bool wait, uint64_t &user_data, int &result) -> bool {
+    while (true) {
+      auto head = *cq_head;
+      if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        auto &cqe = cqes[head & cq_mask];
+        user_data = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+      if (!wait || Enter(0, 1) < 0) {
+        return false;
+      }
+    }
+  }
+
+private:
+  //* 返回提交的请求数, 失败时返回 -1
+  auto Enter(unsigned to_submit, unsigned min_complete) -> long {
+    while (true) {
+      auto ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                         min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+      if (ret >= 0 || errno != EINTR) {
+        return ret;
+      }
+    }
+  }
+
+  int ring_fd{-1};
+  void *sq_ring{MAP_FAILED};
+  void *cq_ring{MAP_FAILED};
+  void *sqes{MAP_FAILED};
+  size_t sq_ring_size{0};
+  size_t cq_ring_size{0};
+  size_t sqes_size{0};
+  unsigned *sq_head{nullptr};
+  unsigned *sq_tail{nullptr};
+  unsigned sq_mask{0};
+  unsigned *sq_array{nullptr};
+  unsigned *cq_head{nullptr};
+  unsigned *cq_tail{nullptr};
+  unsigned cq_mask{0};
+  io_uring_cqe *cqes{nullptr};
+};
+
+#define URING_BUFFERS 4
+#define URING_BUFFER_SIZE (256 * 1024)
+
+//* 多个缓冲区轮流使用: 写满一个就提交给 io_uring, 继续写下一个;
+//* 只有所有缓冲区都在途时才需要等待完成事件
+class UringFile {
+public:
+  UringFile(int fd, uint64_t offset) : fd(fd), offset(offset) {
+    use_uring = uring.Init(URING_BUFFERS);
+    for (auto &buffer : buffers) {
+      buffer.data = static_cast<char *>(counted_malloc(URING_BUFFER_SIZE));
+    }
+  }
+
+  UringFile(const UringFile &) = delete;
+  auto operator=(const UringFile &) -> UringFile & = delete;
+
+  ~UringFile() {
+    for (auto &buffer : buffers) {
+      free(buffer.data);
+    }
+  }
+
+  void Write(const char *data, size_t len) {
+    while (len > 0) {
+      auto &buffer = buffers[current];
+      auto bytes = std::min(len, URING_BUFFER_SIZE - buffer.used);
+      memcpy(buffer.data + buffer.used, data, bytes);
+      buffer.used += bytes;
+      data += bytes;
+      len -= bytes;
+      if (buffer.used == URING_BUFFER_SIZE) {
+        Submit_current();
+      }
+    }
+  }
+
+  //* 提交当前缓冲区并等待所有在途的写完成
+  void Flush() {
+    if (buffers[current].used) {
+      Submit_current();
+    }
+    while (in_flight > 0) {
+      Reap(true);
+    }
+  }
+
+  auto Fd() const -> int { return fd; }
+
+  auto Uses_uring() const -> bool { return use_uring; }
+
+private:
+  struct Buffer {
+    char *data;
+    size_t used{0};
+    size_t written{0};
+    uint64_t offset{0};
+    bool busy{false};
+  };
+
+  void Submit_current() {
+    auto &buffer = buffers[current];
+    buffer.offset = offset;
+    buffer.written = 0;
+    offset += buffer.used;
+    Submit(current);
+    current = (current + 1) % URING_BUFFERS;
+    while (buffers[current].busy) {
+      Reap(true);
+    }
+  }
+
+  void Submit(int index) {
+    auto &buffer = buffers[index];
+    auto data = buffer.data + buffer.written;
+    auto len = buffer.used - buffer.written;
+    auto pos = buffer.offset + buffer.written;
+    if (use_uring) {
+      if (uring.Write(fd, data, static_cast<unsigned>(len), pos, index)) {
+        buffer.busy = true;
+        ++in_flight;
+        return;
+      }
+      //* 提交失败后不再使用 io_uring, 已经在途的请求仍然由 Reap() 收取
+      use_uring = false;
+    }
+    Write_sync(index);
+  }
+
+  //* 不支持 io_uring 时退回到同步的 pwrite, 写出缓冲区中剩余的部分
+  void Write_sync(int index) {
+    auto &buffer = buffers[index];
+    auto data = buffer.data + buffer.written;
+    auto len = buffer.used - buffer.written;
+    auto pos = buffer.offset + buffer.written;
+    while (len > 0) {
+      auto bytes = pwrite(fd, data, len, pos);
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes <= 0) {
+        write_to_stderr("log_what: failed to write io_uring file\n");
+        break;
+      }
+      data += bytes;
+      pos += bytes;
+      len -= bytes;
+    }
+    buffer.used = 0;
+  }
+
+  void Reap(bool wait) {
+    uint64_t index;
+    int result;
+    if (!uring.Complete(wait, index, result)) {
+      if (wait) { //* io_uring_enter 失败, 之后全部走 pwrite
+        use_uring = false;
+        Abandon_in_flight();
+      }
+      return;
+    }
+    auto &buffer = buffers[index];
+    buffer.busy = false;
+    --in_flight;
+    if (result > 0 && buffer.written + result < buffer.used) {
+      buffer.written += result; //* 部分写, 提交剩余部分
+      Submit(static_cast<int>(index));
+      return;
+    }
+    if (result <= 0) { //* 没有写入任何字节: 用 pwrite 重试剩余部分, 仍然失败时报告
+      Write_sync(static_cast<int>(index));
+      return;
+    }
+    buffer.used = 0;
+  }
+
+  //* 收不到完成事件时内核可能仍在读在途的缓冲区, 不能复用: 换成新的缓冲区,
+  //* 用 pwrite 写出同样的内容, 旧的缓冲区不再释放. 在途的请求之后完成时
+  //* 写入的也是这些字节, 位置相同
+  void Abandon_in_flight() {
+    for (int i = 0; i < URING_BUFFERS; ++i) {
+      auto &buffer = buffers[i];
+      if (!buffer.busy) {
+        continue;
+      }
+      auto data = static_cast<char *>(counted_malloc(URING_BUFFER_SIZE));
+      memcpy(data, buffer.data, buffer.used);
+      buffer.data = data;
+      buffer.busy = false;
+      --in_flight;
+      Write_sync(i);
+    }
+  }
+
+  int fd;
+  uint64_t offset;
+  Uring uring;
+  bool use_uring{false};
+  Buffer buffers[URING_BUFFERS];
+  int current{0};
+  int in_flight{0};
+};
+
+void uring_file_log(void *user_data, Message &message) {
+  auto file = reinterpret_cast<UringFile *>(user_data);
+  file->Write(message.prefix, strlen(message.prefix));
+  file->Write(message.raw_message, strlen(message.raw_message));
+  file->Write("\n", 1);
+}
+
+void uring_file_flush(void *user_data) {
+  reinterpret_cast<UringFile *>(user_data)->Flush();
+}
+
+void uring_file_close(void *user_data) {
+  auto file = reinterpret_cast<UringFile *>(user_data);
+  file->Flush();
+  close(file->Fd());
+  delete file;
+}
+
+auto Add_uring_file(const char *path_in, FileMode filemode,
+                    Verbosity verbosity) -> bool {
+  char path[FILENAME_MAX];
+  prepare_path(path_in, path);
+  const char *mode = filemode == FileMode::Truncate ? "w" : "a";
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+              (filemode == FileMode::Truncate ? O_TRUNC : 0);
+  int fd = open(path, flags, 0644);
+  if (fd == -1) {
+    LOG(ERROR, "failed to open file: %s", path);
+    return false;
+  }
+  struct stat st;
+  uint64_t offset = fstat(fd, &st) == 0 ? st.st_size : 0;
+
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  auto file = new UringFile(fd, offset);
+  add_callBack(file, uring_file_log, uring_file_flush, uring_file_close,
+               verbosity);
+  //* Flush() 要等待所有写完成, 不在每条日志之后调用
+  set_lazy_flush(file);
+
+  LOG(MESSAGE, "URING FILE:%-*s FileMode:%-*s Verbosity:%-*s io_uring:%s",
+      FILENAME_WIDTH, path_in, 5, mode, 6, get_verbosity_name(verbosity),
+      file->Uses_uring() ? "yes" : "no(pwrite)");
+  return true;
+}
+
+/*********************************flight recorder*********************************/
+#define FLIGHT_ENTRY_SIZE 256
+
+enum class FlightKind : uint8_t { Args, Text };
+
+struct FlightEntry {
+  //* 序号 pos 的记录写入中为 2 * pos + 1, 写完为 2 * pos + 2
+  std::atomic<uint64_t> sequence;
+  const CallSite *site;
+  long uptime_ms;
+  char thread_name[THREADNAME_WIDTH + 1];
+  int8_t verbosity;
+  FlightKind kind;
+  uint16_t args_size;
+  char args[FLIGHT_ENTRY_SIZE - 48];
+};
+static_assert(sizeof(FlightEntry) == FLIGHT_ENTRY_SIZE,
+              "flight entry should fill exactly one slot");
+
+static FlightEntry *flight_entries{nullptr};
+static size_t flight_mask{0};
+static std::atomic<uint64_t> flight_head{0};
+static char flight_dump_path[FILENAME_MAX];
+//* Dump 同时只能有一个, 渲染用的缓冲区都是静态的
+static std::atomic<bool> flight_dumping{false};
+
+auto Enable_flight_recorder(size_t entries, Verbosity verbosity,
+                            const char *dump_path) -> bool {
+  std::unique_lock<std::recursive_mutex> lock(locker);
+  if (flight_entries) {
+    return false;
+  }
+  size_t capacity = 2;
+  while (capacity < entries) {
+    capacity <<= 1;
+  }
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  auto memory = static_cast<FlightEntry *>(
+      counted_malloc(capacity * sizeof(FlightEntry)));
+  if (!memory) {
+    return false;
+  }
+  for (size_t i = 0; i < capacity; ++i) {
+    new (&memory[i].sequence) std::atomic<uint64_t>(0);
+  }
+  if (dump_path) {
+    prepare_path(dump_path, flight_dump_path);
+  }
+  flight_mask = capacity - 1;
+  flight_entries = memory;
+  recorder_max_verbosity.store(static_cast<int>(verbosity),
+                               std::memory_order_release);
+  update_effective_verbosity();
+
+  LOG(MESSAGE, "FLIGHT RECORDER:%-*zu Verbosity:%-*s dump:%s",
+      FILENAME_WIDTH, capacity, 6, get_verbosity_name(verbosity),
+      dump_path ? flight_dump_path : "stderr");
+  return true;
+}
+
+static auto flight_reserve(const CallSite &site, Verbosity verbosity,
+                           FlightKind kind, size_t &token) -> FlightEntry & {
+  auto pos = flight_head.fetch_add(1, std::memory_order_relaxed);
+  auto &entry = flight_entries[pos & flight_mask];
+  entry.sequence.store(2 * pos + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  entry.site = &site;
+  if (use_ticks.load(std::memory_order_acquire)) {
+    long ms_since_epoch;
+    ticks_to_time(read_ticks(), ms_since_epoch, entry.uptime_ms);
+  } else {
+    entry.uptime_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::steady_clock::now() - start_time)
+                          .count();
+  }
+  cached_thread_name(entry.thread_name);
+  entry.verbosity = static_cast<int8_t>(verbosity);
+  entry.kind = kind;
+  token = pos;
+  return entry;
+}
+
+auto begin_flight(const CallSite &site, Verbosity verbosity, size_t args_size,
+                  size_t &token) -> char * {
+  if (args_size > sizeof(FlightEntry::args)) {
+    return nullptr;
+  }
+  auto &entry = flight_reserve(site, verbosity, FlightKind::Args, token);
+  entry.args_size = static_cast<uint16_t>(args_size);
+  return entry.args;
+}
+
+void commit_flight(size_t token) {
+  flight_entries[token & flight_mask].sequence.store(
+      2 * token + 2, std::memory_order_release);
+}
+
+void flight_text(const CallSite &site, Verbosity verbosity, const char *format,
+                 ...) {
+  size_t token;
+  auto &entry = flight_reserve(site, verbosity, FlightKind::Text, token);
+  va_list list;
+  va_start(list, format);
+  auto len = vsnprintf(entry.args, sizeof entry.args, format, list);
+  va_end(list);
+  entry.args_size = static_cast<uint16_t>(
+      std::min<size_t>(std::max(len, 0), sizeof entry.args - 1));
+  commit_flight(token);
+}
+
+static void write_fd(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    auto bytes = write(fd, data, len);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes <= 0) {
+      return;
+    }
+    data += bytes;
+    len -= bytes;
+  }
+}
+
+static void flight_write(int file_fd, const char *data, size_t len) {
+  write_fd(STDERR_FILENO, data, len);
+  if (file_fd != -1) {
+    write_fd(file_fd, data, len);
+  }
+}
+
+//* 崩溃路径的渲染: 不调用 snprintf/localtime_r, 按参数的类型标签直接写出,
+//* 浮点数只输出 6 位小数, 不支持 width/precision
+static void crash_append_double(CrashWriter &writer, long double value) {
+  if (value != value) {
+    writer.Append("nan");
+    return;
+  }
+  if (value < 0) {
+    writer.Append("-");
+    value = -value;
+  }
+  if (value >= 1e18L) {
+    writer.Append("inf");
+    return;
+  }
+  auto scaled = static_cast<unsigned long long>(value * 1000000 + 0.5L);
+  writer.Append_unsigned(scaled / 1000000, 10);
+  char fraction[7];
+  for (int i = 5; i >= 0; --i, scaled /= 10) {
+    fraction[i] = static_cast<char>('0' + scaled % 10);
+  }
+  fraction[6] = '\0';
+  writer.Append(".");
+  writer.Append(fraction);
+}
+
+//* 读出一个整数参数, 按类型标签决定宽度
+static auto crash_take_integer(const char *&args, const char *end,
+                               long long &value) -> bool {
+  if (args >= end) {
+    return false;
+  }
+  auto type = static_cast<ArgType>(*args);
+  int i;
+  long l;
+  if (type == ArgType::Int && take_arg(args, end, type, i)) {
+    value = i;
+  } else if (type == ArgType::Long && take_arg(args, end, type, l)) {
+    value = l;
+  } else if (!(type == ArgType::LongLong && take_arg(args, end, type, value))) {
+    return false;
+  }
+  return true;
+}
+
+static void crash_render_args(CrashWriter &writer, const char *format,
+                              const char *args, size_t args_size) {
+  const char *end = args + args_size;
+  for (auto p = format; *p;) {
+    if (*p != '%') {
+      writer.Append(p++, 1);
+      continue;
+    }
+    if (p[1] == '%') {
+      writer.Append("%");
+      p += 2;
+      continue;
+    }
+    ++p;
+    bool bad = false;
+    int h_count = 0;
+    while (*p && !strchr("diouxXeEfFgGaAcspn", *p)) {
+      long long star;
+      if (*p == '*' && !crash_take_integer(args, end, star)) {
+        bad = true;
+      }
+      h_count += *p == 'h';
+      ++p;
+    }
+    if (!*p) {
+      break;
+    }
+    auto conversion = *p++;
+    if (bad || args >= end) {
+      writer.Append("(bad arg)");
+      continue;
+    }
+    auto type = static_cast<ArgType>(*args);
+    if (type == ArgType::String) {
+      uint32_t len = 0;
+      if (take_arg(args, end, type, len) && args + len <= end) {
+        writer.Append(args, len);
+        args += len;
+      } else {
+        args = end;
+      }
+    } else if (type == ArgType::Double || type == ArgType::LongDouble) {
+      double d;
+      long double ld;
+      if (type == ArgType::Double && take_arg(args, end, type, d)) {
+        crash_append_double(writer, d);
+      } else if (type == ArgType::LongDouble && take_arg(args, end, type, ld)) {
+        crash_append_double(writer, ld);
+      } else {
+        args = end;
+      }
+    } else if (type == ArgType::Pointer) {
+      const void *ptr;
+      if (take_arg(args, end, type, ptr)) {
+        writer.Append_hex(reinterpret_cast<uintptr_t>(ptr));
+      } else {
+        args = end;
+      }
+    } else {
+      long long value;
+      if (!crash_take_integer(args, end, value)) {
+        writer.Append("(bad arg)");
+        skip_arg(args, end);
+        continue;
+      }
+      auto bits = type == ArgType::Int ? sizeof(int) * 8 : sizeof(value) * 8;
+      if (type == ArgType::Int && h_count) { //* 与 printf 相同, 截断为 short/char
+        bits = h_count >= 2 ? 8 : 16;
+        value = h_count >= 2 ? static_cast<signed char>(value)
+                             : static_cast<short>(value);
+      }
+      auto magnitude = static_cast<unsigned long long>(value);
+      if (bits < sizeof(value) * 8) {
+        magnitude &= (1ULL << bits) - 1;
+      }
+      if (conversion == 'c') {
+        char c = static_cast<char>(value);
+        writer.Append(&c, 1);
+      } else if (conversion == 'x' || conversion == 'X') {
+        writer.Append_unsigned(magnitude, 16);
+      } else if (conversion == 'o') {
+        writer.Append_unsigned(magnitude, 8);
+      } else if (conversion == 'u') {
+        writer.Append_unsigned(magnitude, 10);
+      } else {
+        writer.Append_dec(value);
+      }
+    }
+  }
+}
+
+//* 遍历环形缓冲区中完整的记录, 把一致的副本交给 render
+template <typename F> static void for_each_flight_entry(F &&render) {
+  static FlightEntry entry;
+  auto head = flight_head.load(std::memory_order_acquire);
+  auto capacity = flight_mask + 1;
+  auto begin = head > capacity ? head - capacity : 0;
+  for (auto pos = begin; pos < head; ++pos) {
+    auto &slot = flight_entries[pos & flight_mask];
+    if (slot.sequence.load(std::memory_order_acquire) != 2 * pos + 2) {
+      continue; //* 正在写入或已经被覆盖
+    }
+    memcpy(static_cast<void *>(&entry.site), &slot.site,
+           sizeof(FlightEntry) - offsetof(FlightEntry, site));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) != 2 * pos + 2) {
+      continue;
+    }
+    render(entry);
+  }
+}
+
+#define FLIGHT_BEGIN_BANNER "======== flight recorder begin ========\n"
+#define FLIGHT_END_BANNER "======== flight recorder end ========\n"
+
+static auto open_flight_dump() -> int {
+  return flight_dump_path[0]
+             ? open(flight_dump_path,
+                    O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)
+             : -1;
+}
+
+void Dump_flight_recorder() {
+  if (!flight_entries || flight_dumping.exchange(true)) {
+    return;
+  }
+  static char line[PREFIX_WIDTH + RENDER_SIZE + 1];
+  int file_fd = open_flight_dump();
+
+  //* 用单调时钟换算每条记录的墙上时间
+  timespec real;
+  clock_gettime(CLOCK_REALTIME, &real);
+  long now_uptime_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           std::chrono::steady_clock::now() - start_time)
+                           .count();
+  long now_ms = real.tv_sec * 1000 + real.tv_nsec / 1000000;
+
+  flight_write(file_fd, FLIGHT_BEGIN_BANNER, sizeof FLIGHT_BEGIN_BANNER - 1);
+  for_each_flight_entry([&](const FlightEntry &entry) {
+    auto site = entry.site;
+    format_prefix(line, PREFIX_WIDTH, static_cast<Verbosity>(entry.verbosity),
+                  site->file, site->line,
+                  now_ms - (now_uptime_ms - entry.uptime_ms), entry.uptime_ms,
+                  entry.thread_name);
+    auto len = strlen(line);
+    auto room = sizeof line - len - 1;
+    size_t bytes;
+    if (entry.kind == FlightKind::Args) {
+      bytes = format_deferred(site->format, entry.args, entry.args_size,
+                              line + len, room);
+    } else {
+      bytes = entry.args_size;
+      memcpy(line + len, entry.args, bytes);
+    }
+    len += std::min(bytes, room - 1);
+    line[len++] = '\n';
+    flight_write(file_fd, line, len);
+  });
+  flight_write(file_fd, FLIGHT_END_BANNER, sizeof FLIGHT_END_BANNER - 1);
+  if (file_fd != -1) {
+    close(file_fd);
+  }
+  flight_dumping.store(false);
+}
+
+//* 信号处理函数中使用: 崩溃的线程可能正持有时区锁或在更新前缀缓存,
+//* 所以时间输出为原始的 epoch 毫秒和 uptime, 参数由 crash_render_args() 渲染
+static void crash_dump_flight_recorder() {
+  if (!flight_entries || flight_dumping.exchange(true)) {
+    return;
+  }
+  static CrashWriter writer;
+  int file_fd = open_flight_dump();
+  timespec real, mono;
+  clock_gettime(CLOCK_REALTIME, &real);
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  auto start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      start_time.time_since_epoch())
+                      .count();
+  long now_uptime_ms = static_cast<long>(
+      (mono.tv_sec * 1000000000LL + mono.tv_nsec - start_ns) / 1000000);
+  long now_ms = real.tv_sec * 1000 + real.tv_nsec / 1000000;
+
+  flight_write(file_fd, FLIGHT_BEGIN_BANNER, sizeof FLIGHT_BEGIN_BANNER - 1);
+  for_each_flight_entry([&](const FlightEntry &entry) {
+    auto site = entry.site;
+    writer.Append_dec(now_ms - (now_uptime_ms - entry.uptime_ms));
+    writer.Append(" (");
+    writer.Append_dec(entry.uptime_ms / 1000);
+    writer.Append(".");
+    char millis[] = {static_cast<char>('0' + entry.uptime_ms / 100 % 10),
+                     static_cast<char>('0' + entry.uptime_ms / 10 % 10),
+                     static_cast<char>('0' + entry.uptime_ms % 10), '\0'};
+    writer.Append(millis);
+    writer.Append("s)[");
+    writer.Append(entry.thread_name);
+    writer.Append("] ");
+    writer.Append(site->file);
+    writer.Append(":");
+    writer.Append_dec(site->line);
+    writer.Append(" ");
+    auto name = get_verbosity_name(static_cast<Verbosity>(entry.verbosity));
+    if (name) {
+      writer.Append(name);
+    } else {
+      writer.Append_dec(entry.verbosity);
+    }
+    writer.Append("| ");
+    if (entry.kind == FlightKind::Args) {
+      crash_render_args(writer, site->format, entry.args, entry.args_size);
+    } else {
+      writer.Append(entry.args, entry.args_size);
+    }
+    writer.Append("\n");
+    writer.Write(STDERR_FILENO, file_fd);
+  });
+  flight_write(file_fd, FLIGHT_END_BANNER, sizeof FLIGHT_END_BANNER - 1);
+  if (file_fd != -1) {
+    close(file_fd);
+  }
+  flight_dumping.store(false);
+}
+
+/*********************************json file*********************************/
+#define JSON_LINE_SIZE (16 * 1024)
+
+//* 一行 JSON 先拼在固定的缓冲区里, 超长时分段交给 BatchWriter
+class JsonFile {
+public:
+  explicit JsonFile(int fd) : writer(fd) {}
+
+  void Put(const char *data, size_t len) {
+    if (used + len > sizeof line) {
+      Spill();
+      if (len > sizeof line) {
+        iovec piece{const_cast<char *>(data), len};
+        writer.Write(&piece, 1, false);
+        return;
+      }
+    }
+    memcpy(line + used, data, len);
+    used += len;
+  }
+
+  void Put(const char *str) { Put(str, strlen(str)); }
+
+  void Put_char(char c) {
+    if (used == sizeof line) {
+      Spill();
+    }
+    line[used++] = c;
+  }
+
+  //* JSON 字符串, 带引号
+  void Put_string(const char *str, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    Put_char('"');
+    size_t start = 0;
+    for (size_t i = 0; i < len; ++i) {
+      auto c = static_cast<unsigned char>(str[i]);
+      if (c >= 0x20 && c != '"' && c != '\\') {
+        continue;
+      }
+      Put(str + start, i - start);
+      start = i + 1;
+      char escaped[6] = {'\\', static_cast<char>(c), 0, 0, 0, 0};
+      size_t escaped_len = 2;
+      if (c == '\n') {
+        escaped[1] = 'n';
+      } else if (c == '\t') {
+        escaped[1] = 't';
+      } else if (c == '\r') {
+        escaped[1] = 'r';
+      } else if (c < 0x20) {
+        escaped[1] = 'u';
+        escaped[2] = '0';
+        escaped[3] = '0';
+        escaped[4] = hex[c >> 4];
+        escaped[5] = hex[c & 0xF];
+        escaped_len = 6;
+      }
+      Put(escaped, escaped_len);
+    }
+    Put(str + start, len - start);
+    Put_char('"');
+  }
+
+  void Put_string(const char *str) { Put_string(str, strlen(str)); }
+
+  void Put_integer(long long value) {
+    char number[24];
+    auto result = std::to_chars(number, number + sizeof number, value);
+    Put(number, result.ptr - number);
+  }
+
+  void Put_value(const KvValue &value) {
+    if (value.type == ArgType::String) {
+      Put_string(value.str, value.len);
+    } else if (value.type == ArgType::Double && !std::isfinite(value.real)) {
+      Put("null", 4); //* JSON 不能表示 NaN 和无穷大
+    } else {
+      char number[32];
+      auto len = number_chars(value, number, sizeof number);
+      if (value.type == ArgType::Pointer) {
+        Put_string(number, len);
+      } else {
+        Put(number, len);
+      }
+    }
+  }
+
+  void End_line(bool immediately) {
+    Put_char('\n');
+    iovec piece{line, used};
+    writer.Write(&piece, 1, immediately);
+    used = 0;
+  }
+
+  auto Writer() -> BatchWriter & { return writer; }
+
+private:
+  void Spill() {
+    if (used) {
+      iovec piece{line, used};
+      writer.Write(&piece, 1, false);
+      used = 0;
+    }
+  }
+
+  BatchWriter writer;
+  char line[JSON_LINE_SIZE];
+  size_t used{0};
+};
+
+auto Add_json_file(const char *path_in, FileMode filemode, Verbosity verbosity)
+    -> bool {
+  char path[FILENAME_MAX];
+  prepare_path(path_in, path);
+  const char *mode = filemode == FileMode::Truncate ? "w" : "a";
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+              (filemode == FileMode::Truncate ? O_TRUNC : O_APPEND);
+  int fd = open(path, flags, 0644);
+  if (fd == -1) {
+    LOG(ERROR, "failed to open file: %s", path);
+    return false;
+  }
+
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  add_callBack(new JsonFile(fd), json_file_log, json_file_flush,
+               json_file_close, verbosity);
+
+  LOG(MESSAGE, "JSON FILE:%-*s FileMode:%-*s Verbosity:%-*s", FILENAME_WIDTH,
+      path_in, 5, mode, 6, get_verbosity_name(verbosity));
+  return true;
+}
+
+void json_file_log(void *user_data, Message &message) {
+  auto json = reinterpret_cast<JsonFile *>(user_data);
+  json->Put("{\"ts\":", 6);
+  json->Put_integer(message.ms_since_epoch);
+  json->Put(",\"level\":", 9);
+  auto level = get_verbosity_name(message.verbosity);
+  json->Put_string(level ? level : "?");
+  json->Put(",\"thread\":", 10);
+  json->Put_string(message.thread_name ? message.thread_name : "");
+  json->Put(",\"file\":", 8);
+  json->Put_string(message.file ? filename(message.file) : "");
+  json->Put(",\"line\":", 8);
+  json->Put_integer(message.line);
+  json->Put(",\"msg\":", 7);
+  json->Put_string(message.kv_message ? message.kv_message
+                                      : message.raw_message);
+
+  const char *fields = message.fields;
+  const char *end = fields + message.fields_size;
+  KvValue key, value;
+  while (fields && next_kv(fields, end, key) && next_kv(fields, end, value)) {
+    if (key.type != ArgType::String) {
+      continue;
+    }
+    json->Put_char(',');
+    json->Put_string(key.str, key.len);
+    json->Put_char(':');
+    json->Put_value(value);
+  }
+  json->Put_char('}');
+  json->End_line(flush_immediately());
+}
+
+void json_file_flush(void *user_data) {
+  reinterpret_cast<JsonFile *>(user_data)->Writer().Flush();
+}
+
+void json_file_close(void *user_data) {
+  auto json = reinterpret_cast<JsonFile *>(user_data);
+  json->Writer().Flush();
+  close(json->Writer().Fd());
+  delete json;
+}
+
+/*********************************vmodule*********************************/
+#define CONFIG_POLL_MS 1000
+#define CONFIG_FILE_MAX_SIZE (64 * 1024)
+
+struct ModuleRule {
+  std::string pattern;
+  int verbosity;
+};
+
+//* 规则在 locker 和 site_mutex 都持有时才会修改, 持有其中一个就可以读
+static std::vector<ModuleRule> module_rules;
+//* log_message() 中按文件查询规则的缓存, 由 locker 保护
+static std::unordered_map<const char *, int> module_cache;
+//* 已解析过的调用点, 配置变化时逐个重置; 由 site_mutex 保护
+static const CallSite *resolved_sites{nullptr};
+static std::mutex site_mutex;
+
+//* 数字或级别名, 不区分大小写
+static auto parse_verbosity(const char *text, int &verbosity) -> bool {
+  static const std::pair<const char *, Verbosity> names[] = {
+      {"FATAL", Verbosity::VerbosityFATAL},
+      {"FATL", Verbosity::VerbosityFATAL},
+      {"ERROR", Verbosity::VerbosityERROR},
+      {"ERR", Verbosity::VerbosityERROR},
+      {"WARNING", Verbosity::VerbosityWARNING},
+      {"WARN", Verbosity::VerbosityWARNING},
+      {"INFO", Verbosity::VerbosityINFO},
+      {"MESSAGE", Verbosity::VerbosityMESSAGE},
+      {"MES", Verbosity::VerbosityMESSAGE},
+  };
+  for (auto &name : names) {
+    if (strcasecmp(text, name.first) == 0) {
+      verbosity = static_cast<int>(name.second);
+      return true;
+    }
+  }
+  char *end = nullptr;
+  auto value = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || value < INT8_MIN || value > INT8_MAX) {
+    return false;
+  }
+  verbosity = static_cast<int>(value);
+  return true;
+}
+
+//* "pattern=LEVEL,pattern=LEVEL", 任何一项有误时整体失败
+static auto parse_vmodule(const char *spec, std::vector<ModuleRule> &rules)
+    -> bool {
+  std::string text = spec;
+  size_t start = 0;
+  while (start < text.size()) {
+    auto comma = text.find(',', start);
+    if (comma == std::string::npos) {
+      comma = text.size();
+    }
+    auto item = text.substr(start, comma - start);
+    start = comma + 1;
+    if (item.empty()) {
+      continue;
+    }
+    auto equal = item.rfind('=');
+    int verbosity;
+    if (equal == std::string::npos || equal == 0 ||
+        !parse_verbosity(item.c_str() + equal + 1, verbosity)) {
+      return false;
+    }
+    rules.push_back(ModuleRule{item.substr(0, equal), verbosity});
+  }
+  return true;
+}
+
+//* 去掉扩展名后, 不含 '/' 的模式匹配文件名, 含 '/' 的匹配任意以 '/' 分隔的结尾
+static auto match_rules(const char *file) -> int {
+  if (module_rules.empty() || !file) {
+    return INT_MIN;
+  }
+  std::string path = file;
+  auto slash = path.rfind('/');
+  auto dot = path.rfind('.');
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+    path.resize(dot);
+  }
+  auto base = slash == std::string::npos ? path.c_str()
+                                         : path.c_str() + slash + 1;
+  for (auto &rule : module_rules) {
+    if (rule.pattern.find('/') == std::string::npos) {
+      if (fnmatch(rule.pattern.c_str(), base, 0) == 0) {
+        return rule.verbosity;
+      }
+      continue;
+    }
+    for (auto suffix = path.c_str(); suffix; ) {
+      if (fnmatch(rule.pattern.c_str(), suffix, 0) == 0) {
+        return rule.verbosity;
+      }
+      suffix = strchr(suffix, '/');
+      suffix = suffix ? suffix + 1 : nullptr;
+    }
+  }
+  return INT_MIN;
+}
+
+//* 需要持有 locker
+static auto module_verbosity(const char *file) -> int {
+  auto it = module_cache.find(file);
+  if (it != module_cache.end()) {
+    return it->second;
+  }
+  auto verbosity = match_rules(file);
+  module_cache.emplace(file, verbosity);
+  return verbosity;
+}
+
+//* 需要持有 locker
+static void invalidate_sites() {
+  std::unique_lock<std::mutex> lock(site_mutex);
+  for (auto site = resolved_sites; site; site = site->next) {
+    site->level.store(SITE_UNRESOLVED, std::memory_order_relaxed);
+  }
+}
+
+auto resolve_site(const CallSite &site, Verbosity verbosity) -> bool {
+  std::unique_lock<std::mutex> lock(site_mutex);
+  if (!site.registered.load(std::memory_order_relaxed)) {
+    site.registered.store(true, std::memory_order_relaxed);
+    site.next = resolved_sites;
+    resolved_sites = &site;
+  }
+  auto level = default_site_verbosity.load(std::memory_order_relaxed);
+  auto module = match_rules(site.file);
+  if (module != INT_MIN) {
+    //* fatal 永远不能被过滤, 飞行记录器仍然需要它自己的级别
+    level = std::max({module, static_cast<int>(Verbosity::VerbosityFATAL),
+                      recorder_max_verbosity.load(std::memory_order_relaxed)});
+  }
+  site.level.store(level, std::memory_order_relaxed);
+  return static_cast<int>(verbosity) <= level;
+}
+
+auto Set_vmodule(const char *spec) -> bool {
+  std::vector<ModuleRule> rules;
+  if (!spec || !parse_vmodule(spec, rules)) {
+    LOG(WARNING, "invalid vmodule: %s", spec ? spec : "(null)");
+    return false;
+  }
+  int max_verbosity = INT_MIN;
+  for (auto &rule : rules) {
+    max_verbosity = std::max(max_verbosity, rule.verbosity);
+  }
+  {
+    std::unique_lock<std::recursive_mutex> lock(locker);
+    {
+      std::unique_lock<std::mutex> site_lock(site_mutex);
+      module_rules.swap(rules);
+      module_cache.clear();
+    }
+    module_max_verbosity.store(max_verbosity, std::memory_order_relaxed);
+    update_effective_verbosity();
+  }
+  LOG(INFO, "vmodule: %s", *spec ? spec : "(none)");
+  return true;
+}
+
+//* 处理 v 或 vmodule 选项, 值有误时返回 false
+static auto apply_option(const std::string &name, const char *value) -> bool {
+  if (name == "v") {
+    int verbosity;
+    if (!parse_verbosity(value, verbosity)) {
+      LOG(WARNING, "invalid -v: %s", value);
+      return false;
+    }
+    Set_stderr_verbosity(static_cast<Verbosity>(verbosity));
+    return true;
+  }
+  if (name == "vmodule") {
+    return Set_vmodule(value);
+  }
+  return false;
+}
+
+static void parse_args(int argc, char *argv[]) {
+  for (int i = 1; i < argc && argv; ++i) {
+    const char *arg = argv[i];
+    if (!arg || arg[0] != '-') {
+      continue;
+    }
+    arg += arg[1] == '-' ? 2 : 1;
+    std::string name = arg;
+    auto equal = name.find('=');
+    if (equal != std::string::npos) {
+      name.resize(equal);
+      if (name == "v" || name == "vmodule") {
+        apply_option(name, arg + equal + 1);
+      }
+      continue;
+    }
+    //* "-v LEVEL": 下一个参数不是级别时当作程序自己的 -v
+    int verbosity;
+    if (name == "v" && i + 1 < argc &&
+        parse_verbosity(argv[i + 1], verbosity)) {
+      apply_option(name, argv[++i]);
+    } else if (name == "vmodule" && i + 1 < argc) {
+      apply_option(name, argv[++i]);
+    }
+  }
+}
+
+static std::string config_path;
+static std::thread *config_thread{nullptr};
+static std::mutex config_mutex;
+static std::condition_variable config_cv;
+static bool config_stop{false};
+static std::atomic<bool> config_reload{false};
+
+static void config_signal_handler(int) {
+  config_reload.store(true, std::memory_order_relaxed);
+}
+
+static void reload_config() {
+  FILE *file = fopen(config_path.c_str(), "r");
+  if (!file) {
+    LOG(WARNING, "failed to open config file: %s", config_path.c_str());
+    return;
+  }
+  std::string text(CONFIG_FILE_MAX_SIZE, '\0');
+  text.resize(fread(&text[0], 1, text.size(), file));
+  fclose(file);
+
+  bool has_vmodule = false;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    if (isspace(static_cast<unsigned char>(text[pos]))) {
+      ++pos;
+      continue;
+    }
+    if (text[pos] == '#') {
+      pos = text.find('\n', pos);
+      continue;
+    }
+    auto end = pos;
+    while (end < text.size() && !isspace(static_cast<unsigned char>(text[end]))) {
+      ++end;
+    }
+    auto token = text.substr(pos, end - pos);
+    pos = end;
+    token.erase(0, token.find_first_not_of('-'));
+    auto equal = token.find('=');
+    auto name = token.substr(0, equal);
+    auto value = equal == std::string::npos ? std::string()
+                                            : token.substr(equal + 1);
+    if (name == "v" || name == "vmodule") {
+      apply_option(name, value.c_str());
+      has_vmodule |= name == "vmodule";
+    } else {
+      LOG(WARNING, "unknown option in %s: %s", config_path.c_str(),
+          token.c_str());
+    }
+  }
+  if (!has_vmodule) {
+    Set_vmodule("");
+  }
+}
+
+static void config_loop() {
+  Set_thread_name("log_what_ctl");
+  timespec last_mtime{0, 0};
+  bool first = true;
+  std::unique_lock<std::mutex> lock(config_mutex);
+  while (!config_stop) {
+    struct stat st;
+    bool changed = false;
+    if (stat(config_path.c_str(), &st) == 0) {
+      changed = st.st_mtim.tv_sec != last_mtime.tv_sec ||
+                st.st_mtim.tv_nsec != last_mtime.tv_nsec;
+      last_mtime = st.st_mtim;
+    }
+    if (config_reload.exchange(false, std::memory_order_relaxed) || changed ||
+        first) {
+      first = false;
+      lock.unlock();
+      reload_config();
+      lock.lock();
+    }
+    config_cv.wait_for(lock, std::chrono::milliseconds(CONFIG_POLL_MS),
+                       [] { return config_stop; });
+  }
+}
+
+void Watch_config_file(const char *path) {
+  ASSERT(path != nullptr, "path should not be null !");
+  stop_config_thread();
+  config_path = path;
+  config_stop = false;
+
+  struct sigaction sig_action;
+  memset(&sig_action, 0, sizeof sig_action);
+  sigemptyset(&sig_action.sa_mask);
+  sig_action.sa_flags = SA_RESTART;
+  sig_action.sa_handler = config_signal_handler;
+  sigaction(SIGUSR1, &sig_action, nullptr);
+
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  config_thread = new std::thread(config_loop);
+  LOG(MESSAGE, "CONFIG FILE:%-*s reload:SIGUSR1 or mtime", FILENAME_WIDTH,
+      path);
+}
+
+static void stop_config_thread() {
+  if (!config_thread) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(config_mutex);
+    config_stop = true;
   }
+  config_cv.notify_one();
+  config_thread->join();
+  delete config_thread;
+  config_thread = nullptr;
+}
 
-  if (thread_name[0] ==
-      '\0') { // fail to get a specific thread name give it a hex number
-    auto id = pthread_self();
-    snprintf(thread_name, thread_name_len, "%*lX",
-             static_cast<int>(thread_name_len) - 1, id);
+/*********************************stats*********************************/
+class LatencyHistogram {
+public:
+  void Record(uint64_t ns) {
+    auto bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    buckets[std::min(bucket, STATS_BUCKETS - 1)].fetch_add(
+        1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    auto max = max_ns.load(std::memory_order_relaxed);
+    while (ns > max && !max_ns.compare_exchange_weak(
+                           max, ns, std::memory_order_relaxed)) {
+    }
   }
-}
 
-auto vastextprint(const char *format, va_list list) -> Text {
-  char *buffer;
-  int bytes = vasprintf(&buffer, format, list);
-  ASSERT(bytes >= 0,
-         "bad format fatal"); // TODO 应该使用自己的fatal log方式进行处理
-  return Text(buffer);
+  //* 各个字段分别读取, 并发写入时可能相差几条
+  void Snapshot(Histogram &out) const {
+    out.count = count.load(std::memory_order_relaxed);
+    out.sum_ns = sum_ns.load(std::memory_order_relaxed);
+    out.max_ns = max_ns.load(std::memory_order_relaxed);
+    for (int i = 0; i < STATS_BUCKETS; ++i) {
+      out.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+    }
+  }
+
+private:
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum_ns{0};
+  std::atomic<uint64_t> max_ns{0};
+  std::atomic<uint64_t> buckets[STATS_BUCKETS]{};
+};
+
+static LatencyHistogram stats_histograms[5];
+static std::atomic<int> stats_report_ms{0};
+static std::atomic<long> next_stats_report_ms{0};
+
+static void stats_record(StatsPoint point, uint64_t ns) {
+  stats_histograms[static_cast<int>(point)].Record(ns);
 }
 
-auto filename(const char *file) -> const char * {
-  for (auto ptr = file; *ptr; ++ptr) {
-    if (*ptr == '/' || *ptr == '\\') { //消除掉文件名的前缀
-      file = ptr + 1;
+auto Histogram::Percentile(double p) const -> uint64_t {
+  uint64_t total = 0;
+  for (auto bucket : buckets) {
+    total += bucket;
+  }
+  if (total == 0) {
+    return 0;
+  }
+  auto rank = static_cast<uint64_t>(std::ceil(p * static_cast<double>(total)));
+  rank = std::max<uint64_t>(rank, 1);
+  uint64_t seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      auto upper = i + 1 < 64 ? (uint64_t{1} << (i + 1)) - 1 : UINT64_MAX;
+      return std::min(upper, max_ns);
     }
   }
-  return file;
+  return max_ns;
 }
 
-void flush() {
+void Enable_stats(bool enable, int report_interval_ms) {
+  stats_enabled.store(enable, std::memory_order_relaxed);
+  stats_report_ms.store(std::max(report_interval_ms, 0),
+                        std::memory_order_relaxed);
+  next_stats_report_ms.store(coarse_ms() + report_interval_ms,
+                             std::memory_order_relaxed);
+}
+
+auto Get_stats() -> Stats {
+  Stats stats{};
   std::unique_lock<std::recursive_mutex> lock(locker);
-  fflush(stderr);
-  for (auto &callback : callBacks) {
-    if (callback.flush) {
-      callback.flush(callback.user_data);
+  memcpy(stats.messages, message_counts, sizeof stats.messages);
+  stats.stderr_bytes = stderr_bytes;
+  stats.queue_full = queue_full_count.load(std::memory_order_relaxed);
+  stats.queue_depth =
+      record_queue ? record_queue->Tail() - record_queue->Consumed() : 0;
+  stats.batch_max = batch_max;
+  for (auto &callBack : callBacks) {
+    auto dropped = callBack.worker ? callBack.worker->Dropped() : 0;
+    stats.dropped += dropped;
+    stats.sinks.push_back(SinkStats{callBack.user_data, callBack.messages,
+                                    callBack.bytes, dropped});
+  }
+  lock.unlock();
+  stats_histograms[static_cast<int>(StatsPoint::LockWait)].Snapshot(
+      stats.lock_wait);
+  stats_histograms[static_cast<int>(StatsPoint::Enqueue)].Snapshot(
+      stats.enqueue);
+  stats_histograms[static_cast<int>(StatsPoint::QueueLatency)].Snapshot(
+      stats.queue_latency);
+  stats_histograms[static_cast<int>(StatsPoint::Dispatch)].Snapshot(
+      stats.dispatch);
+  stats_histograms[static_cast<int>(StatsPoint::Flush)].Snapshot(stats.flush);
+  return stats;
+}
+
+//* 在 log_message() 末尾(已经释放 locker)检查, 与限流的汇总相同, 不需要额外的线程
+static void maybe_report_stats() {
+  auto interval = stats_report_ms.load(std::memory_order_relaxed);
+  if (interval <= 0) {
+    return;
+  }
+  auto now = coarse_ms();
+  auto next = next_stats_report_ms.load(std::memory_order_relaxed);
+  if (now < next || !next_stats_report_ms.compare_exchange_strong(
+                        next, now + interval, std::memory_order_relaxed)) {
+    return;
+  }
+  auto stats = Get_stats();
+  uint64_t sink_bytes = 0;
+  for (auto &sink : stats.sinks) {
+    sink_bytes += sink.bytes;
+  }
+  LOG(INFO,
+      "log_what stats: fatal=%llu error=%llu warning=%llu info=%llu "
+      "message=%llu vlog=%llu stderr_bytes=%llu sink_bytes=%llu dropped=%llu "
+      "queue_full=%llu batch_max=%llu lock_wait_p99=%lluns "
+      "enqueue_p99=%lluns queue_latency_p99=%lluns dispatch_p99=%lluns "
+      "flush_p99=%lluns",
+      static_cast<unsigned long long>(stats.messages[0]),
+      static_cast<unsigned long long>(stats.messages[1]),
+      static_cast<unsigned long long>(stats.messages[2]),
+      static_cast<unsigned long long>(stats.messages[3]),
+      static_cast<unsigned long long>(stats.messages[4]),
+      static_cast<unsigned long long>(stats.messages[5]),
+      static_cast<unsigned long long>(stats.stderr_bytes),
+      static_cast<unsigned long long>(sink_bytes),
+      static_cast<unsigned long long>(stats.dropped),
+      static_cast<unsigned long long>(stats.queue_full),
+      static_cast<unsigned long long>(stats.batch_max),
+      static_cast<unsigned long long>(stats.lock_wait.Percentile(0.99)),
+      static_cast<unsigned long long>(stats.enqueue.Percentile(0.99)),
+      static_cast<unsigned long long>(stats.queue_latency.Percentile(0.99)),
+      static_cast<unsigned long long>(stats.dispatch.Percentile(0.99)),
+      static_cast<unsigned long long>(stats.flush.Percentile(0.99)));
+}
+
+/*********************************scope timer*********************************/
+//* 线程本地表的大小(2的幂), 满了之后新的作用域直接合并到全局表
+#define SCOPE_TABLE_SIZE 64
+#define SCOPE_MERGE_MS 1000
+
+struct ScopeStat {
+  const ScopeSite *site{nullptr};
+  uint64_t count{0};
+  uint64_t total_ns{0};
+  uint64_t max_ns{0};
+};
+
+//* 每个线程一个, 只被所属线程访问; 线程退出时由 scope_key 的析构函数合并
+struct ThreadScopes {
+  int depth{0};
+  long next_merge_ms{0};
+  ScopeStat stats[SCOPE_TABLE_SIZE];
+};
+
+static thread_local ThreadScopes *thread_scopes{nullptr};
+static std::mutex scope_locker;
+static std::unordered_map<const ScopeSite *, ScopeStat> scope_totals;
+static std::atomic<int> scope_report_ms{SCOPE_REPORT_MS};
+static std::atomic<long> next_scope_report_ms{0};
+
+static auto get_thread_scopes() -> ThreadScopes & {
+  if (!thread_scopes) { //* 每个线程只分配一次
+    pthread_once(&thread_once, init_thread_key);
+    thread_scopes = new (counted_malloc(sizeof(ThreadScopes))) ThreadScopes;
+    pthread_setspecific(scope_key, thread_scopes);
+  }
+  return *thread_scopes;
+}
+
+static void merge_stat(ScopeStat &into, const ScopeStat &from) {
+  into.site = from.site;
+  into.count += from.count;
+  into.total_ns += from.total_ns;
+  into.max_ns = std::max(into.max_ns, from.max_ns);
+}
+
+//* 把线程本地的累计合并到全局表并清零, 保留 site 使探测序列不变
+static void merge_thread_scopes(ThreadScopes &scopes) {
+  std::unique_lock<std::mutex> lock(scope_locker);
+  for (auto &stat : scopes.stats) {
+    if (stat.count) {
+      merge_stat(scope_totals[stat.site], stat);
+      stat.count = stat.total_ns = stat.max_ns = 0;
     }
   }
-  need_flush = false;
 }
 
-auto Add_file(const char *path_in, FileMode filemode, Verbosity verbosity)
-    -> bool {
-  char path[FILENAME_MAX];
-  if (path_in[0] == '~') {
-    snprintf(path, FILENAME_MAX, "%s%s", home_dir(), path_in);
+static void scope_thread_exit(void *data) {
+  auto scopes = static_cast<ThreadScopes *>(data);
+  merge_thread_scopes(*scopes);
+  thread_scopes = nullptr;
+  free(scopes);
+}
+
+static void record_scope(ThreadScopes &scopes, const ScopeSite *site,
+                         uint64_t ns) {
+  auto hash = reinterpret_cast<uintptr_t>(site) >> 4;
+  for (size_t i = 0; i < SCOPE_TABLE_SIZE; ++i) {
+    auto &stat = scopes.stats[(hash + i) & (SCOPE_TABLE_SIZE - 1)];
+    if (stat.site == site || !stat.site) {
+      merge_stat(stat, ScopeStat{site, 1, ns, ns});
+      return;
+    }
+  }
+  std::unique_lock<std::mutex> lock(scope_locker);
+  merge_stat(scope_totals[site], ScopeStat{site, 1, ns, ns});
+}
+
+//* 取出全局表后再输出, callback 中的 LOG_TIMER 不会与这里竞争 scope_locker
+static void emit_scopes() {
+  std::unordered_map<const ScopeSite *, ScopeStat> totals;
+  {
+    std::unique_lock<std::mutex> lock(scope_locker);
+    totals.swap(scope_totals);
+  }
+  for (auto &[site, stat] : totals) {
+    if (Site_enabled(site->exit_site, site->exit_site.verbosity)) {
+      log_site(site->exit_site, site->exit_site.verbosity,
+               scope_summary_format, site->name,
+               static_cast<unsigned long long>(stat.count),
+               stat.total_ns / 1e6, stat.total_ns / 1e6 / stat.count,
+               stat.max_ns / 1e6);
+    }
+  }
+}
+
+//* 与 maybe_report_stats() 相同, 由恰好到期的线程输出, 不需要额外的线程
+static void maybe_report_scopes(long now) {
+  auto interval = scope_report_ms.load(std::memory_order_relaxed);
+  if (interval <= 0) {
+    return;
+  }
+  auto next = next_scope_report_ms.load(std::memory_order_relaxed);
+  if (now < next || !next_scope_report_ms.compare_exchange_strong(
+                        next, now + interval, std::memory_order_relaxed)) {
+    return;
+  }
+  if (next != 0) { //* 第一次只设置时间
+    emit_scopes();
+  }
+}
+
+void ScopeTimer::Enter(const ScopeSite &site) {
+  __site = &site;
+  __ticks = use_ticks.load(std::memory_order_acquire);
+  if (!site.aggregate) {
+    auto &scopes = get_thread_scopes();
+    log_site(site.enter_site, site.enter_site.verbosity, scope_enter_format,
+             scopes.depth * SCOPE_INDENT, "", site.name);
+    ++scopes.depth;
+  }
+  //* 最后读时钟, 不把输出进入日志的时间算进去
+  __start = __ticks ? read_ticks()
+                    : static_cast<uint64_t>(clock_ns(CLOCK_MONOTONIC));
+}
+
+void ScopeTimer::Leave() {
+  uint64_t elapsed_ns;
+  if (__ticks) {
+    auto ticks = read_ticks() - __start;
+    elapsed_ns =
+        static_cast<uint64_t>(ticks * load_calibration().ns_per_tick);
   } else {
-    snprintf(path, FILENAME_MAX, "%s", path_in);
+    elapsed_ns = static_cast<uint64_t>(clock_ns(CLOCK_MONOTONIC)) - __start;
   }
-  if (!create_dir(path)) {
-    LOG(ERROR, "failed to create dir:%s", path);
+  auto &scopes = get_thread_scopes();
+  if (!__site->aggregate) {
+    --scopes.depth;
+    if (Site_enabled(__site->exit_site, __site->exit_site.verbosity)) {
+      log_site(__site->exit_site, __site->exit_site.verbosity,
+               scope_exit_format, scopes.depth * SCOPE_INDENT, "",
+               __site->name, elapsed_ns / 1e6);
+    }
+    return;
   }
-  const char *mode = filemode == FileMode::Truncate ? "w" : "a";
-  FILE *file;
-  file = fopen(path, mode);
-  if (!file) {
-    LOG(ERROR, "failed to open file: %s", path);
+  record_scope(scopes, __site, elapsed_ns);
+  auto now = coarse_ms();
+  if (now >= scopes.next_merge_ms) {
+    if (scopes.next_merge_ms != 0) {
+      merge_thread_scopes(scopes);
+    }
+    auto interval = scope_report_ms.load(std::memory_order_relaxed);
+    scopes.next_merge_ms =
+        now + (interval > 0 ? std::min(interval, SCOPE_MERGE_MS)
+                            : SCOPE_MERGE_MS);
+    maybe_report_scopes(now);
+  }
+}
+
+void Set_scope_report_interval(int interval_ms) {
+  scope_report_ms.store(std::max(interval_ms, 0), std::memory_order_relaxed);
+  next_scope_report_ms.store(coarse_ms() + interval_ms,
+                             std::memory_order_relaxed);
+}
+
+void Report_scopes() {
+  if (thread_scopes) {
+    merge_thread_scopes(*thread_scopes);
+  }
+  emit_scopes();
+}
+
+/*********************************shared memory*********************************/
+#define SHM_MAGIC "LOGWSHM\1"
+#define SHM_PAD INT32_MIN
+//* 时间戳在写入前一刻才读取, 合并时只输出比现在早这么久的日志, 等待读时钟与提交之间
+//* 的间隔; 这只是尽力而为: 写入者在这段间隔里被调度出去超过 SHM_REORDER_MS 时,
+//* 它的日志会排在已经输出的更晚的日志之后
+#define SHM_REORDER_MS 2
+#define SHM_IDLE_SLEEP_MS 1
+//* 检查环的所属进程是否已经退出, 并汇报丢弃的条数
+#define SHM_MAINTENANCE_MS 1000
+
+enum ShmRingState : uint32_t { ShmFree, ShmClaiming, ShmActive, ShmClosed };
+
+struct alignas(64) ShmHeader {
+  char magic[8];
+  std::atomic<uint32_t> ready;
+  uint32_t ring_count;
+  uint64_t ring_size;
+};
+
+//* 单生产者(持有 locker 的 shm_log)单消费者(collector), 跨进程只依赖无锁原子变量
+struct alignas(64) ShmRing {
+  std::atomic<uint32_t> state;
+  std::atomic<int32_t> pid;
+  std::atomic<uint64_t> dropped;
+  alignas(64) std::atomic<uint64_t> head; //* 生产者已经提交的字节数
+  alignas(64) std::atomic<uint64_t> tail; //* collector 已经读取的字节数
+};
+
+//* 每条日志: 头 + 前缀 + 消息, 按头的大小对齐, 环尾剩下的空间不够时写一个 SHM_PAD
+struct alignas(32) ShmEntry {
+  uint32_t size;
+  int32_t verbosity;
+  uint64_t ts_ns;
+  uint32_t prefix_len;
+  uint32_t text_len;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "shared memory ring needs lock-free 64-bit atomics");
+
+class ShmSegment {
+public:
+  //* 第一个打开的进程负责创建和初始化, 其他进程等待 ready;
+  //* 创建者在 ftruncate 和 ready 之间退出会留下永远不可用的共享内存,
+  //* 等待超时后删除并重新创建一次
+  auto Open(const char *name, size_t ring_size_hint) -> bool {
+    snprintf(shm_name, sizeof shm_name, "/log_what.%s", name);
+    size_t ring_size = 4096;
+    while (ring_size < ring_size_hint) {
+      ring_size <<= 1;
+    }
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      auto result = Try_open(ring_size);
+      if (result != OpenStale) {
+        return result == OpenOk;
+      }
+      shm_unlink(shm_name);
+    }
     return false;
   }
 
-  add_callBack(file, file_log, file_flush, file_close, verbosity);
+  //* 删除 /dev/shm 中的名字, 已经映射的进程不受影响
+  void Unlink() { shm_unlink(shm_name); }
 
-  LOG(MESSAGE, "FILE:%-*s FileMode:%-*s Verbosity:%-*s", FILENAME_WIDTH,
-      path_in, 5, mode, 6, get_verbosity_name(verbosity));
-  return true;
+  void Close() {
+    if (base) {
+      munmap(base, size);
+      base = nullptr;
+      header = nullptr;
+    }
+  }
+
+  auto Ring_count() const -> uint32_t { return header->ring_count; }
+
+  auto Ring_size() const -> uint64_t { return header->ring_size; }
+
+  auto Ring(uint32_t index) const -> ShmRing * {
+    return reinterpret_cast<ShmRing *>(base + sizeof(ShmHeader) +
+                                       index * (sizeof(ShmRing) + Ring_size()));
+  }
+
+  auto Data(ShmRing *ring) const -> char * {
+    return reinterpret_cast<char *>(ring) + sizeof(ShmRing);
+  }
+
+  auto Name() const -> const char * { return shm_name; }
+
+private:
+  enum OpenResult { OpenOk, OpenFailed, OpenStale };
+
+  auto Try_open(size_t ring_size) -> OpenResult {
+    bool creator = true;
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1 && errno == EEXIST) {
+      creator = false;
+      fd = shm_open(shm_name, O_RDWR | O_CLOEXEC, 0644);
+      if (fd == -1 && errno == ENOENT) { //* 刚好被其他进程删除
+        return OpenStale;
+      }
+    }
+    if (fd == -1) {
+      return OpenFailed;
+    }
+    if (creator) {
+      size = Layout_size(SHM_RINGS, ring_size);
+      if (ftruncate(fd, static_cast<off_t>(size)) == -1) {
+        close(fd);
+        shm_unlink(shm_name);
+        return OpenFailed;
+      }
+    } else {
+      struct stat st {};
+      bool sized = false;
+      for (int i = 0; i < 1000 && !sized; ++i) { //* 等待创建者 ftruncate
+        sized = fstat(fd, &st) == 0 &&
+                st.st_size >= static_cast<off_t>(sizeof(ShmHeader));
+        if (!sized) {
+          usleep(1000);
+        }
+      }
+      if (!sized) {
+        close(fd);
+        return OpenStale;
+      }
+      size = static_cast<size_t>(st.st_size);
+    }
+    auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+      return OpenFailed;
+    }
+    base = static_cast<char *>(memory);
+    header = reinterpret_cast<ShmHeader *>(base);
+    if (creator) {
+      memcpy(header->magic, SHM_MAGIC, sizeof header->magic);
+      header->ring_count = SHM_RINGS;
+      header->ring_size = ring_size;
+      header->ready.store(1, std::memory_order_release);
+      return OpenOk;
+    }
+    for (int i = 0; i < 1000 && !header->ready.load(std::memory_order_acquire);
+         ++i) {
+      usleep(1000);
+    }
+    if (!header->ready.load(std::memory_order_acquire)) {
+      Close();
+      return OpenStale;
+    }
+    if (memcmp(header->magic, SHM_MAGIC, sizeof header->magic) != 0 ||
+        Layout_size(header->ring_count, header->ring_size) > size) {
+      Close();
+      return OpenFailed;
+    }
+    return OpenOk;
+  }
+
+  static auto Layout_size(uint64_t rings, uint64_t ring_size) -> size_t {
+    return sizeof(ShmHeader) + rings * (sizeof(ShmRing) + ring_size);
+  }
+
+  char shm_name[NAME_MAX];
+  char *base{nullptr};
+  ShmHeader *header{nullptr};
+  size_t size{0};
+};
+
+static auto shm_round(uint64_t bytes) -> uint64_t {
+  return (bytes + sizeof(ShmEntry) - 1) / sizeof(ShmEntry) * sizeof(ShmEntry);
 }
 
-auto create_dir(const char *filepath) -> bool {
-  char *file = strdup(filepath);
-  for (char *p = strchr(file + 1, '/'); p; p = strchr(p + 1, '/')) {
-    *p = '\0';
-    if (mkdir(file, 0755) == -1) {
-      LOG(ERROR, "failed to create dir: %s", file);
-      free(file);
-      return false;
+static auto realtime_ns() -> uint64_t {
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
+
+//* fork 之后子进程的 pid 不同, 需要占用自己的环
+static std::atomic<pid_t> current_pid{0};
+static pthread_once_t shm_fork_once = PTHREAD_ONCE_INIT;
+
+static std::atomic<bool> shm_collector_running{false};
+static void shm_forget_collector();
+
+//* 子进程中没有 collector 线程
+static void shm_after_fork() {
+  current_pid.store(getpid());
+  shm_forget_collector();
+}
+
+static void shm_install_fork_handler() {
+  current_pid.store(getpid());
+  pthread_atfork(nullptr, nullptr, shm_after_fork);
+}
+
+class ShmSink {
+public:
+  explicit ShmSink(ShmSegment segment) : segment(segment) {}
+
+  void Log(Message &message) {
+    auto pid = current_pid.load(std::memory_order_relaxed);
+    if (!ring || owner != pid) {
+      ring = Claim(pid);
+      owner = pid;
+      if (!ring) {
+        return;
+      }
     }
-    *p = '/';
+    auto ring_size = segment.Ring_size();
+    auto prefix_len = strlen(message.prefix);
+    auto text_len = strlen(message.raw_message);
+    //* 一条日志最多占半个环
+    auto limit = ring_size / 2 - sizeof(ShmEntry);
+    prefix_len = std::min<uint64_t>(prefix_len, limit);
+    text_len = std::min<uint64_t>(text_len, limit - prefix_len);
+    auto need = shm_round(sizeof(ShmEntry) + prefix_len + text_len);
+
+    auto head = ring->head.load(std::memory_order_relaxed);
+    auto tail = ring->tail.load(std::memory_order_acquire);
+    auto pos = head & (ring_size - 1);
+    auto contiguous = ring_size - pos;
+    auto padding = contiguous < need ? contiguous : 0;
+    if (head + padding + need - tail > ring_size) {
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    auto data = segment.Data(ring);
+    if (padding) {
+      auto pad = reinterpret_cast<ShmEntry *>(data + pos);
+      pad->size = static_cast<uint32_t>(padding);
+      pad->verbosity = SHM_PAD;
+      head += padding;
+      pos = 0;
+    }
+    auto entry = reinterpret_cast<ShmEntry *>(data + pos);
+    entry->size = static_cast<uint32_t>(need);
+    entry->verbosity = static_cast<int32_t>(message.verbosity);
+    entry->ts_ns = realtime_ns();
+    entry->prefix_len = static_cast<uint32_t>(prefix_len);
+    entry->text_len = static_cast<uint32_t>(text_len);
+    auto text = reinterpret_cast<char *>(entry + 1);
+    memcpy(text, message.prefix, prefix_len);
+    memcpy(text + prefix_len, message.raw_message, text_len);
+    ring->head.store(head + need, std::memory_order_release);
   }
-  free(file);
-  return true;
+
+  //* collector 读完剩余的日志后把环标记为空闲
+  void Close() {
+    if (ring && owner == current_pid.load(std::memory_order_relaxed)) {
+      ring->state.store(ShmClosed, std::memory_order_release);
+    }
+    ring = nullptr;
+    segment.Close();
+  }
+
+private:
+  //* 优先使用空闲的环, 其次是所属进程已经退出且已经读完的环
+  auto Claim(pid_t pid) -> ShmRing * {
+    for (uint32_t i = 0; i < segment.Ring_count(); ++i) {
+      auto candidate = segment.Ring(i);
+      uint32_t expected = ShmFree;
+      if (candidate->state.compare_exchange_strong(expected, ShmClaiming,
+                                                   std::memory_order_acq_rel)) {
+        return Activate(candidate, pid);
+      }
+    }
+    for (uint32_t i = 0; i < segment.Ring_count(); ++i) {
+      auto candidate = segment.Ring(i);
+      auto other = candidate->pid.load(std::memory_order_relaxed);
+      if (other != pid && kill(other, 0) == -1 && errno == ESRCH &&
+          candidate->head.load(std::memory_order_acquire) ==
+              candidate->tail.load(std::memory_order_acquire)) {
+        uint32_t expected = ShmActive;
+        if (candidate->state.compare_exchange_strong(
+                expected, ShmClaiming, std::memory_order_acq_rel)) {
+          return Activate(candidate, pid);
+        }
+      }
+    }
+    if (!reported_full) {
+      reported_full = true;
+      write_to_stderr("log_what: no free ring in shared memory\n");
+    }
+    return nullptr;
+  }
+
+  auto Activate(ShmRing *candidate, pid_t pid) -> ShmRing * {
+    candidate->head.store(0, std::memory_order_relaxed);
+    candidate->tail.store(0, std::memory_order_relaxed);
+    candidate->dropped.store(0, std::memory_order_relaxed);
+    candidate->pid.store(pid, std::memory_order_relaxed);
+    candidate->state.store(ShmActive, std::memory_order_release);
+    return candidate;
+  }
+
+  ShmSegment segment;
+  ShmRing *ring{nullptr};
+  pid_t owner{0};
+  bool reported_full{false};
+};
+
+//* 运行 collector 的进程直接输出到自己的 sink, 不需要经过共享内存
+void shm_log(void *user_data, Message &message) {
+  if (is_shm_collector ||
+      shm_collector_running.load(std::memory_order_relaxed)) {
+    return;
+  }
+  reinterpret_cast<ShmSink *>(user_data)->Log(message);
 }
 
-auto home_dir() -> const char * {
-  auto home = getenv("HOME");
-  ASSERT(home != nullptr, "failed to get your home directory");
-  return home;
+void shm_close(void *user_data) {
+  auto sink = reinterpret_cast<ShmSink *>(user_data);
+  sink->Close();
+  delete sink;
 }
 
-//? 是否应该支持 remove_callBack
-void add_callBack(void *user_data, call_back_handler_t call,
-                  flush_handler_t flush, close_handler_t close,
-                  Verbosity max_verbosity) {
-  std::unique_lock<std::recursive_mutex> lock(locker);
-  auto tmp = CallBack{.user_data = user_data,
-                      .call_back = call,
-                      .flush = flush,
-                      .close = close,
-                      .max_verbosit = max_verbosity};
-  callBacks.push_back(std::move(tmp));
+auto Add_shm_sink(const char *name, Verbosity verbosity, size_t ring_size)
+    -> bool {
+  pthread_once(&shm_fork_once, shm_install_fork_handler);
+  ShmSegment segment;
+  if (!segment.Open(name, ring_size)) {
+    LOG(ERROR, "failed to open shared memory: %s", name);
+    return false;
+  }
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  add_callBack(new ShmSink(segment), shm_log, nullptr, shm_close, verbosity);
+
+  LOG(MESSAGE, "SHM SINK:%-*s RingSize:%-*llu Verbosity:%-*s", FILENAME_WIDTH,
+      segment.Name(), 8, static_cast<unsigned long long>(segment.Ring_size()),
+      6, get_verbosity_name(verbosity));
+  return true;
 }
 
-void file_log(void *user_data, Message &message) {
-  auto file = reinterpret_cast<FILE *>(user_data);
-  fprintf(file, "%s%s\n", message.prefix, message.raw_message);
-  if (flush_interval_ms == 0) {
-    fflush(file);
+//* 把各个环按时间戳归并; 每个环内部已经有序, 每次取所有环头部最早的一条
+class ShmCollector {
+public:
+  explicit ShmCollector(ShmSegment segment) : segment(segment) {}
+
+  ~ShmCollector() { segment.Close(); }
+
+  //* 返回本次输出的条数; drain_all 时忽略 SHM_REORDER_MS
+  auto Collect(bool drain_all) -> size_t {
+    auto now = realtime_ns();
+    bool maintain = drain_all || now >= next_maintenance_ns;
+    if (maintain) {
+      next_maintenance_ns = now + SHM_MAINTENANCE_MS * 1000000ULL;
+    }
+    active.clear();
+    for (uint32_t i = 0; i < segment.Ring_count(); ++i) {
+      auto ring = segment.Ring(i);
+      auto state = ring->state.load(std::memory_order_acquire);
+      if (state != ShmActive && state != ShmClosed) {
+        continue;
+      }
+      if (maintain) {
+        Report_dropped(ring);
+      }
+      if (Front(ring)) {
+        active.push_back(ring);
+      } else if (maintain || state == ShmClosed) {
+        Release_if_done(ring, state);
+      }
+    }
+
+    size_t count = 0;
+    auto deadline = now - SHM_REORDER_MS * 1000000ULL;
+    while (!active.empty()) {
+      size_t earliest = 0;
+      ShmEntry *earliest_entry = nullptr;
+      for (size_t i = 0; i < active.size();) {
+        auto entry = Front(active[i]);
+        if (!entry) { //* 这个环已经读完
+          active[i] = active.back();
+          active.pop_back();
+          continue;
+        }
+        if (!earliest_entry || entry->ts_ns < earliest_entry->ts_ns) {
+          earliest = i;
+          earliest_entry = entry;
+        }
+        ++i;
+      }
+      if (!earliest_entry || (!drain_all && earliest_entry->ts_ns > deadline)) {
+        break;
+      }
+      Deliver(earliest_entry);
+      active[earliest]->tail.fetch_add(earliest_entry->size,
+                                       std::memory_order_release);
+      ++count;
+    }
+    return count;
+  }
+
+  //* 没有进程持有环, 也没有剩余的日志
+  auto Idle() const -> bool {
+    for (uint32_t i = 0; i < segment.Ring_count(); ++i) {
+      if (segment.Ring(i)->state.load(std::memory_order_acquire) != ShmFree) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Unlink() { segment.Unlink(); }
+
+private:
+  //* 跳过 SHM_PAD, 没有日志时返回 nullptr
+  auto Front(ShmRing *ring) -> ShmEntry * {
+    auto ring_size = segment.Ring_size();
+    while (true) {
+      auto tail = ring->tail.load(std::memory_order_relaxed);
+      if (tail == ring->head.load(std::memory_order_acquire)) {
+        return nullptr;
+      }
+      auto entry = reinterpret_cast<ShmEntry *>(segment.Data(ring) +
+                                                (tail & (ring_size - 1)));
+      if (entry->verbosity != SHM_PAD) {
+        return entry;
+      }
+      ring->tail.store(tail + entry->size, std::memory_order_release);
+    }
   }
+
+  void Deliver(ShmEntry *entry) {
+    auto text = reinterpret_cast<const char *>(entry + 1);
+    line.assign(text, entry->prefix_len);
+    line.push_back('\0');
+    line.append(text + entry->prefix_len, entry->text_len);
+    auto verbosity = static_cast<Verbosity>(entry->verbosity);
+    auto message = Message{
+        .verbosity = verbosity,
+        .file = "",
+        .line = 0,
+        .prefix = line.c_str(),
+        .raw_message = line.c_str() + entry->prefix_len + 1,
+        .ms_since_epoch = static_cast<long>(entry->ts_ns / 1000000),
+    };
+    log_message(verbosity, message);
+  }
+
+  void Report_dropped(ShmRing *ring) {
+    if (!ring->dropped.load(std::memory_order_relaxed)) {
+      return;
+    }
+    auto dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+    char text[128];
+    snprintf(text, sizeof text,
+             "log_what: process %d dropped %llu messages, shm ring is full",
+             ring->pid.load(std::memory_order_relaxed),
+             static_cast<unsigned long long>(dropped));
+    auto message = Message{
+        .verbosity = Verbosity::VerbosityWARNING,
+        .file = "",
+        .line = 0,
+        .prefix = "",
+        .raw_message = text,
+    };
+    log_message(Verbosity::VerbosityWARNING, message);
+  }
+
+  //* 已经读完的环: 进程主动关闭或者已经退出时交还
+  void Release_if_done(ShmRing *ring, uint32_t state) {
+    if (state == ShmActive) {
+      auto pid = ring->pid.load(std::memory_order_relaxed);
+      if (kill(pid, 0) == 0 || errno != ESRCH) {
+        return;
+      }
+    }
+    if (ring->state.compare_exchange_strong(state, ShmClaiming,
+                                            std::memory_order_acq_rel)) {
+      //* 在 CAS 之前写入的最后几条
+      if (Front(ring)) {
+        ring->state.store(state, std::memory_order_release);
+        return;
+      }
+      ring->state.store(ShmFree, std::memory_order_release);
+    }
+  }
+
+  ShmSegment segment;
+  std::string line;
+  std::vector<ShmRing *> active;
+  uint64_t next_maintenance_ns{0};
+};
+
+static ShmCollector *shm_collector{nullptr};
+static std::thread *shm_collector_thread{nullptr};
+static std::atomic<bool> shm_collector_stop{false};
+
+static void shm_collector_loop() {
+  is_shm_collector = true;
+  Set_thread_name("log_what_shm");
+  while (!shm_collector_stop.load(std::memory_order_acquire)) {
+    if (!shm_collector->Collect(false)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(SHM_IDLE_SLEEP_MS));
+    }
+  }
+  shm_collector->Collect(true);
 }
 
-void file_flush(void *user_data) {
-  auto file = reinterpret_cast<FILE *>(user_data);
-  fflush(file);
+static void shm_forget_collector() {
+  shm_collector_running.store(false);
+  shm_collector_thread = nullptr;
+  shm_collector = nullptr;
 }
 
-void file_close(void *user_data) {
-  auto file = reinterpret_cast<FILE *>(user_data);
-  if (file) {
-    fclose(file);
+auto Start_shm_collector(const char *name, size_t ring_size) -> bool {
+  pthread_once(&shm_fork_once, shm_install_fork_handler);
+  if (shm_collector_thread) {
+    return false;
+  }
+  ShmSegment segment;
+  if (!segment.Open(name, ring_size)) {
+    LOG(ERROR, "failed to open shared memory: %s", name);
+    return false;
+  }
+  allocations.fetch_add(2, std::memory_order_relaxed);
+  shm_collector = new ShmCollector(segment);
+  shm_collector_stop.store(false);
+  shm_collector_thread = new std::thread(shm_collector_loop);
+  shm_collector_running.store(true);
+  LOG(MESSAGE, "SHM COLLECTOR:%-*s Rings:%u", FILENAME_WIDTH, segment.Name(),
+      segment.Ring_count());
+  return true;
+}
+
+void Stop_shm_collector(bool remove) {
+  if (!shm_collector_thread) {
+    return;
+  }
+  shm_collector_running.store(false);
+  shm_collector_stop.store(true, std::memory_order_release);
+  shm_collector_thread->join();
+  delete shm_collector_thread;
+  shm_collector_thread = nullptr;
+  if (remove && shm_collector->Idle()) {
+    shm_collector->Unlink();
   }
+  delete shm_collector;
+  shm_collector = nullptr;
 }
 
 } // namespace what::Log
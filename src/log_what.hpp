@@ -2,10 +2,20 @@
 #define LOG_WHAT_HPP
 
 #define TERMINAL_HAS_COLOR 1
-#define UNSAFE 1
+#include <atomic>
 #include <cassert>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <limits.h>
+#include <memory>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 // TODO: handle_fatal(), backtrace()
 
@@ -23,10 +33,12 @@ enum class FileMode { Truncate, Append };
 
 struct signal_t {
   bool sigabrt{true};
+  bool sigsegv{true};
+  bool sigbus{true};
+  bool sigfpe{true};
+  bool sigill{true};
 
-  // TODO wait for more signal
-
-  void none() { sigabrt = false; }
+  void none() { sigabrt = sigsegv = sigbus = sigfpe = sigill = false; }
 };
 
 class Text {
@@ -54,6 +66,8 @@ private:
   char *__str{nullptr}; //初始化为nullptr
 };
 
+struct CallSite;
+
 class Message {
 public:
   /* already in prifix*/
@@ -66,12 +80,36 @@ public:
   const char *prefix;
 
   const char *raw_message;
+
+  /* 以下字段供二进制 sink 等需要原始数据的 callback 使用 */
+  long ms_since_epoch;
+
+  long uptime_ms;
+
+  const char *thread_name;
+
+  //* 延迟格式化的记录才有, 否则为 nullptr
+  const CallSite *site;
+
+  const char *args;
+
+  unsigned int args_size;
+
+  //* LOG_KV 的记录才有: 不含字段的消息, 以及编码后的 key/value
+  //* (与延迟格式化的参数编码相同, key 和 value 交替出现)
+  const char *kv_message;
+
+  const char *fields;
+
+  unsigned int fields_size;
 };
 
 typedef void (*call_back_handler_t)(void *user_data, Message &);
 typedef void (*flush_handler_t)(void *user_data);
 typedef void (*close_handler_t)(void *user_data);
 
+class SinkWorker;
+
 class CallBack {
 public:
   void *user_data;
@@ -83,6 +121,18 @@ public:
   close_handler_t close;
 
   Verbosity max_verbosit;
+
+  //* 有独立队列时由工作线程调用上面的函数, 否则为空
+  std::shared_ptr<SinkWorker> worker;
+
+  //* flush 需要等待 I/O 完成的 sink: flush_interval_ms 为 0 时也不在每条日志后 flush,
+  //* 只由 flush()、flush 线程和后台线程的每批日志之后 flush
+  bool lazy_flush{false};
+
+  //* 交给这个 sink 的日志条数和字节数(前缀 + 消息 + 换行), 由 locker 保护
+  uint64_t messages{0};
+
+  uint64_t bytes{0};
 };
 
 #define THREADNAME_WIDTH 16
@@ -114,25 +164,1219 @@ public:
     }                                                                          \
   } while (0);
 
-static int flush_interval_ms{0};
+//* 0 表示每条日志都立即 flush, 否则由 flush 线程按这个周期合并 flush
+extern std::atomic<int> flush_interval_ms;
+
+//* 编译期的最大 verbosity, 更大(更不重要)的日志直接编译为空
+//* 例如 -DLOG_WHAT_MAX_VERBOSITY=0 会去掉所有 MESSAGE 级别的日志
+#ifndef LOG_WHAT_MAX_VERBOSITY
+#define LOG_WHAT_MAX_VERBOSITY 1
+#endif
+
+//* stderr, 所有 callback 与 vmodule 规则中最大的 verbosity, 由 add_callBack() 等维护
+extern std::atomic<int> sink_max_verbosity;
+
+//* 再加上飞行记录器的 verbosity, 宏用它决定是否计算参数
+extern std::atomic<int> effective_max_verbosity;
+
+//* 宏在计算参数之前先检查, 被禁用的日志只有一次比较
+inline auto Should_log(Verbosity verbosity) -> bool {
+  return static_cast<int>(verbosity) <= LOG_WHAT_MAX_VERBOSITY &&
+         static_cast<int>(verbosity) <=
+             effective_max_verbosity.load(std::memory_order_relaxed);
+}
+
+void Set_stderr_verbosity(Verbosity verbosity);
 
 void log(Verbosity verbosity, const char *file, unsigned int line,
-         const char *format, ...);
+         const char *format, ...) __attribute__((format(printf, 4, 5)));
+
+//* 不带前缀的日志
+void raw_log(Verbosity verbosity, const char *file, unsigned int line,
+             const char *format, ...) __attribute__((format(printf, 4, 5)));
+
+//* 已经格式化好的消息(len 不含'\0'), LOG 宏在调用点格式化后使用
+void log_formatted(Verbosity verbosity, const char *file, unsigned int line,
+                   const char *text, size_t len);
+
+/******** deferred logging ********/
+//* 调用点描述符, 每个 LOG/VLOG 调用点一个静态实例
+#define SITE_UNRESOLVED INT_MAX
+
+//* 按格式串渲染编码后的参数, 与 format_deferred 相同
+typedef size_t (*render_args_t)(const char *format, const char *args,
+                                size_t args_size, char *out, size_t out_len);
+
+struct CallSite {
+  constexpr CallSite(Verbosity verbosity, const char *file, unsigned int line,
+                     const char *format)
+      : verbosity(verbosity), file(file), line(line), format(format) {}
+
+  Verbosity verbosity;
+
+  const char *file;
+
+  unsigned int line;
+
+  const char *format;
+
+  //* 按 vmodule 解析出的本调用点的级别, 配置变化时重置为 SITE_UNRESOLVED
+  mutable std::atomic<int> level{SITE_UNRESOLVED};
+
+  mutable std::atomic<bool> registered{false};
+
+  mutable const CallSite *next{nullptr};
+
+  //* LOG 宏的调用点为自己的参数类型生成的渲染函数, 后台线程不再解析格式串
+  mutable std::atomic<render_args_t> render{nullptr};
+};
+
+//* 第一次执行(或配置变化后)时解析调用点的级别并缓存
+auto resolve_site(const CallSite &site, Verbosity verbosity) -> bool;
+
+//* 宏用它代替 Should_log(): 已解析的调用点只有一次 load 和比较
+inline auto Site_enabled(const CallSite &site, Verbosity verbosity) -> bool {
+  if (static_cast<int>(verbosity) > LOG_WHAT_MAX_VERBOSITY) {
+    return false;
+  }
+  auto level = site.level.load(std::memory_order_relaxed);
+  if (static_cast<int>(verbosity) > level) {
+    return false;
+  }
+  return level != SITE_UNRESOLVED || resolve_site(site, verbosity);
+}
+
+//* 按源文件设置级别, 例如 "net/*=MESSAGE,db_pool=WARNING":
+//* 不含 '/' 的模式匹配文件名, 含 '/' 的匹配路径的结尾, 都不含扩展名, 支持 * 和 ?;
+//* 第一个匹配的模式生效, 匹配的文件的日志不再受 sink 级别的限制. 空串清除所有规则
+auto Set_vmodule(const char *spec) -> bool;
+
+//* 收到 SIGUSR1 或文件被修改时重新读取, 格式与命令行参数相同:
+//* "-v=INFO --vmodule=net/*=MESSAGE", 可以换行, '#' 之后为注释; 没有 vmodule 时清除规则
+void Watch_config_file(const char *path);
+
+//* 延迟格式化时参数的类型标签, 与 printf 的默认参数提升保持一致
+enum class ArgType : unsigned char {
+  Int,
+  Long,
+  LongLong,
+  Double,
+  LongDouble,
+  String,
+  Pointer,
+  Bool,     //* 以下两种只用于 LOG_KV 的值, 见 kv_type()
+  Unsigned, //* 无符号整数统一编码为 uint64_t
+  Unsupported,
+};
+
+//* char, signed char 和 unsigned char(可以带 const)的指针都按字符串处理
+template <typename U> constexpr auto is_char_pointer() -> bool {
+  if constexpr (std::is_pointer_v<U>) {
+    using C = std::remove_const_t<std::remove_pointer_t<U>>;
+    return std::is_same_v<C, char> || std::is_same_v<C, signed char> ||
+           std::is_same_v<C, unsigned char>;
+  } else {
+    return false;
+  }
+}
+
+template <typename T> constexpr auto arg_type() -> ArgType {
+  using U = std::decay_t<T>;
+  if constexpr (std::is_enum_v<U>) {
+    return arg_type<std::underlying_type_t<U>>();
+  } else if constexpr (is_char_pointer<U>()) {
+    return ArgType::String;
+  } else if constexpr (std::is_pointer_v<U> || std::is_null_pointer_v<U>) {
+    return ArgType::Pointer;
+  } else if constexpr (std::is_integral_v<U> && sizeof(U) <= sizeof(int)) {
+    return ArgType::Int;
+  } else if constexpr (std::is_same_v<U, long> ||
+                       std::is_same_v<U, unsigned long>) {
+    return ArgType::Long;
+  } else if constexpr (std::is_integral_v<U> &&
+                       sizeof(U) == sizeof(long long)) {
+    return ArgType::LongLong;
+  } else if constexpr (std::is_same_v<U, float> || std::is_same_v<U, double>) {
+    return ArgType::Double;
+  } else if constexpr (std::is_same_v<U, long double>) {
+    return ArgType::LongDouble;
+  } else {
+    return ArgType::Unsupported;
+  }
+}
+
+//* 编码后的格式: [类型标签][值], 字符串为 [标签][uint32 长度][字节]
+template <typename T> inline auto arg_size(const T &arg) -> size_t {
+  constexpr auto type = arg_type<T>();
+  if constexpr (type == ArgType::String) {
+    return 1 + sizeof(uint32_t) +
+           (arg ? strlen(reinterpret_cast<const char *>(arg))
+                : sizeof("(null)") - 1);
+  } else if constexpr (type == ArgType::Int) {
+    return 1 + sizeof(int);
+  } else if constexpr (type == ArgType::Long) {
+    return 1 + sizeof(long);
+  } else if constexpr (type == ArgType::LongLong) {
+    return 1 + sizeof(long long);
+  } else if constexpr (type == ArgType::Double) {
+    return 1 + sizeof(double);
+  } else if constexpr (type == ArgType::LongDouble) {
+    return 1 + sizeof(long double);
+  } else {
+    return 1 + sizeof(const void *);
+  }
+}
+
+template <typename V> inline void put_arg(char *&buffer, ArgType type, V v) {
+  *buffer++ = static_cast<char>(type);
+  memcpy(buffer, &v, sizeof v);
+  buffer += sizeof v;
+}
+
+template <typename T> inline void encode_arg(char *&buffer, const T &arg) {
+  constexpr auto type = arg_type<T>();
+  if constexpr (type == ArgType::String) {
+    const char *str = arg ? reinterpret_cast<const char *>(arg) : "(null)";
+    auto len = static_cast<uint32_t>(strlen(str));
+    put_arg(buffer, type, len);
+    memcpy(buffer, str, len);
+    buffer += len;
+  } else if constexpr (type == ArgType::Int) {
+    put_arg(buffer, type, static_cast<int>(arg));
+  } else if constexpr (type == ArgType::Long) {
+    put_arg(buffer, type, static_cast<long>(arg));
+  } else if constexpr (type == ArgType::LongLong) {
+    put_arg(buffer, type, static_cast<long long>(arg));
+  } else if constexpr (type == ArgType::Double) {
+    put_arg(buffer, type, static_cast<double>(arg));
+  } else if constexpr (type == ArgType::LongDouble) {
+    put_arg(buffer, type, static_cast<long double>(arg));
+  } else {
+    put_arg(buffer, type, static_cast<const void *>(arg));
+  }
+}
+
+//* 开启后(需要异步模式), 调用线程只拷贝参数和时间戳, 格式化交给后台线程
+void Set_deferred(bool enable);
+
+//* 时间戳来源: Clock 每条日志读取墙上时钟和单调时钟;
+//* Tsc 在调用点只读 rdtsc(没有 invariant TSC 时为 CLOCK_MONOTONIC_COARSE),
+//* 按 Init() 时记录的基准换算为日期和 uptime, 异步模式下由后台线程换算;
+//* 同步模式下前缀立即输出, 仍在调用线程换算(一次 seqlock 读取和乘法)
+enum class TimestampSource { Clock, Tsc };
+
+void Set_timestamp_source(TimestampSource source);
+
+//* 每秒用时钟重新校准一次; drift 是校准前按旧参数换算的时间与时钟的差
+struct TimestampCalibration {
+  bool tsc; //* false 表示退回到 CLOCK_MONOTONIC_COARSE
+  double ns_per_tick;
+  uint64_t calibrations;
+  int64_t last_drift_ns;
+  int64_t max_drift_ns; //* 绝对值最大的一次
+};
+
+auto Get_timestamp_calibration() -> TimestampCalibration;
+
+//* 在队列中预留一条延迟格式化记录并返回参数缓冲区, 返回 nullptr 表示应当立即格式化
+auto begin_deferred(const CallSite &site, Verbosity verbosity,
+                    size_t args_size, size_t &token) -> char *;
+
+void commit_deferred(size_t token);
+
+//* 按格式串渲染编码后的参数, 返回完整输出需要的长度(不含'\0'), 与 snprintf 一致
+auto format_deferred(const char *format, const char *args, size_t args_size,
+                     char *out, size_t out_len) -> size_t;
+
+/******** 编译期格式检查 ********/
+//* LOG/VLOG 把字面量格式串放进调用点的一个局部类型 (static Text()), 格式串随类型
+//* 进入模板: 编译期解析为字面量片段和转换说明, 检查参数的个数和类型,
+//* 并为每个调用点生成专门的格式化代码, 运行时不再解析格式串
+#define FORMAT_MAX_ARGS 32
+#define FORMAT_SPEC_SIZE 24
+//* width/precision 为 '*', 由参数给出
+#define FORMAT_STAR -2
+
+enum class FormatError : unsigned char {
+  None,
+  BadConversion,
+  TooManyConversions,
+  TooFewArguments,
+  TooManyArguments,
+  TypeMismatch,
+  UnsupportedArgument,
+};
+
+enum class ArgRole : unsigned char { Value, Width, Precision };
+
+//* 一个转换说明 %[flags][width][.precision][length]conversion 以及它之前的字面量
+struct FormatSpec {
+  size_t literal_begin{0};
+  size_t literal_end{0};
+  bool literal_escaped{false}; //* 字面量中有 "%%"
+  char text[FORMAT_SPEC_SIZE]{}; //* 单独的转换说明, 复杂的情况交给 snprintf
+  char conversion{0};
+  char length{0}; //* 与 conversion_type() 相同, 'H' 为 hh, 'q' 为 ll
+  ArgType type{ArgType::Unsupported}; //* 转换说明要求的参数类型
+  bool plain{true}; //* 没有 flags, width 和 precision
+  bool left{false};
+  int width{-1};
+  int precision{-1};
+};
+
+struct ParsedFormat {
+  FormatSpec specs[FORMAT_MAX_ARGS]{};
+  size_t count{0};
+  size_t tail_begin{0};
+  size_t tail_end{0};
+  bool tail_escaped{false};
+  //* 第 i 个参数的用途和所属的转换说明
+  ArgRole roles[FORMAT_MAX_ARGS]{};
+  size_t arg_specs[FORMAT_MAX_ARGS]{};
+  size_t args{0};
+  FormatError error{FormatError::None};
+};
+
+//* length: 'H' 为 hh, 'q' 为 ll
+constexpr auto conversion_type(char length, char conversion) -> ArgType {
+  switch (conversion) {
+  case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+    switch (length) {
+    case 0: case 'h': case 'H':
+      return ArgType::Int;
+    case 'l': case 'j': case 'z': case 't':
+      return conversion == 'c' ? ArgType::Int : ArgType::Long;
+    case 'q':
+      return ArgType::LongLong;
+    default:
+      return ArgType::Unsupported;
+    }
+  case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+    return length == 'L' ? ArgType::LongDouble
+           : length == 0 || length == 'l' ? ArgType::Double
+                                          : ArgType::Unsupported;
+  case 's':
+    return length == 0 ? ArgType::String : ArgType::Unsupported;
+  case 'p':
+    return length == 0 ? ArgType::Pointer : ArgType::Unsupported;
+  default: //* %n 和 glibc 的扩展不支持
+    return ArgType::Unsupported;
+  }
+}
+
+constexpr auto parse_number(const char *format, size_t &i) -> int {
+  int value = 0;
+  for (; format[i] >= '0' && format[i] <= '9'; ++i) {
+    value = value * 10 + (format[i] - '0');
+  }
+  return value;
+}
+
+constexpr auto parse_format(const char *format) -> ParsedFormat {
+  ParsedFormat parsed{};
+  size_t literal_begin = 0;
+  bool escaped = false;
+  size_t i = 0;
+  while (format[i]) {
+    if (format[i] != '%') {
+      ++i;
+      continue;
+    }
+    if (format[i + 1] == '%') {
+      escaped = true;
+      i += 2;
+      continue;
+    }
+    FormatSpec spec{};
+    spec.literal_begin = literal_begin;
+    spec.literal_end = i;
+    spec.literal_escaped = escaped;
+    size_t j = i + 1;
+    for (; format[j] == '-' || format[j] == '+' || format[j] == ' ' ||
+           format[j] == '#' || format[j] == '0' || format[j] == '\'';
+         ++j) {
+      spec.plain = false;
+      spec.left = spec.left || format[j] == '-';
+    }
+    if (format[j] == '*') {
+      spec.width = FORMAT_STAR;
+      ++j;
+    } else if (format[j] >= '0' && format[j] <= '9') {
+      spec.width = parse_number(format, j);
+    }
+    if (format[j] == '.') {
+      ++j;
+      if (format[j] == '*') {
+        spec.precision = FORMAT_STAR;
+        ++j;
+      } else {
+        spec.precision = parse_number(format, j);
+      }
+    }
+    char length = 0;
+    if (format[j] == 'h' || format[j] == 'l') {
+      length = format[j++];
+      if (format[j] == length) {
+        length = length == 'h' ? 'H' : 'q';
+        ++j;
+      }
+    } else if (format[j] == 'q' || format[j] == 'j' || format[j] == 'z' ||
+               format[j] == 't' || format[j] == 'L') {
+      length = format[j++];
+    }
+    spec.conversion = format[j];
+    spec.length = length;
+    spec.type = conversion_type(length, spec.conversion);
+    spec.plain = spec.plain && spec.width == -1 && spec.precision == -1;
+    size_t needed = 1 + (spec.width == FORMAT_STAR) +
+                    (spec.precision == FORMAT_STAR);
+    if (spec.type == ArgType::Unsupported || j + 1 - i >= FORMAT_SPEC_SIZE) {
+      parsed.error = FormatError::BadConversion;
+      return parsed;
+    }
+    if (parsed.count == FORMAT_MAX_ARGS ||
+        parsed.args + needed > FORMAT_MAX_ARGS) {
+      parsed.error = FormatError::TooManyConversions;
+      return parsed;
+    }
+    for (size_t k = i; k <= j; ++k) {
+      spec.text[k - i] = format[k];
+    }
+    if (spec.width == FORMAT_STAR) {
+      parsed.roles[parsed.args] = ArgRole::Width;
+      parsed.arg_specs[parsed.args++] = parsed.count;
+    }
+    if (spec.precision == FORMAT_STAR) {
+      parsed.roles[parsed.args] = ArgRole::Precision;
+      parsed.arg_specs[parsed.args++] = parsed.count;
+    }
+    parsed.roles[parsed.args] = ArgRole::Value;
+    parsed.arg_specs[parsed.args++] = parsed.count;
+    parsed.specs[parsed.count++] = spec;
+    i = literal_begin = j + 1;
+    escaped = false;
+  }
+  parsed.tail_begin = literal_begin;
+  parsed.tail_end = i;
+  parsed.tail_escaped = escaped;
+  return parsed;
+}
+
+//* long 与 long long 大小相同时可以互换, %p 可以接受字符串指针
+constexpr auto arg_compatible(ArgType expected, ArgType actual) -> bool {
+  if (expected == actual) {
+    return true;
+  }
+  if ((expected == ArgType::Long && actual == ArgType::LongLong) ||
+      (expected == ArgType::LongLong && actual == ArgType::Long)) {
+    return sizeof(long) == sizeof(long long);
+  }
+  return expected == ArgType::Pointer && actual == ArgType::String;
+}
+
+template <typename... Args>
+constexpr auto check_format(const ParsedFormat &parsed) -> FormatError {
+  if (parsed.error != FormatError::None) {
+    return parsed.error;
+  }
+  if (sizeof...(Args) < parsed.args) {
+    return FormatError::TooFewArguments;
+  }
+  if (sizeof...(Args) > parsed.args) {
+    return FormatError::TooManyArguments;
+  }
+  constexpr ArgType types[] = {arg_type<Args>()..., ArgType::Int};
+  for (size_t i = 0; i < parsed.args; ++i) {
+    if (types[i] == ArgType::Unsupported) {
+      return FormatError::UnsupportedArgument;
+    }
+    auto expected = parsed.roles[i] == ArgRole::Value
+                        ? parsed.specs[parsed.arg_specs[i]].type
+                        : ArgType::Int;
+    if (!arg_compatible(expected, types[i])) {
+      return FormatError::TypeMismatch;
+    }
+  }
+  return FormatError::None;
+}
+
+template <typename Format> struct CompiledFormat {
+  static constexpr ParsedFormat parsed = parse_format(Format::Text());
+};
+
+//* 后台线程解码出的字符串参数, 不以 '\0' 结尾
+struct StringArg {
+  const char *data;
+  size_t len;
+};
+
+template <ArgType Type> struct ArgValue;
+template <> struct ArgValue<ArgType::Int> { using type = int; };
+template <> struct ArgValue<ArgType::Long> { using type = long; };
+template <> struct ArgValue<ArgType::LongLong> { using type = long long; };
+template <> struct ArgValue<ArgType::Double> { using type = double; };
+template <> struct ArgValue<ArgType::LongDouble> { using type = long double; };
+template <> struct ArgValue<ArgType::String> { using type = StringArg; };
+template <> struct ArgValue<ArgType::Pointer> { using type = const void *; };
+
+//* %h 和 %hh 输出前先截断为 short 和 signed char, 与 printf 一致
+template <char Length, typename C> struct LengthValue { using type = C; };
+template <> struct LengthValue<'h', int> { using type = short; };
+template <> struct LengthValue<'H', int> { using type = signed char; };
+
+//* 转换为转换说明要求的 C 类型, 交给 snprintf
+template <ArgType Type, typename T> inline auto c_arg(const T &value) {
+  using C = typename ArgValue<Type>::type;
+  if constexpr (std::is_same_v<T, StringArg>) {
+    return static_cast<const void *>(value.data);
+  } else if constexpr (std::is_pointer_v<T>) {
+    return static_cast<const void *>(value);
+  } else {
+    return static_cast<C>(value);
+  }
+}
+
+inline auto string_arg(const char *value) -> StringArg {
+  return value ? StringArg{value, strlen(value)}
+               : StringArg{"(null)", sizeof("(null)") - 1};
+}
+
+inline auto string_arg(const signed char *value) -> StringArg {
+  return string_arg(reinterpret_cast<const char *>(value));
+}
+
+inline auto string_arg(const unsigned char *value) -> StringArg {
+  return string_arg(reinterpret_cast<const char *>(value));
+}
+
+inline auto string_arg(const StringArg &value) -> StringArg { return value; }
+
+//* 与 format_deferred 相同: 写入 out 的剩余空间, 总是累计完整输出需要的长度
+class FormatWriter {
+public:
+  FormatWriter(char *out, size_t out_len) : out(out), out_len(out_len) {}
+
+  void Put(const char *data, size_t len) {
+    if (pos < out_len) {
+      memcpy(out + pos, data, len < out_len - pos ? len : out_len - pos);
+    }
+    pos += len;
+  }
+
+  //* "%%" 输出为 '%'
+  void Put_literal(const char *data, size_t len, bool escaped) {
+    if (!escaped) {
+      Put(data, len);
+      return;
+    }
+    for (size_t i = 0; i < len; ++i) {
+      Put(data + i, 1);
+      i += data[i] == '%';
+    }
+  }
+
+  void Put_char(char c) { Put(&c, 1); }
+
+  void Put_pad(int count) {
+    for (; count > 0; --count) {
+      Put_char(' ');
+    }
+  }
+
+  template <typename I> void Put_integer(I value, int base) {
+    char digits[24]{};
+    auto result = std::to_chars(digits, digits + sizeof digits, value, base);
+    if (result.ec == std::errc()) {
+      Put(digits, result.ptr - digits);
+    }
+  }
+
+  //* %s 的 flags/width/precision 直接处理, 不需要 '\0' 结尾
+  void Put_string(StringArg value, bool left, int width, int precision) {
+    if (width < 0 && width != -1) { //* '*' 给出负数表示左对齐
+      left = true;
+      width = -width;
+    }
+    auto len = precision >= 0 && static_cast<size_t>(precision) < value.len
+                   ? static_cast<size_t>(precision)
+                   : value.len;
+    auto pad = width > 0 ? width - static_cast<int>(len) : 0;
+    if (!left) {
+      Put_pad(pad);
+    }
+    Put(value.data, len);
+    if (left) {
+      Put_pad(pad);
+    }
+  }
+
+  template <typename... V> void Put_spec(const char *spec, V... values) {
+    auto room = pos < out_len ? out_len - pos : 0;
+    int bytes = snprintf(room ? out + pos : nullptr, room, spec, values...);
+    if (bytes > 0) {
+      pos += bytes;
+    }
+  }
+
+  //* 返回完整输出需要的长度(不含'\0'), 与 snprintf 一致
+  auto Finish() -> size_t {
+    if (out_len) {
+      out[pos < out_len ? pos : out_len - 1] = '\0';
+    }
+    return pos;
+  }
+
+private:
+  char *out;
+  size_t out_len;
+  size_t pos{0};
+};
+
+template <typename F, size_t... I, typename... Args>
+inline void for_each_arg(F &&f, std::index_sequence<I...>,
+                         const Args &...args) {
+  (f(std::integral_constant<size_t, I>{}, args), ...);
+}
+
+//* 按调用点的格式串格式化, 参数已经由 check_format() 检查过
+template <typename Format, typename... Args>
+inline auto format_checked(char *out, size_t out_len, const Args &...args)
+    -> size_t {
+  using Compiled = CompiledFormat<Format>;
+  const char *text = Format::Text();
+  FormatWriter writer(out, out_len);
+  int star_width = -1;
+  int star_precision = -1;
+  auto write = [&](auto index, const auto &value) {
+    constexpr size_t I = decltype(index)::value;
+    constexpr ArgRole role = Compiled::parsed.roles[I];
+    if constexpr (role == ArgRole::Width) {
+      star_width = static_cast<int>(value);
+    } else if constexpr (role == ArgRole::Precision) {
+      star_precision = static_cast<int>(value);
+    } else {
+      constexpr FormatSpec spec =
+          Compiled::parsed.specs[Compiled::parsed.arg_specs[I]];
+      constexpr char conversion = spec.conversion;
+      writer.Put_literal(text + spec.literal_begin,
+                         spec.literal_end - spec.literal_begin,
+                         spec.literal_escaped);
+      if constexpr (conversion == 's') {
+        writer.Put_string(
+            string_arg(value), spec.left,
+            spec.width == FORMAT_STAR ? star_width : spec.width,
+            spec.precision == FORMAT_STAR ? star_precision : spec.precision);
+      } else if constexpr (spec.plain &&
+                           (conversion == 'd' || conversion == 'i')) {
+        using C = typename LengthValue<
+            spec.length, typename ArgValue<spec.type>::type>::type;
+        writer.Put_integer(static_cast<C>(c_arg<spec.type>(value)), 10);
+      } else if constexpr (spec.plain &&
+                           (conversion == 'u' || conversion == 'x')) {
+        using C = typename LengthValue<
+            spec.length, typename ArgValue<spec.type>::type>::type;
+        writer.Put_integer(
+            static_cast<std::make_unsigned_t<C>>(c_arg<spec.type>(value)),
+            conversion == 'u' ? 10 : 16);
+      } else if constexpr (spec.plain && conversion == 'c') {
+        writer.Put_char(static_cast<char>(c_arg<spec.type>(value)));
+      } else if constexpr (spec.width == FORMAT_STAR &&
+                           spec.precision == FORMAT_STAR) {
+        writer.Put_spec(spec.text, star_width, star_precision,
+                        c_arg<spec.type>(value));
+      } else if constexpr (spec.width == FORMAT_STAR) {
+        writer.Put_spec(spec.text, star_width, c_arg<spec.type>(value));
+      } else if constexpr (spec.precision == FORMAT_STAR) {
+        writer.Put_spec(spec.text, star_precision, c_arg<spec.type>(value));
+      } else {
+        writer.Put_spec(spec.text, c_arg<spec.type>(value));
+      }
+    }
+  };
+  for_each_arg(write, std::index_sequence_for<Args...>{}, args...);
+  writer.Put_literal(text + Compiled::parsed.tail_begin,
+                     Compiled::parsed.tail_end - Compiled::parsed.tail_begin,
+                     Compiled::parsed.tail_escaped);
+  return writer.Finish();
+}
+
+//* 按 encode_arg 的编码读取一个参数, 字符串指向参数缓冲区
+template <ArgType Type>
+inline auto decode_arg(const char *&args) -> typename ArgValue<Type>::type {
+  typename ArgValue<Type>::type value;
+  if constexpr (Type == ArgType::String) {
+    uint32_t len;
+    memcpy(&len, args + 1, sizeof len);
+    value = StringArg{args + 1 + sizeof len, len};
+    args += 1 + sizeof len + len;
+  } else {
+    memcpy(&value, args + 1, sizeof value);
+    args += 1 + sizeof value;
+  }
+  return value;
+}
+
+//* 注册到 CallSite::render, 后台线程按调用点的参数类型解码, 不再解析格式串
+template <typename Format, typename... Args>
+auto render_checked(const char *, [[maybe_unused]] const char *args, size_t,
+                    char *out, size_t out_len) -> size_t {
+  //* 花括号初始化保证从左到右求值
+  std::tuple<typename ArgValue<arg_type<Args>()>::type...> values{
+      decode_arg<arg_type<Args>()>(args)...};
+  return std::apply(
+      [&](const auto &...decoded) {
+        return format_checked<Format>(out, out_len, decoded...);
+      },
+      values);
+}
+
+/******** 飞行记录器 ********/
+//* 开启后所有不高于 verbosity 的日志以二进制形式(调用点 + 编码后的参数)写入
+//* 一个无锁的内存环形缓冲区, 不做格式化也不做 I/O; 只有 FATAL、崩溃信号或
+//* 调用 Dump_flight_recorder() 时才渲染最近的 entries 条, 输出到 stderr 和
+//* dump_path(可以为 nullptr). 只能开启一次
+auto Enable_flight_recorder(size_t entries, Verbosity verbosity,
+                            const char *dump_path = nullptr) -> bool;
+
+//* 按正常的前缀和格式渲染; 崩溃信号的处理函数使用只调用 write() 的版本,
+//* 时间输出为 epoch 毫秒和 uptime
+void Dump_flight_recorder();
+
+extern std::atomic<int> recorder_max_verbosity;
+
+//* 在环形缓冲区中预留一条记录, 返回参数缓冲区, 参数放不下时返回 nullptr
+auto begin_flight(const CallSite &site, Verbosity verbosity, size_t args_size,
+                  size_t &token) -> char *;
+
+void commit_flight(size_t token);
+
+//* 参数无法编码时退化为记录格式化后的文本
+void flight_text(const CallSite &site, Verbosity verbosity, const char *format,
+                 ...) __attribute__((format(printf, 3, 4)));
+
+template <typename... Args>
+inline void flight_record(const CallSite &site, Verbosity verbosity,
+                          const char *format, Args... args) {
+  constexpr bool supported =
+      ((arg_type<Args>() != ArgType::Unsupported) && ... && true);
+  if constexpr (supported) {
+    if (site.format == format) {
+      size_t token;
+      auto size = (arg_size(args) + ... + size_t(0));
+      if (auto buffer = begin_flight(site, verbosity, size, token)) {
+        (encode_arg(buffer, args), ...);
+        commit_flight(token);
+        return;
+      }
+    }
+  }
+  flight_text(site, verbosity, format, args...);
+}
+
+//* 运行时的格式串, 供库内部使用固定格式串的调用点(LOG_SCOPE 等)
+template <typename... Args>
+inline void log_site(const CallSite &site, Verbosity verbosity,
+                     const char *format, Args... args) {
+  if (static_cast<int>(verbosity) <=
+      recorder_max_verbosity.load(std::memory_order_relaxed)) {
+    flight_record(site, verbosity, format, args...);
+  }
+  //* 只有飞行记录器需要的级别不再交给 sink
+  if (static_cast<int>(verbosity) >
+      sink_max_verbosity.load(std::memory_order_relaxed)) {
+    return;
+  }
+  constexpr bool supported =
+      ((arg_type<Args>() != ArgType::Unsupported) && ... && true);
+  if constexpr (supported) {
+    if (site.format == format) { //* 格式串不是字面量时只能立即格式化
+      size_t token;
+      auto size = (arg_size(args) + ... + size_t(0));
+      if (auto buffer = begin_deferred(site, verbosity, size, token)) {
+        (encode_arg(buffer, args), ...);
+        commit_deferred(token);
+        return;
+      }
+    }
+  }
+  log(verbosity, site.file, site.line, format, args...);
+}
+
+#define LOG_TEXT_SIZE 1024
+
+//* 字面量格式串的调用点: 参数在编译期检查, 立即输出时在调用点用专门的代码格式化,
+//* 延迟格式化时把渲染函数注册到调用点, 由后台线程使用
+template <typename Format, typename... Args>
+inline void log_compiled(const CallSite &site, Verbosity verbosity,
+                         Args... args) {
+  constexpr auto error =
+      check_format<Args...>(CompiledFormat<Format>::parsed);
+  static_assert(error != FormatError::BadConversion,
+                "LOG: invalid or unsupported conversion in format string");
+  static_assert(error != FormatError::TooManyConversions,
+                "LOG: too many conversions in format string");
+  static_assert(error != FormatError::TooFewArguments,
+                "LOG: too few arguments for format string");
+  static_assert(error != FormatError::TooManyArguments,
+                "LOG: too many arguments for format string");
+  static_assert(error != FormatError::TypeMismatch,
+                "LOG: argument type does not match its conversion");
+  static_assert(error != FormatError::UnsupportedArgument,
+                "LOG: unsupported argument type");
+  if (static_cast<int>(verbosity) <=
+      recorder_max_verbosity.load(std::memory_order_relaxed)) {
+    flight_record(site, verbosity, site.format, args...);
+  }
+  if (static_cast<int>(verbosity) >
+      sink_max_verbosity.load(std::memory_order_relaxed)) {
+    return;
+  }
+  size_t token;
+  auto size = (arg_size(args) + ... + size_t(0));
+  if (auto buffer = begin_deferred(site, verbosity, size, token)) {
+    if (!site.render.load(std::memory_order_relaxed)) {
+      site.render.store(&render_checked<Format, Args...>,
+                        std::memory_order_relaxed);
+    }
+    (encode_arg(buffer, args), ...);
+    commit_deferred(token);
+    return;
+  }
+  char text[LOG_TEXT_SIZE];
+  auto len = format_checked<Format>(text, sizeof text, args...);
+  if (len < sizeof text) {
+    log_formatted(verbosity, site.file, site.line, text, len);
+  } else { //* 超长的消息交给 log(), 借用内存池
+    log(verbosity, site.file, site.line, site.format, args...);
+  }
+}
 
-#define VLOG(verbosity, ...)                                                   \
-  what::Log::log(verbosity, __FILE__, __LINE__, __VA_ARGS__);
+//* LOG/VLOG 的入口; 编译期不知道内容的格式串(Format::Text() 为 nullptr)
+//* 交给 log_site() 在运行时格式化
+template <typename Format, typename... Args>
+inline void log_checked(const CallSite &site, Verbosity verbosity,
+                        [[maybe_unused]] const char *format, Args... args) {
+  if constexpr (Format::Text() == nullptr) {
+    log_site(site, verbosity, format, args...);
+  } else {
+    log_compiled<Format>(site, verbosity, args...);
+  }
+}
+
+/******** 结构化日志 ********/
+#define KV_BUFFER_SIZE 1024
+
+template <typename... Args> constexpr auto kv_keys_are_strings() -> bool {
+  constexpr ArgType types[] = {arg_type<Args>()..., ArgType::String};
+  for (size_t i = 0; i < sizeof...(Args); i += 2) {
+    if (types[i] != ArgType::String) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//* 字段的值没有转换说明决定如何输出: bool 和 unsigned int 及更宽的无符号整数
+//* 使用单独的类型标签, 输出 true/false 和不带符号的值, 其余与 arg_type() 相同
+template <typename T> constexpr auto kv_type() -> ArgType {
+  using U = std::decay_t<T>;
+  if constexpr (std::is_same_v<U, bool>) {
+    return ArgType::Bool;
+  } else if constexpr (std::is_integral_v<U> && std::is_unsigned_v<U> &&
+                       sizeof(U) >= sizeof(unsigned int)) {
+    return ArgType::Unsigned;
+  } else {
+    return arg_type<T>();
+  }
+}
+
+template <typename T> inline auto kv_size(const T &value) -> size_t {
+  constexpr auto type = kv_type<T>();
+  if constexpr (type == ArgType::Bool) {
+    return 1 + sizeof(bool);
+  } else if constexpr (type == ArgType::Unsigned) {
+    return 1 + sizeof(uint64_t);
+  } else {
+    return arg_size(value);
+  }
+}
+
+template <typename T> inline void encode_kv(char *&buffer, const T &value) {
+  constexpr auto type = kv_type<T>();
+  if constexpr (type == ArgType::Bool) {
+    put_arg(buffer, type, static_cast<bool>(value));
+  } else if constexpr (type == ArgType::Unsigned) {
+    put_arg(buffer, type, static_cast<uint64_t>(value));
+  } else {
+    encode_arg(buffer, value);
+  }
+}
+
+//* 异步模式下预留一条结构化记录, 返回字段缓冲区; 否则返回 nullptr, 用 log_kv_fields()
+auto begin_kv(const CallSite &site, Verbosity verbosity, size_t fields_size,
+              size_t &token) -> char *;
+
+void log_kv_fields(const CallSite &site, Verbosity verbosity,
+                   const char *fields, size_t fields_size);
+
+//* 把字段渲染为 logfmt 风格的文本: message key=value key="带空格的 value"
+//* 返回完整输出需要的长度(不含'\0'), 与 snprintf 一致
+auto format_kv(const char *message, const char *fields, size_t fields_size,
+               char *out, size_t out_len) -> size_t;
+
+template <typename... Args>
+inline void log_kv(const CallSite &site, Verbosity verbosity, Args... kvs) {
+  static_assert(sizeof...(Args) % 2 == 0, "LOG_KV expects key, value pairs");
+  static_assert(kv_keys_are_strings<Args...>(), "LOG_KV keys must be strings");
+  static_assert(((kv_type<Args>() != ArgType::Unsupported) && ... && true),
+                "unsupported LOG_KV value type");
+  if (static_cast<int>(verbosity) >
+      sink_max_verbosity.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if constexpr (sizeof...(Args) == 0) {
+    log_kv_fields(site, verbosity, nullptr, 0);
+  } else {
+    auto size = (kv_size(kvs) + ... + size_t(0));
+    size_t token;
+    if (auto buffer = begin_kv(site, verbosity, size, token)) {
+      (encode_kv(buffer, kvs), ...);
+      commit_deferred(token);
+      return;
+    }
+    char inline_buffer[KV_BUFFER_SIZE];
+    auto fields = size <= sizeof inline_buffer
+                      ? inline_buffer
+                      : static_cast<char *>(malloc(size));
+    if (!fields) {
+      return;
+    }
+    auto buffer = fields;
+    (encode_kv(buffer, kvs), ...);
+    log_kv_fields(site, verbosity, fields, size);
+    if (fields != inline_buffer) {
+      free(fields);
+    }
+  }
+}
+
+// LOG_KV(INFO, "request done", "latency_us", 123, "path", path)
+//* message 必须是字面量: 它保存在调用点里, 后台线程和 sink 在之后才读取
+#define VLOG_KV(verbosity, message, ...)                                       \
+  do {                                                                         \
+    struct log_what_message {                                                  \
+      static constexpr auto Text() -> const char * { return (message); }       \
+    };                                                                         \
+    static_assert(log_what_message::Text() != nullptr,                         \
+                  "LOG_KV message must be a string literal");                  \
+    static const what::Log::CallSite log_what_site{                            \
+        (verbosity), __FILE__, __LINE__, log_what_message::Text()};            \
+    if (what::Log::Site_enabled(log_what_site, (verbosity))) {                 \
+      what::Log::log_kv(log_what_site, (verbosity), ##__VA_ARGS__);            \
+    }                                                                          \
+  } while (0);
+
+#define LOG_KV(verbosityname, ...)                                             \
+  VLOG_KV(what::Log::Verbosity::Verbosity##verbosityname, __VA_ARGS__)
+
+//* 字面量的 format 在编译期检查并生成格式化代码; 其他格式串(数组、变量、
+//* c_str())按 printf 的规则在运行时立即格式化, 没有编译期检查
+#define VLOG(verbosity, format, ...)                                           \
+  do {                                                                         \
+    constexpr const char *log_what_text =                                      \
+        __builtin_constant_p(format) ? (format) : nullptr;                     \
+    struct log_what_format {                                                   \
+      static constexpr auto Text() -> const char * { return log_what_text; }   \
+    };                                                                         \
+    static const what::Log::CallSite log_what_site{(verbosity), __FILE__,      \
+                                                   __LINE__, log_what_text};   \
+    if (what::Log::Site_enabled(log_what_site, (verbosity))) {                 \
+      what::Log::log_checked<log_what_format>(log_what_site, (verbosity),      \
+                                              (format), ##__VA_ARGS__);        \
+    }                                                                          \
+  } while (0);
 
 // LOG(INFO,"test:%s\n",str)
 #define LOG(verbosityname, ...)                                                \
   VLOG(what::Log::Verbosity::Verbosity##verbosityname, __VA_ARGS__)
 
 #define RAW_VLOG(verbosity, ...)                                               \
-  what::Log::raw_log(verbosity, __FILE__, __LINE__, __VA_ARGS__);
+  do {                                                                         \
+    static const what::Log::CallSite log_what_site{(verbosity), __FILE__,      \
+                                                   __LINE__, nullptr};         \
+    if (what::Log::Site_enabled(log_what_site, (verbosity))) {                 \
+      what::Log::raw_log(verbosity, __FILE__, __LINE__, __VA_ARGS__);          \
+    }                                                                          \
+  } while (0);
 
 #define RAW_LOG(verbosityname, ...)                                            \
   RAW_VLOG(what::Log::Verbosity::Verbosity##verbosityname, __VA_ARGS__)
-// TODsO
-//* 对log系统进行初始化
+
+//* 调用栈中符号的输出方式: Symbolized 解析函数名(每个地址只解析一次并缓存),
+//* Raw 只输出 "模块(+偏移)", 可以用 addr2line -Cfe <模块> <偏移> 离线解析
+enum class StacktraceMode { Symbolized, Raw };
+
+void Set_stacktrace_mode(StacktraceMode mode);
+
+//* 输出日志并附上当前线程的调用栈; 异步模式下调用线程只抓取返回地址,
+//* 符号解析由后台线程完成
+void log_stacktrace(Verbosity verbosity, const char *file, unsigned int line,
+                    const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#define VLOG_STACKTRACE(verbosity, ...)                                        \
+  do {                                                                         \
+    static const what::Log::CallSite log_what_site{(verbosity), __FILE__,      \
+                                                   __LINE__, nullptr};         \
+    if (what::Log::Site_enabled(log_what_site, (verbosity))) {                 \
+      what::Log::log_stacktrace(verbosity, __FILE__, __LINE__, __VA_ARGS__);   \
+    }                                                                          \
+  } while (0);
+
+#define LOG_STACKTRACE(verbosityname, ...)                                     \
+  VLOG_STACKTRACE(what::Log::Verbosity::Verbosity##verbosityname, __VA_ARGS__)
+
+/******** 限流 ********/
+//* 每个限流调用点的状态, 常量初始化, 不需要 static 局部变量的加锁
+//* 被抑制的调用只做一次 count 的原子加法(LOG_EVERY_MS 另外读一次粗粒度时钟),
+//* 每 RATE_LIMIT_CHECK_CALLS 次调用才进入一次 rate_limit_check()
+struct RateLimit {
+  constexpr RateLimit(Verbosity verbosity, const char *file, unsigned int line)
+      : verbosity(verbosity), file(file), line(line) {}
+
+  const Verbosity verbosity;
+  const char *const file;
+  const unsigned int line;
+  std::atomic<uint64_t> count{0};   //* 总调用次数
+  std::atomic<uint64_t> emitted{0}; //* 实际输出的次数
+  std::atomic<long> next_ms{0};     //* LOG_EVERY_MS 下一次允许输出的时间
+  std::atomic<bool> registered{false};
+  uint64_t reported{0}; //* 已经汇报过的被抑制次数
+  RateLimit *next{nullptr};
+};
+
+//* 精度为几毫秒的单调时钟, 走 vDSO, 不进入内核
+inline auto coarse_ms() -> long {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#define RATE_LIMIT_CHECK_CALLS 1024
+
+//* 第一次调用时登记调用点, 之后检查是否到了输出 "suppressed N messages" 汇总的时间,
+//* 这样即使调用点从不放行也会汇总
+void rate_limit_check(RateLimit &limit);
+
+//* 返回之前的调用次数
+inline auto rate_limit_count(RateLimit &limit) -> uint64_t {
+  auto count = limit.count.fetch_add(1, std::memory_order_relaxed);
+  if (count % RATE_LIMIT_CHECK_CALLS == 0) {
+    rate_limit_check(limit);
+  }
+  return count;
+}
+
+//* n <= 0 时从不放行
+inline auto every_n_pass(RateLimit &limit, long long n) -> bool {
+  auto count = rate_limit_count(limit);
+  return n > 0 && count % static_cast<uint64_t>(n) == 0;
+}
+
+inline auto first_n_pass(RateLimit &limit, long long n) -> bool {
+  auto count = rate_limit_count(limit);
+  return n > 0 && count < static_cast<uint64_t>(n);
+}
+
+inline auto every_ms_pass(RateLimit &limit, long ms) -> bool {
+  rate_limit_count(limit);
+  auto now = coarse_ms();
+  auto next = limit.next_ms.load(std::memory_order_relaxed);
+  return now >= next && limit.next_ms.compare_exchange_strong(
+                            next, now + ms, std::memory_order_relaxed);
+}
+
+//* 限流调用点放行一条日志时调用
+void rate_limit_pass(RateLimit &limit);
+
+//* 立即为所有有新增抑制的调用点输出汇总, exit() 时也会调用
+void Report_suppressed();
+
+#define VLOG_IF_PASS(verbosity, pass, format, ...)                             \
+  do {                                                                         \
+    static const what::Log::CallSite log_what_gate{(verbosity), __FILE__,      \
+                                                   __LINE__, (format)};        \
+    if (what::Log::Site_enabled(log_what_gate, (verbosity))) {                 \
+      static what::Log::RateLimit log_what_limit{(verbosity), __FILE__,        \
+                                                 __LINE__};                    \
+      if (pass) {                                                              \
+        what::Log::rate_limit_pass(log_what_limit);                            \
+        VLOG(verbosity, format, ##__VA_ARGS__)                                 \
+      }                                                                        \
+    }                                                                          \
+  } while (0);
+
+//* 第 1, n+1, 2n+1 ... 次调用时输出
+#define VLOG_EVERY_N(verbosity, n, format, ...)                                \
+  VLOG_IF_PASS(verbosity, what::Log::every_n_pass(log_what_limit, (n)),        \
+               format, ##__VA_ARGS__)
+
+//* 只输出前 n 次
+#define VLOG_FIRST_N(verbosity, n, format, ...)                                \
+  VLOG_IF_PASS(verbosity, what::Log::first_n_pass(log_what_limit, (n)),        \
+               format, ##__VA_ARGS__)
+
+//* 每 ms 毫秒最多输出一次
+#define VLOG_EVERY_MS(verbosity, ms, format, ...)                              \
+  VLOG_IF_PASS(verbosity, what::Log::every_ms_pass(log_what_limit, (ms)),      \
+               format, ##__VA_ARGS__)
+
+// LOG_EVERY_N(ERROR, 100, "send failed:%d", err)
+#define LOG_EVERY_N(verbosityname, n, ...)                                     \
+  VLOG_EVERY_N(what::Log::Verbosity::Verbosity##verbosityname, n, __VA_ARGS__)
+
+#define LOG_FIRST_N(verbosityname, n, ...)                                     \
+  VLOG_FIRST_N(what::Log::Verbosity::Verbosity##verbosityname, n, __VA_ARGS__)
+
+#define LOG_EVERY_MS(verbosityname, ms, ...)                                   \
+  VLOG_EVERY_MS(what::Log::Verbosity::Verbosity##verbosityname, ms,            \
+                __VA_ARGS__)
+
+/******** 作用域计时 ********/
+#define SCOPE_INDENT 2
+//* LOG_TIMER 汇总的默认周期
+#define SCOPE_REPORT_MS 10000
+
+inline constexpr char scope_enter_format[] = "%*s{ %s";
+inline constexpr char scope_exit_format[] = "%*s} %s %.3fms";
+inline constexpr char scope_summary_format[] =
+    "scope %s: count=%llu total=%.3fms avg=%.3fms max=%.3fms";
+
+//* 每个 LOG_SCOPE/LOG_TIMER 一个静态实例, name 必须一直有效(汇总在之后输出)
+struct ScopeSite {
+  constexpr ScopeSite(Verbosity verbosity, const char *file, unsigned int line,
+                      const char *name, bool aggregate)
+      : enter_site(verbosity, file, line, scope_enter_format),
+        exit_site(verbosity, file, line,
+                  aggregate ? scope_summary_format : scope_exit_format),
+        name(name), aggregate(aggregate) {}
+
+  CallSite enter_site;
+
+  CallSite exit_site; //* LOG_TIMER 用它输出汇总
+
+  const char *name;
+
+  bool aggregate;
+};
+
+//* LOG_SCOPE: 进入和退出时各输出一条, 按当前线程的嵌套深度缩进, 退出时附上耗时;
+//* LOG_TIMER: 不输出单条日志, 只在线程本地的表中累计次数/总耗时/最大耗时
+//* 计时使用与时间戳相同的时钟, TSC 模式下只读 rdtsc
+class ScopeTimer {
+public:
+  explicit ScopeTimer(const ScopeSite &site) {
+    if (Site_enabled(site.enter_site, site.enter_site.verbosity)) {
+      Enter(site);
+    }
+  }
+
+  ScopeTimer(const ScopeTimer &) = delete;
+  auto operator=(const ScopeTimer &) -> ScopeTimer & = delete;
+
+  ~ScopeTimer() {
+    if (__site) {
+      Leave();
+    }
+  }
+
+private:
+  void Enter(const ScopeSite &site);
+
+  void Leave();
+
+  const ScopeSite *__site{nullptr};
+
+  uint64_t __start{0};
+
+  bool __ticks{false};
+};
+
+//* LOG_TIMER 的汇总周期(毫秒), 每个周期输出一次后清零; 0 表示只在
+//* Report_scopes() 和 exit() 时输出. 各线程的累计最多每秒合并一次
+void Set_scope_report_interval(int interval_ms);
+
+//* 合并当前线程的累计并立即输出所有 LOG_TIMER 的汇总, exit() 时也会调用
+void Report_scopes();
+
+#define LOG_WHAT_CONCAT_IMPL(a, b) a##b
+#define LOG_WHAT_CONCAT(a, b) LOG_WHAT_CONCAT_IMPL(a, b)
+
+#define VLOG_SCOPE_IMPL(verbosity, name, aggregate)                            \
+  static const what::Log::ScopeSite LOG_WHAT_CONCAT(log_what_scope_,          \
+                                                    __LINE__){                 \
+      (verbosity), __FILE__, __LINE__, (name), (aggregate)};                   \
+  what::Log::ScopeTimer LOG_WHAT_CONCAT(log_what_timer_, __LINE__){            \
+      LOG_WHAT_CONCAT(log_what_scope_, __LINE__)};
+
+#define VLOG_SCOPE(verbosity, name) VLOG_SCOPE_IMPL(verbosity, name, false)
+
+#define VLOG_TIMER(verbosity, name) VLOG_SCOPE_IMPL(verbosity, name, true)
+
+// LOG_SCOPE(INFO, "load config") 到所在作用域结束
+#define LOG_SCOPE(verbosityname, name)                                         \
+  VLOG_SCOPE(what::Log::Verbosity::Verbosity##verbosityname, name)
+
+#define LOG_TIMER(verbosityname, name)                                         \
+  VLOG_TIMER(what::Log::Verbosity::Verbosity##verbosityname, name)
+
+/******** 自身统计 ********/
+//* 桶 i 统计 [2^i, 2^(i+1)) 纳秒, 桶 0 同时包含 0
+#define STATS_BUCKETS 40
+
+struct Histogram {
+  uint64_t count{0};
+  uint64_t sum_ns{0};
+  uint64_t max_ns{0};
+  uint64_t buckets[STATS_BUCKETS]{};
+
+  //* 返回所在桶的上界, 误差在两倍以内
+  auto Percentile(double p) const -> uint64_t;
+};
+
+struct SinkStats {
+  void *user_data; //* add_callBack() 时传入的 user_data
+  uint64_t messages;
+  uint64_t bytes;
+  uint64_t dropped; //* 独立队列满时丢弃的条数
+};
+
+#define STATS_VERBOSITY_BUCKETS 6
+
+struct Stats {
+  //* 按级别的条数, 下标为 verbosity - VerbosityFATAL, 最后一个是 VLOG(2) 及以上的总数
+  uint64_t messages[STATS_VERBOSITY_BUCKETS];
+  uint64_t stderr_bytes;
+  uint64_t dropped; //* 所有 sink 丢弃的条数之和
+  uint64_t queue_full; //* 异步队列满, 生产者等待后台线程的次数
+  uint64_t queue_depth; //* 异步队列当前的记录数
+  uint64_t batch_max; //* 后台线程每批处理的最多记录数
+  //* 以下需要 Enable_stats(true): 每个统计点多两次读时钟
+  Histogram lock_wait; //* 等待 locker, 未竞争时记为 0 且不读时钟
+  Histogram enqueue; //* 生产者写入异步队列
+  Histogram queue_latency; //* 异步模式下从写入队列到后台线程开始分发
+  Histogram dispatch; //* 分发到 stderr 和所有 callback
+  Histogram flush; //* flush 所有 sink
+  std::vector<SinkStats> sinks;
+};
+
+//* 计数一直开启; enable 控制延迟直方图, report_interval_ms > 0 时定期以一条 INFO 日志输出摘要
+void Enable_stats(bool enable, int report_interval_ms = 0);
+
+auto Get_stats() -> Stats;
+
+//* 对log系统进行初始化, 识别 -v LEVEL, -v=LEVEL, --vmodule=SPEC 参数(不会从 argv 中移除);
+//* LEVEL 可以是数字或 MESSAGE/INFO/WARNING/ERROR/FATAL
 void Init(int argc, char *argv[]);
 
 void write_to_stderr(const char *);
@@ -141,12 +1385,26 @@ void write_to_stderr(const char *, size_t);
 
 void install_signal_handler(const signal_t &);
 
+//* 开启异步模式: 日志写入无锁环形队列(queue_size 向上取整为2的幂),
+//* 由后台线程统一格式化并分发到 stderr 和各个 callback
+auto Start_async(size_t queue_size) -> bool;
+
+//* 排空队列并停止后台线程, 之后的日志重新同步输出;
+//* 与 Start_async() 一样可以在多个线程中同时调用, 不能在 callback 中调用
+void Stop_async();
+
 auto Add_file(const char *path_in, FileMode filemode, Verbosity verbosity)
     -> bool;
 
+//* queue_size > 0 时 callback 拥有独立的有界队列和工作线程, 慢的 callback
+//* 不会阻塞其他 sink 和写日志的线程; 队列满时丢弃新日志, 之后汇报丢弃的条数
 void add_callBack(void *user_data, call_back_handler_t call,
                   flush_handler_t flush, close_handler_t close,
-                  Verbosity max_verbosity);
+                  Verbosity max_verbosity, size_t queue_size = 0);
+
+//* 按 user_data 移除 callback, 可以在其他线程写日志时调用:
+//* 已经排队的日志处理完后依次调用 flush 和 close. 不能在 callback 内部调用
+auto remove_callBack(void *user_data) -> bool;
 
 //* 程序退出时的执行的函数
 void exit();
@@ -165,9 +1423,17 @@ void log_message(Verbosity verbosity, Message &message);
 
 auto vastextprint(const char *format, va_list list) -> Text;
 
+//* 日志库自身的堆分配次数(arena, 内存池, vasprintf, strdup), 用于测试稳态下无分配
+auto allocation_count() -> unsigned long;
+
 void print_prefix(char *prefix, size_t prefix_len, Verbosity verbosity,
                   const char *file, unsigned int line);
 
+//* 使用给定的时间与线程名生成前缀, 异步模式下由后台线程调用
+void format_prefix(char *prefix, size_t prefix_len, Verbosity verbosity,
+                   const char *file, unsigned int line, long ms_since_epoch,
+                   long uptime_ms, const char *thread_name);
+
 void get_thread_name(char *thread_name, size_t thread_name_len);
 
 auto filename(const char *) -> const char *;
@@ -178,11 +1444,146 @@ auto create_dir(const char *) -> bool;
 
 void flush();
 
+//* sink 写缓冲的大小, 最长的滞留时间由 flush_interval_ms 决定
+void Set_write_batch(size_t batch_bytes);
+
 /******** file call back ********/
+//* user_data 为 FILE *
 void file_log(void *user_data, Message &message);
 void file_flush(void *user_data);
 void file_close(void *user_data);
 
+//* Add_file() 使用的批量写 sink, 攒满缓冲区或 flush 时用一次 writev 写出
+void batch_file_log(void *user_data, Message &message);
+void batch_file_flush(void *user_data);
+void batch_file_close(void *user_data);
+
+/******** rotating file ********/
+struct RotateOptions {
+  size_t max_bytes{0}; //* 单个文件的最大字节数, 0 表示不限制
+
+  long max_age_sec{0}; //* 单个文件最长写多久, 0 表示不限制
+
+  int max_files{0}; //* 保留的历史文件个数, 0 表示全部保留
+
+  bool compress{true}; //* 编译时定义了 LOG_WHAT_HAS_ZLIB 才会 gzip
+};
+
+//* 与 Add_file() 相同的文本格式, 超过大小或时间后切换到提前创建的 path.next,
+//* 由后台线程把旧文件重命名为 path.YYYYMMDD-HHMMSS.NNN、把 path.next 重命名为 path,
+//* 压缩和清理历史文件也在后台线程完成
+auto Add_rotating_file(const char *path_in, FileMode filemode,
+                       Verbosity verbosity, const RotateOptions &options)
+    -> bool;
+
+void rotating_file_log(void *user_data, Message &message);
+void rotating_file_flush(void *user_data);
+void rotating_file_close(void *user_data);
+
+/******** indexed file ********/
+//* 与 Add_file() 相同的文本格式, 另外写一个 path.idx 索引: 每 every_records 条或
+//* every_bytes 字节为一个块, 记录块的位置、时间范围和包含的级别,
+//* log_what_query 用它按时间二分查找并跳过不含所需级别的块
+//* 索引文件: LOG_INDEX_MAGIC 之后是一串定长的 IndexBlock
+#define LOG_INDEX_MAGIC "LOGWIDX\1"
+
+struct IndexOptions {
+  size_t every_records{1024}; //* 0 表示不按条数分块
+
+  size_t every_bytes{64 * 1024}; //* 0 表示不按字节分块
+};
+
+struct IndexBlock {
+  uint64_t offset; //* 块在日志文件中的起始偏移, 总是一条日志的开头
+  uint64_t length;
+  int64_t min_ms; //* 块内最早的时间戳
+  int64_t max_ms; //* 到这个块为止最晚的时间戳, 单调不减, 用于二分查找
+  uint32_t records;
+  uint32_t levels; //* 第 i 位表示包含 verbosity 为 VerbosityFATAL + i 的日志
+};
+
+//* 追加到没有索引的已有文件时, 已有的内容作为一个包含所有级别、时间未知的块
+auto Add_indexed_file(const char *path_in, FileMode filemode,
+                      Verbosity verbosity, const IndexOptions &options = {})
+    -> bool;
+
+void indexed_file_log(void *user_data, Message &message);
+void indexed_file_flush(void *user_data);
+void indexed_file_close(void *user_data);
+
+/******** json file ********/
+//* 每条日志一行 JSON: ts(毫秒时间戳), level, thread, file, line, msg,
+//* 以及 LOG_KV 的字段; 直接编码进输出缓冲区, 不分配内存
+auto Add_json_file(const char *path_in, FileMode filemode, Verbosity verbosity)
+    -> bool;
+
+void json_file_log(void *user_data, Message &message);
+void json_file_flush(void *user_data);
+void json_file_close(void *user_data);
+
+/******** io_uring file ********/
+//* 与 Add_file() 相同的文本格式, 写满的缓冲区通过 io_uring 异步提交,
+//* 写日志的线程不会阻塞在 write() 上; 内核不支持时退回到 pwrite.
+//* flush 会等待所有在途的写完成, 所以 flush_interval_ms 为 0 时也不在每条日志之后
+//* flush, 而是交给 flush 线程(异步模式下为后台线程的每批日志之后), flush() 照常等待
+auto Add_uring_file(const char *path_in, FileMode filemode,
+                    Verbosity verbosity) -> bool;
+
+void uring_file_log(void *user_data, Message &message);
+void uring_file_flush(void *user_data);
+void uring_file_close(void *user_data);
+
+/******** mmap file ********/
+//* 与 Add_file() 相同的文本格式, 但文件按块预分配并通过 mmap 写入,
+//* 没有 stdio 缓冲和逐条的系统调用, 进程崩溃时已写入页缓存的日志不会丢失
+auto Add_mmap_file(const char *path_in, FileMode filemode, Verbosity verbosity)
+    -> bool;
+
+void mmap_file_log(void *user_data, Message &message);
+void mmap_file_flush(void *user_data);
+void mmap_file_close(void *user_data);
+
+/******** shared memory ********/
+//* 同一台机器上的多个进程(例如 pre-fork 的 worker)不再各自打开同一个文件:
+//* 每个进程独占 /dev/shm/log_what.<name> 中的一个环, 写入格式化好的一行,
+//* 环满时丢弃并计数; 由一个 collector 按时间戳合并后交给它所在进程的 callback,
+//* 写入者在读时钟与提交之间停顿超过 2ms 时顺序可能颠倒
+#define SHM_RINGS 64
+#define SHM_RING_SIZE (1 << 20)
+
+//* ring_size 只在创建共享内存的进程中生效; fork 之后子进程第一次写入时占用新的环
+auto Add_shm_sink(const char *name, Verbosity verbosity,
+                  size_t ring_size = SHM_RING_SIZE) -> bool;
+
+void shm_log(void *user_data, Message &message);
+void shm_close(void *user_data);
+
+//* 在当前进程中启动 collector 线程, 日志交给本进程的 callback(不会输出到 stderr,
+//* 也不会再写回共享内存); 也可以使用独立的 log_what_collector
+auto Start_shm_collector(const char *name, size_t ring_size = SHM_RING_SIZE)
+    -> bool;
+
+//* 输出所有环中剩余的日志后停止, exit() 时也会调用;
+//* remove 为 true 且所有环都已经交还时删除 /dev/shm 中的共享内存
+void Stop_shm_collector(bool remove = false);
+
+/******** binary file ********/
+//* 二进制日志文件, 用 log_what_decode 还原成与 file_log 相同的文本
+//* 文件头: "LOGWHAT\1" 之后是一串条目, 每个条目以一个字节的类型开头:
+//*   'S' 调用点: id, 行号, 文件名, 格式串 (首次使用前写入)
+//*   'T' 线程:   id, 线程名 (首次使用前写入)
+//*   'R' 记录:   调用点id, verbosity, 是否有前缀, 时间差(ms), uptime 差(ms),
+//*               线程id, 参数长度, 参数 (编码与 encode_arg 相同)
+//* 整数使用 LEB128 变长编码, 有符号数先做 zigzag, 字符串为 长度 + 字节
+#define BINARY_LOG_MAGIC "LOGWHAT\1"
+
+auto Add_binary_file(const char *path_in, FileMode filemode,
+                     Verbosity verbosity) -> bool;
+
+void binary_file_log(void *user_data, Message &message);
+void binary_file_flush(void *user_data);
+void binary_file_close(void *user_data);
+
 } // namespace what::Log
 
 #endif
\ No newline at end of file
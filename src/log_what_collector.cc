@@ -0,0 +1,36 @@
+//* log_what_collector: 把各个进程通过 Add_shm_sink() 写入共享内存的日志
+//* 按时间戳合并到一个文件, 收到 SIGINT 或 SIGTERM 时输出剩余的日志后退出,
+//* 已经没有进程使用时删除共享内存
+//* usage: log_what_collector <name> <output> [ring size]
+#include "log_what.hpp"
+#include <signal.h>
+
+using namespace what::Log;
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <name> <output> [ring size]\n", argv[0]);
+    return 1;
+  }
+  //* 在创建其他线程之前屏蔽, 由主线程 sigwait
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  Init(argc, argv);
+  Set_stderr_verbosity(Verbosity::VerbosityWARNING);
+  if (!Add_file(argv[2], FileMode::Append, Verbosity::VerbosityMESSAGE)) {
+    return 1;
+  }
+  size_t ring_size = argc > 3 ? strtoul(argv[3], nullptr, 0) : SHM_RING_SIZE;
+  if (!Start_shm_collector(argv[1], ring_size)) {
+    return 1;
+  }
+
+  int signal_number;
+  sigwait(&signals, &signal_number);
+  Stop_shm_collector(true);
+  return 0;
+}
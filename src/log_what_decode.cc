@@ -0,0 +1,198 @@
+//* log_what_decode: 把 Add_binary_file() 写出的二进制日志还原成文本
+//* usage: log_what_decode <binary log> [output]
+#include "log_what.hpp"
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace what::Log;
+
+namespace {
+
+//* file 指向 interned 中的字符串: format_prefix() 按 (file 指针, line) 缓存文件名片段,
+//* 同一个指针必须一直对应同一个文件名
+struct Site {
+  unsigned int line{0};
+  const char *file{""};
+  std::string format;
+};
+
+class Reader {
+public:
+  Reader(const char *data, size_t size) : ptr(data), end(data + size) {}
+
+  auto Done() const -> bool { return ptr >= end; }
+
+  auto Ok() const -> bool { return ok; }
+
+  auto Byte() -> int {
+    if (ptr >= end) {
+      ok = false;
+      return 0;
+    }
+    return static_cast<unsigned char>(*ptr++);
+  }
+
+  auto Varint() -> uint64_t {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      auto byte = Byte();
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) {
+        break;
+      }
+    }
+    return value;
+  }
+
+  auto Signed_varint() -> int64_t {
+    auto value = Varint();
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+  }
+
+  auto Bytes(size_t len) -> const char * {
+    if (static_cast<size_t>(end - ptr) < len) {
+      ok = false;
+      ptr = end;
+      return nullptr;
+    }
+    auto data = ptr;
+    ptr += len;
+    return data;
+  }
+
+  auto String() -> std::string {
+    auto len = Varint();
+    auto data = Bytes(len);
+    return data ? std::string(data, len) : std::string();
+  }
+
+  //* 文件头可能出现多次(追加模式), 遇到时重置字典
+  auto Magic() -> bool {
+    auto len = sizeof(BINARY_LOG_MAGIC) - 1;
+    if (static_cast<size_t>(end - ptr) >= len &&
+        memcmp(ptr, BINARY_LOG_MAGIC, len) == 0) {
+      ptr += len;
+      return true;
+    }
+    return false;
+  }
+
+private:
+  const char *ptr;
+  const char *end;
+  bool ok{true};
+};
+
+auto read_file(const char *path, std::vector<char> &data) -> bool {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+  char buffer[64 * 1024];
+  size_t bytes;
+  while ((bytes = fread(buffer, 1, sizeof buffer, file)) > 0) {
+    data.insert(data.end(), buffer, buffer + bytes);
+  }
+  fclose(file);
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <binary log> [output]\n", argv[0]);
+    return 1;
+  }
+  std::vector<char> data;
+  if (!read_file(argv[1], data)) {
+    fprintf(stderr, "failed to open file: %s\n", argv[1]);
+    return 1;
+  }
+  FILE *out = argc > 2 ? fopen(argv[2], "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "failed to open file: %s\n", argv[2]);
+    return 1;
+  }
+
+  Reader reader(data.data(), data.size());
+  if (!reader.Magic()) {
+    fprintf(stderr, "%s is not a log_what binary log\n", argv[1]);
+    return 1;
+  }
+
+  std::vector<Site> sites;
+  std::set<std::string> interned; //* 不随文件头清空
+  std::vector<std::string> threads;
+  long ms_since_epoch = 0;
+  long uptime_ms = 0;
+  std::vector<char> text(16 * 1024);
+  char prefix[PREFIX_WIDTH];
+
+  while (!reader.Done() && reader.Ok()) {
+    if (reader.Magic()) {
+      sites.clear();
+      threads.clear();
+      ms_since_epoch = 0;
+      uptime_ms = 0;
+      continue;
+    }
+    auto type = reader.Byte();
+    if (type == 'S') {
+      auto id = reader.Varint();
+      Site site;
+      site.line = static_cast<unsigned int>(reader.Varint());
+      site.file = interned.insert(reader.String()).first->c_str();
+      site.format = reader.String();
+      if (id >= sites.size()) {
+        sites.resize(id + 1);
+      }
+      sites[id] = std::move(site);
+    } else if (type == 'T') {
+      auto id = reader.Varint();
+      if (id >= threads.size()) {
+        threads.resize(id + 1);
+      }
+      threads[id] = reader.String();
+    } else if (type == 'R') {
+      auto site_id = reader.Varint();
+      auto verbosity = static_cast<Verbosity>(reader.Signed_varint());
+      bool with_prefix = reader.Byte() != 0;
+      ms_since_epoch += reader.Signed_varint();
+      uptime_ms += reader.Signed_varint();
+      auto thread_id = reader.Varint();
+      auto args_size = reader.Varint();
+      auto args = reader.Bytes(args_size);
+      if (!reader.Ok() || site_id >= sites.size() ||
+          thread_id >= threads.size()) {
+        break;
+      }
+      auto &site = sites[site_id];
+      auto bytes = format_deferred(site.format.c_str(), args, args_size,
+                                   text.data(), text.size());
+      if (bytes >= text.size()) {
+        text.resize(bytes + 1);
+        format_deferred(site.format.c_str(), args, args_size, text.data(),
+                        text.size());
+      }
+      if (with_prefix) {
+        format_prefix(prefix, sizeof prefix, verbosity, site.file, site.line,
+                      ms_since_epoch, uptime_ms, threads[thread_id].c_str());
+      } else {
+        prefix[0] = '\0';
+      }
+      fprintf(out, "%s%s\n", prefix, text.data());
+    } else {
+      fprintf(stderr, "unknown entry type: %d\n", type);
+      return 1;
+    }
+  }
+  if (!reader.Ok()) {
+    fprintf(stderr, "%s is truncated\n", argv[1]);
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+  return reader.Ok() ? 0 : 1;
+}
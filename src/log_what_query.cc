@@ -0,0 +1,376 @@
+//* log_what_query: 按时间和级别查询 Add_indexed_file() 写出的日志
+//* 通过 path.idx 二分查找起始块, 跳过不含所需级别的块, 只读取需要的部分;
+//* 没有索引时扫描整个文件
+//* usage: log_what_query <log> [--from=TIME] [--to=TIME] [--level=LEVEL]
+//*                             [--grep=TEXT]
+//* TIME 为 "YYYY-mm-dd HH:MM:SS[.mmm]"(本地时间, 与日志前缀相同)或毫秒时间戳,
+//* LEVEL 与 -v 相同, 输出不高于它的日志
+#include "log_what.hpp"
+#include <algorithm>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace what::Log;
+
+namespace {
+
+//* "2024-02-10 12:15:35.000" 的长度
+#define DATE_TIME_WIDTH 23
+
+class MappedFile {
+public:
+  MappedFile(const MappedFile &) = delete;
+  auto operator=(const MappedFile &) -> MappedFile & = delete;
+
+  MappedFile() = default;
+
+  ~MappedFile() {
+    if (data != MAP_FAILED && size > 0) {
+      munmap(data, size);
+    }
+  }
+
+  auto Open(const char *path) -> bool {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      size = st.st_size;
+      data = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                      : nullptr;
+    }
+    close(fd);
+    return data != MAP_FAILED;
+  }
+
+  auto Data() const -> const char * { return static_cast<const char *>(data); }
+
+  auto Size() const -> size_t { return size; }
+
+private:
+  void *data{MAP_FAILED};
+  size_t size{0};
+};
+
+//* 需要扫描的一段日志, 索引之外的部分(已有内容, 未写满的块)时间和级别未知
+struct Range {
+  uint64_t begin;
+  uint64_t end;
+  int64_t min_ms;
+  int64_t max_ms; //* 单调不减
+  uint32_t levels;
+};
+
+struct Query {
+  int64_t from_ms{INT64_MIN};
+  int64_t to_ms{INT64_MAX};
+  int max_verbosity{static_cast<int>(Verbosity::VerbosityMESSAGE)};
+  std::string needle;
+};
+
+//* 先用 SIMD 比较首尾两个字节, 只对候选位置做 memcmp
+auto find_text(const char *begin, const char *end, const std::string &needle)
+    -> const char * {
+  auto n = needle.size();
+  if (static_cast<size_t>(end - begin) < n) {
+    return nullptr;
+  }
+  if (n == 1) {
+    return static_cast<const char *>(memchr(begin, needle[0], end - begin));
+  }
+  auto p = begin;
+#if defined(__SSE2__)
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[n - 1]);
+  for (; p + n - 1 + 16 <= end; p += 16) {
+    auto head = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    auto tail = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + n - 1));
+    auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last))));
+    while (mask) {
+      auto bit = __builtin_ctz(mask);
+      if (memcmp(p + bit + 1, needle.data() + 1, n - 2) == 0) {
+        return p + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+  return static_cast<const char *>(memmem(p, end - p, needle.data(), n));
+}
+
+auto parse_digits(const char *text, int count, int &value) -> bool {
+  value = 0;
+  for (int i = 0; i < count; ++i) {
+    if (text[i] < '0' || text[i] > '9') {
+      return false;
+    }
+    value = value * 10 + (text[i] - '0');
+  }
+  return true;
+}
+
+//* 解析 "YYYY-mm-dd HH:MM:SS", 同一秒内的日志只调用一次 mktime
+auto parse_seconds(const char *text, int64_t &seconds) -> bool {
+  static char cached[DATE_TIME_WIDTH];
+  static int64_t cached_seconds = -1;
+  if (cached_seconds != -1 && memcmp(text, cached, 19) == 0) {
+    seconds = cached_seconds;
+    return true;
+  }
+  tm time_info{};
+  if (!parse_digits(text, 4, time_info.tm_year) || text[4] != '-' ||
+      !parse_digits(text + 5, 2, time_info.tm_mon) || text[7] != '-' ||
+      !parse_digits(text + 8, 2, time_info.tm_mday) || text[10] != ' ' ||
+      !parse_digits(text + 11, 2, time_info.tm_hour) || text[13] != ':' ||
+      !parse_digits(text + 14, 2, time_info.tm_min) || text[16] != ':' ||
+      !parse_digits(text + 17, 2, time_info.tm_sec)) {
+    return false;
+  }
+  time_info.tm_year -= 1900;
+  time_info.tm_mon -= 1;
+  time_info.tm_isdst = -1;
+  seconds = mktime(&time_info);
+  memcpy(cached, text, 19);
+  cached_seconds = seconds;
+  return true;
+}
+
+auto parse_time(const char *text, int64_t &ms) -> bool {
+  auto len = strlen(text);
+  if (len > 0 && strspn(text, "0123456789") == len) {
+    ms = strtoll(text, nullptr, 10);
+    return true;
+  }
+  int64_t seconds;
+  int millis = 0;
+  if (len < 19 || !parse_seconds(text, seconds) ||
+      (len > 19 && (text[19] != '.' || len != DATE_TIME_WIDTH ||
+                    !parse_digits(text + 20, 3, millis)))) {
+    return false;
+  }
+  ms = seconds * 1000 + millis;
+  return true;
+}
+
+auto parse_level(const char *text, int &verbosity) -> bool {
+  static const std::pair<const char *, Verbosity> names[] = {
+      {"FATAL", Verbosity::VerbosityFATAL},
+      {"ERROR", Verbosity::VerbosityERROR},
+      {"WARNING", Verbosity::VerbosityWARNING},
+      {"INFO", Verbosity::VerbosityINFO},
+      {"MESSAGE", Verbosity::VerbosityMESSAGE},
+  };
+  for (auto &[name, level] : names) {
+    if (strcmp(text, name) == 0 ||
+        strcmp(text, get_verbosity_name(level)) == 0) {
+      verbosity = static_cast<int>(level);
+      return true;
+    }
+  }
+  char *end;
+  verbosity = static_cast<int>(strtol(text, &end, 10));
+  return *text && !*end;
+}
+
+//* 一条日志的时间和级别; 不是日志开头的行(调用栈, raw_log)沿用上一条的
+struct Record {
+  bool known{false};
+  int64_t ms{0};
+  int verbosity{0};
+};
+
+auto parse_header(const char *line, const char *end, Record &record) -> bool {
+  int64_t seconds;
+  int millis;
+  if (end - line < DATE_TIME_WIDTH || line[19] != '.' ||
+      !parse_digits(line + 20, 3, millis) || !parse_seconds(line, seconds)) {
+    return false;
+  }
+  //* 级别在前缀末尾的 "| " 之前, 右对齐
+  std::string separator = "| ";
+  auto bar = find_text(line + DATE_TIME_WIDTH, end, separator);
+  if (!bar) {
+    return false;
+  }
+  auto name_begin = bar;
+  while (name_begin > line && name_begin[-1] != ' ') {
+    --name_begin;
+  }
+  std::string name(name_begin, bar);
+  int verbosity;
+  if (!parse_level(name.c_str(), verbosity)) {
+    return false;
+  }
+  record = Record{true, seconds * 1000 + millis, verbosity};
+  return true;
+}
+
+auto matches(const Query &query, const Record &record) -> bool {
+  return !record.known ||
+         (record.ms >= query.from_ms && record.ms <= query.to_ms &&
+          record.verbosity <= query.max_verbosity);
+}
+
+auto line_end(const char *line, const char *end) -> const char * {
+  auto newline = static_cast<const char *>(memchr(line, '\n', end - line));
+  return newline ? newline : end;
+}
+
+void print_line(const char *line, const char *end) {
+  fwrite(line, 1, end - line, stdout);
+  fputc('\n', stdout);
+}
+
+//* 没有 --grep 时逐行扫描
+void scan_lines(const char *begin, const char *end, const Query &query) {
+  Record record;
+  for (auto line = begin; line < end;) {
+    auto next = line_end(line, end);
+    parse_header(line, next, record);
+    if (matches(query, record)) {
+      print_line(line, next);
+    }
+    line = next + 1;
+  }
+}
+
+//* 有 --grep 时先在整段中查找, 只为命中的行向前找所属日志的开头
+void grep_lines(const char *begin, const char *end, const Query &query) {
+  for (auto pos = begin; pos < end;) {
+    auto hit = find_text(pos, end, query.needle);
+    if (!hit) {
+      return;
+    }
+    auto line = hit;
+    while (line > begin && line[-1] != '\n') {
+      --line;
+    }
+    auto next = line_end(hit, end);
+    Record record;
+    for (auto header = line;
+         !parse_header(header, line_end(header, end), record);) {
+      if (header == begin) {
+        break;
+      }
+      --header;
+      while (header > begin && header[-1] != '\n') {
+        --header;
+      }
+    }
+    if (matches(query, record)) {
+      print_line(line, next);
+    }
+    pos = next + 1;
+  }
+}
+
+auto load_ranges(const MappedFile &log, const MappedFile &index)
+    -> std::vector<Range> {
+  std::vector<Range> ranges;
+  const size_t magic_len = sizeof(LOG_INDEX_MAGIC) - 1;
+  uint64_t cursor = 0;
+  if (index.Size() >= magic_len &&
+      memcmp(index.Data(), LOG_INDEX_MAGIC, magic_len) == 0) {
+    auto count = (index.Size() - magic_len) / sizeof(IndexBlock);
+    for (size_t i = 0; i < count; ++i) {
+      IndexBlock block;
+      memcpy(&block, index.Data() + magic_len + i * sizeof block, sizeof block);
+      auto begin = std::min<uint64_t>(block.offset, log.Size());
+      auto end = std::min<uint64_t>(block.offset + block.length, log.Size());
+      if (begin > cursor) { //* 进程崩溃时没有写入索引的块
+        ranges.push_back(Range{cursor, begin, INT64_MIN, block.max_ms,
+                               UINT32_MAX});
+      }
+      if (end > begin) {
+        ranges.push_back(
+            Range{begin, end, block.min_ms, block.max_ms, block.levels});
+      }
+      cursor = std::max(cursor, end);
+    }
+  }
+  if (cursor < log.Size()) {
+    ranges.push_back(
+        Range{cursor, log.Size(), INT64_MIN, INT64_MAX, UINT32_MAX});
+  }
+  return ranges;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "usage: %s <log> [--from=TIME] [--to=TIME] [--level=LEVEL] "
+            "[--grep=TEXT]\n",
+            argv[0]);
+    return 1;
+  }
+  Query query;
+  for (int i = 2; i < argc; ++i) {
+    auto arg = argv[i];
+    bool ok = true;
+    if (strncmp(arg, "--from=", 7) == 0) {
+      ok = parse_time(arg + 7, query.from_ms);
+    } else if (strncmp(arg, "--to=", 5) == 0) {
+      ok = parse_time(arg + 5, query.to_ms);
+    } else if (strncmp(arg, "--level=", 8) == 0) {
+      ok = parse_level(arg + 8, query.max_verbosity);
+    } else if (strncmp(arg, "--grep=", 7) == 0) {
+      query.needle = arg + 7;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, "bad argument: %s\n", arg);
+      return 1;
+    }
+  }
+
+  MappedFile log;
+  if (!log.Open(argv[1])) {
+    fprintf(stderr, "failed to open file: %s\n", argv[1]);
+    return 1;
+  }
+  MappedFile index;
+  std::string index_path = std::string(argv[1]) + ".idx";
+  if (!index.Open(index_path.c_str())) {
+    fprintf(stderr, "%s not found, scanning the whole file\n",
+            index_path.c_str());
+  }
+  auto ranges = load_ranges(log, index);
+
+  const int fatal = static_cast<int>(Verbosity::VerbosityFATAL);
+  uint32_t levels = 0;
+  for (int v = fatal; v <= std::min(query.max_verbosity, fatal + 31); ++v) {
+    levels |= 1u << (v - fatal);
+  }
+  //* 第一个可能包含 from 之后日志的块, 块之前未索引的部分与它的 max_ms 相同
+  auto it = std::partition_point(
+      ranges.begin(), ranges.end(),
+      [&](const Range &range) { return range.max_ms < query.from_ms; });
+  for (; it != ranges.end(); ++it) {
+    if (it->min_ms > query.to_ms || !(it->levels & levels)) {
+      continue;
+    }
+    auto begin = log.Data() + it->begin;
+    auto end = log.Data() + it->end;
+    madvise(const_cast<char *>(begin) - (it->begin % getpagesize()),
+            end - begin + (it->begin % getpagesize()), MADV_SEQUENTIAL);
+    if (query.needle.empty()) {
+      scan_lines(begin, end, query);
+    } else {
+      grep_lines(begin, end, query);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,395 @@
+//* log_test: 同步和异步模式下的输出顺序, 编译期格式化和延迟格式化与 snprintf 一致,
+//* 二进制日志经 log_what_decode 还原后与文本日志相同, 稳态下 LOG() 没有堆分配
+//* usage: log_test <log_what_decode> <work dir>
+#include "log_what.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace what::Log;
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT(condition)                                                      \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "%s:%d: EXPECT(%s) failed\n", __FILE__, __LINE__,        \
+              #condition);                                                     \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (0)
+
+//* 收集 callback 收到的消息文本
+class Capture {
+public:
+  static void Log(void *user_data, Message &message) {
+    auto capture = reinterpret_cast<Capture *>(user_data);
+    std::lock_guard<std::mutex> lock(capture->mutex);
+    capture->lines.emplace_back(message.raw_message);
+  }
+
+  auto Take() -> std::vector<std::string> {
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::move(lines);
+  }
+
+private:
+  std::mutex mutex;
+  std::vector<std::string> lines;
+};
+
+//* 同一组参数分别交给 snprintf, format_checked, render_checked 和 format_deferred
+template <typename Format, typename... Args>
+void expect_format(int line, Args... args) {
+  char expected[256];
+  auto expected_len =
+      snprintf(expected, sizeof expected, Format::Text(), args...);
+
+  char checked[256];
+  auto checked_len = format_checked<Format>(checked, sizeof checked, args...);
+
+  std::vector<char> encoded((arg_size(args) + ... + size_t(1)));
+  char *buffer = encoded.data();
+  (encode_arg(buffer, args), ...);
+  auto encoded_size = static_cast<size_t>(buffer - encoded.data());
+
+  char rendered[256];
+  auto rendered_len = render_checked<Format, Args...>(
+      Format::Text(), encoded.data(), encoded_size, rendered, sizeof rendered);
+
+  char deferred[256];
+  auto deferred_len = format_deferred(Format::Text(), encoded.data(),
+                                      encoded_size, deferred, sizeof deferred);
+
+  //* 截断时返回完整的长度, 输出以 '\0' 结尾
+  char small[5];
+  auto small_len = format_checked<Format>(small, sizeof small, args...);
+  auto small_expected = std::string(expected).substr(0, sizeof small - 1);
+
+  for (auto [name, text, len] :
+       {std::make_tuple("format_checked", checked, checked_len),
+        std::make_tuple("render_checked", rendered, rendered_len),
+        std::make_tuple("format_deferred", deferred, deferred_len)}) {
+    if (len != static_cast<size_t>(expected_len) || strcmp(text, expected)) {
+      fprintf(stderr, "%s:%d: %s(\"%s\") gave \"%s\", snprintf gave \"%s\"\n",
+              __FILE__, line, name, Format::Text(), text, expected);
+      ++failures;
+    }
+  }
+  if (small_len != static_cast<size_t>(expected_len) ||
+      small != small_expected) {
+    fprintf(stderr, "%s:%d: truncated format_checked(\"%s\") gave \"%s\"\n",
+            __FILE__, line, Format::Text(), small);
+    ++failures;
+  }
+}
+
+#define EXPECT_FORMAT(format, ...)                                             \
+  do {                                                                         \
+    struct test_format {                                                       \
+      static constexpr auto Text() -> const char * { return format; }          \
+    };                                                                         \
+    expect_format<test_format>(__LINE__, ##__VA_ARGS__);                       \
+  } while (0)
+
+void test_format() {
+  EXPECT_FORMAT("plain text");
+  EXPECT_FORMAT("100%% %d%%", 42);
+  EXPECT_FORMAT("%d|%i|%u|%x|%X|%o", -42, 7, -1, 0xbeef, 0xbeef, 8);
+  EXPECT_FORMAT("%hd|%hhx|%hu", 70000, 0x1ff, -1);
+  EXPECT_FORMAT("%hhd|%hhu|%hx|%5hd|%-4hhu|", 200, -1, 0x12345, 70000, 0x1ff);
+  EXPECT_FORMAT("%ld|%lld|%lu|%zu|%lx", -5L, -6LL, 7UL, sizeof(long), -1L);
+  EXPECT_FORMAT("%+d|%05d|% d|%#x|%-6d|%6d", 1, -2, 3, 4, 5, 6);
+  EXPECT_FORMAT("%s|%5s|%-5s|%.2s|", "abc", "ab", "ab", "abc");
+  EXPECT_FORMAT("%*s|%-*.*s|%.*s", 4, "a", 5, 2, "xyz", 1, "pq");
+  EXPECT_FORMAT("%*d|%.*f", -4, 7, 2, 3.14159);
+  EXPECT_FORMAT("%c%c%c", 'o', 'k', '!');
+  EXPECT_FORMAT("%f|%.3e|%g|%10.4f|%Lf", 1.5, 12345.678, 0.0001, -2.25,
+                3.25L);
+  const unsigned char bytes[] = "unsigned";
+  const signed char chars[] = "signed";
+  EXPECT_FORMAT("%s %s", bytes, chars);
+  int value = 0;
+  EXPECT_FORMAT("%p %p", static_cast<void *>(&value),
+                static_cast<void *>(nullptr));
+
+  //* 与 glibc 相同, 空指针输出为 "(null)"
+  struct null_format {
+    static constexpr auto Text() -> const char * { return "%s and %.3s"; }
+  };
+  char text[32];
+  const char *null_string = nullptr;
+  format_checked<null_format>(text, sizeof text, null_string, null_string);
+  EXPECT(strcmp(text, "(null) and (nu") == 0);
+}
+
+void test_sync_order() {
+  Capture capture;
+  add_callBack(&capture, Capture::Log, nullptr, nullptr,
+               Verbosity::VerbosityINFO);
+  for (int i = 0; i < 1000; ++i) {
+    LOG(INFO, "order %d", i);
+  }
+  remove_callBack(&capture);
+  auto lines = capture.Take();
+  EXPECT(lines.size() == 1000);
+  for (size_t i = 0; i < lines.size(); ++i) {
+    EXPECT(lines[i] == "order " + std::to_string(i));
+  }
+}
+
+//* 每个线程内的日志保持调用顺序, 队列满时生产者等待而不是丢弃
+void test_async_order() {
+  constexpr int threads = 4;
+  constexpr int messages = 5000;
+  Capture capture;
+  add_callBack(&capture, Capture::Log, nullptr, nullptr,
+               Verbosity::VerbosityINFO);
+  EXPECT(Start_async(256));
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([t] {
+      for (int i = 0; i < messages; ++i) {
+        LOG(INFO, "thread %d seq %d", t, i);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  Stop_async();
+  remove_callBack(&capture);
+
+  auto lines = capture.Take();
+  EXPECT(lines.size() == threads * messages);
+  int next[threads] = {};
+  for (auto &line : lines) {
+    int t = -1, seq = -1;
+    if (sscanf(line.c_str(), "thread %d seq %d", &t, &seq) != 2 || t < 0 ||
+        t >= threads) {
+      EXPECT(!"unexpected line");
+      continue;
+    }
+    EXPECT(seq == next[t]);
+    next[t] = seq + 1;
+  }
+}
+
+//* 多个线程同时 Start_async() 和 Stop_async(): 只有一个负责停止, 日志不丢失
+void test_async_start_stop() {
+  Capture capture;
+  add_callBack(&capture, Capture::Log, nullptr, nullptr,
+               Verbosity::VerbosityINFO);
+  constexpr int rounds = 50;
+  for (int round = 0; round < rounds; ++round) {
+    std::vector<std::thread> controllers;
+    for (int t = 0; t < 3; ++t) {
+      controllers.emplace_back([] { Start_async(64); });
+    }
+    for (auto &controller : controllers) {
+      controller.join();
+    }
+    controllers.clear();
+    LOG(INFO, "round %d", round);
+    for (int t = 0; t < 3; ++t) {
+      controllers.emplace_back([] { Stop_async(); });
+    }
+    for (auto &controller : controllers) {
+      controller.join();
+    }
+  }
+  remove_callBack(&capture);
+  auto lines = capture.Take();
+  EXPECT(lines.size() == rounds);
+  for (size_t i = 0; i < lines.size(); ++i) {
+    EXPECT(lines[i] == "round " + std::to_string(i));
+  }
+}
+
+//* 限流的放行次数, 以及过了汇总周期之后 Report_suppressed() 不会在
+//* 输出汇总时重入自己(曾经在这里死锁, exit() 也会调用它)
+void test_rate_limit() {
+  Capture capture;
+  add_callBack(&capture, Capture::Log, nullptr, nullptr,
+               Verbosity::VerbosityINFO);
+  for (int i = 0; i < 10; ++i) {
+    LOG_EVERY_N(INFO, 5, "every %d", i);
+    LOG_FIRST_N(INFO, 3, "first %d", i);
+    LOG_EVERY_MS(INFO, 60000, "ms %d", i);
+    LOG_EVERY_N(INFO, 0, "never %d", i);
+  }
+  auto lines = capture.Take();
+  std::vector<std::string> expected = {"every 0", "first 0", "ms 0",
+                                       "first 1", "first 2", "every 5"};
+  EXPECT(lines == expected);
+
+  //* 第一次检查只设置汇总时间, 之后它已经过期
+  std::this_thread::sleep_for(std::chrono::milliseconds(5200));
+  auto report = std::async(std::launch::async, [] { Report_suppressed(); });
+  if (report.wait_for(std::chrono::seconds(5)) != std::future_status::ready) {
+    fprintf(stderr, "Report_suppressed() did not return\n");
+    std::_Exit(1);
+  }
+  remove_callBack(&capture);
+  lines = capture.Take();
+  for (auto summary : {"suppressed 8 messages (8 in total)",
+                       "suppressed 7 messages (7 in total)",
+                       "suppressed 9 messages (9 in total)",
+                       "suppressed 10 messages (10 in total)"}) {
+    EXPECT(std::count(lines.begin(), lines.end(), summary) == 1);
+  }
+  EXPECT(lines.size() == 4);
+}
+
+//* 递归得足够深, 让 backtrace() 抓满 MAX_STACK_FRAMES
+__attribute__((noinline)) int log_stacktrace_at_depth(int depth) {
+  if (depth == 0) {
+    LOG_STACKTRACE(INFO, "deep");
+    return 0;
+  }
+  volatile int keep_frame = log_stacktrace_at_depth(depth - 1);
+  return keep_frame + 1;
+}
+
+//* 调用栈超过 MAX_STACK_FRAMES 时标出 [truncated], 浅的调用栈不会
+void test_stacktrace_truncation(bool async) {
+  Capture capture;
+  add_callBack(&capture, Capture::Log, nullptr, nullptr,
+               Verbosity::VerbosityINFO);
+  if (async) {
+    EXPECT(Start_async(64));
+  }
+  LOG_STACKTRACE(INFO, "shallow");
+  log_stacktrace_at_depth(200);
+  if (async) {
+    Stop_async();
+  }
+  remove_callBack(&capture);
+  auto lines = capture.Take();
+  EXPECT(lines.size() == 2);
+  if (lines.size() == 2) {
+    EXPECT(lines[0].find("shallow\nStack Trace:\n") == 0);
+    EXPECT(lines[0].find("[truncated]") == std::string::npos);
+    EXPECT(lines[1].find("deep\nStack Trace:\n[truncated]\n") == 0);
+  }
+}
+
+void ignore_message(void *, Message &) {}
+
+//* 预热之后(内存池, 线程名缓存, 调用点注册)再写日志不再分配
+void test_steady_allocations(bool async) {
+  add_callBack(reinterpret_cast<void *>(&ignore_message), ignore_message,
+               nullptr, nullptr, Verbosity::VerbosityINFO);
+  if (async) {
+    EXPECT(Start_async(1024));
+  }
+  auto log_some = [] {
+    for (int i = 0; i < 2000; ++i) {
+      LOG(INFO, "steady %d %s %.2f", i, "payload", i * 0.5);
+    }
+    flush();
+  };
+  log_some();
+  auto before = allocation_count();
+  log_some();
+  auto after = allocation_count();
+  if (after != before) {
+    fprintf(stderr, "%s: %lu allocations in steady state\n",
+            async ? "async" : "sync", after - before);
+    ++failures;
+  }
+  if (async) {
+    Stop_async();
+  }
+  remove_callBack(reinterpret_cast<void *>(&ignore_message));
+}
+
+auto read_lines(const std::string &path) -> std::vector<std::string> {
+  std::vector<std::string> lines;
+  FILE *file = fopen(path.c_str(), "r");
+  if (!file) {
+    return lines;
+  }
+  char buffer[4096];
+  while (fgets(buffer, sizeof buffer, file)) {
+    lines.emplace_back(buffer);
+  }
+  fclose(file);
+  return lines;
+}
+
+//* 同一批日志同时写入文本文件和二进制文件, 还原后应当逐行相同;
+//* 文件 sink 无法移除, 所以放在最后
+void test_binary_round_trip(const char *decoder, const std::string &dir) {
+  auto text_path = dir + "/log_test.log";
+  auto binary_path = dir + "/log_test.bin";
+  auto decoded_path = dir + "/log_test.decoded";
+  EXPECT(Add_file(text_path.c_str(), FileMode::Truncate,
+                  Verbosity::VerbosityINFO));
+  EXPECT(Add_binary_file(binary_path.c_str(), FileMode::Truncate,
+                         Verbosity::VerbosityINFO));
+  Set_thread_name("round_trip");
+  EXPECT(Start_async(1024));
+  for (int i = 0; i < 100; ++i) {
+    LOG(INFO, "round trip %d %s %hx %.3f %c", i, "text", 0x12345, i / 3.0,
+        'z');
+    LOG(WARNING, "%-6s|%*d|%lld", "left", 5, -i, -1234567890123LL);
+  }
+  std::string runtime = "runtime format %d";
+  LOG(INFO, runtime.c_str(), 7);
+  Stop_async();
+  flush();
+
+  auto command = std::string(decoder) + " " + binary_path + " " + decoded_path;
+  EXPECT(system(command.c_str()) == 0);
+  auto expected = read_lines(text_path);
+  auto decoded = read_lines(decoded_path);
+  EXPECT(expected.size() == 201);
+  EXPECT(decoded.size() == expected.size());
+  for (size_t i = 0; i < expected.size() && i < decoded.size(); ++i) {
+    if (decoded[i] != expected[i]) {
+      fprintf(stderr, "line %zu differs:\n  text:    %s  decoded: %s", i,
+              expected[i].c_str(), decoded[i].c_str());
+      ++failures;
+      break;
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <log_what_decode> <work dir>\n", argv[0]);
+    return 1;
+  }
+  Init(argc, argv);
+  //* 比 FATAL 更低的级别: stderr 不再输出任何日志
+  Set_stderr_verbosity(
+      static_cast<Verbosity>(static_cast<int>(Verbosity::VerbosityFATAL) - 1));
+
+  test_format();
+  test_sync_order();
+  test_rate_limit();
+  test_stacktrace_truncation(false);
+  test_steady_allocations(false);
+  Set_deferred(true);
+  test_async_order();
+  test_async_start_stop();
+  test_stacktrace_truncation(true);
+  test_steady_allocations(true);
+  test_binary_round_trip(argv[1], argv[2]);
+
+  if (failures) {
+    fprintf(stderr, "%d failures\n", failures);
+    return 1;
+  }
+  fprintf(stderr, "all tests passed\n");
+  return 0;
+}